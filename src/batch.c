@@ -0,0 +1,153 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** batch.c
+ *
+ *  Builds many packages in one process from a manifest, see upk_batch().
+ *  A line may also name a build manifest (see manifest.c) for packages
+ *  whose images live in directories of their own.
+ *  All writers share one crc_cache_t, so an image used by twenty
+ *  packages is read and hashed once and then only copied twenty times,
+ *  by the kernel and out of the same page cache.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <libgen.h>
+#include "upk.h"
+#include "stream.h"
+
+#define BATCH_MAXARGS  (UPK_MAX_IMAGES + 5)
+
+typedef struct batch_job {
+  upk_writer_t *w;
+  char         *package;
+  int           line;
+  int           ret;
+} batch_job_t;
+
+static void batch_run(void *arg)
+{
+  batch_job_t *job = arg;
+
+  job->ret = 0;
+  if(job->package && upk_writer_write(job->w, job->package) != 0)
+    job->ret = -1;
+  if(upk_writer_write_variants(job->w) != 0)
+    job->ret = -1;
+}
+
+int upk_batch(const char *manifest, int copy_flags, pool_t *pool,
+	      crc_cache_t *cache, upk_stats_t *stats, memo_t *memo)
+{
+  FILE *fp;
+  char *line = NULL, *copy, *dir, *argv[BATCH_MAXARGS], path[PATH_MAX];
+  const char *package;
+  size_t cap = 0;
+  int argc, lineno = 0, njobs = 0, failed = 0, i;
+  batch_job_t *jobs = NULL, *job;
+  crc_cache_t *own = NULL;
+  pool_group_t grp = POOL_GROUP_INIT;
+
+  if((fp = fopen(manifest, "r")) == NULL)
+    {
+      printf("Can't open manifest: %s\n", manifest);
+      return(-1);
+    }
+  if(cache == NULL)
+    cache = own = crc_cache_new();
+  if((copy = strdup(manifest)) == NULL || cache == NULL)
+    {
+      crc_cache_free(own);
+      free(copy);
+      fclose(fp);
+      return(-1);
+    }
+  dir = dirname(copy);
+
+  while(getline(&line, &cap, fp) > 0)
+    {
+      lineno++;
+      if((argc = upk_split_line(line, argv, BATCH_MAXARGS)) == 0)
+	continue;
+      if((job = realloc(jobs, (njobs + 1) * sizeof(*jobs))) == NULL)
+	{
+	  failed++;
+	  break;
+	}
+      jobs = job;
+      job = &jobs[njobs];
+      job->line = lineno;
+      job->ret  = -1;
+      job->package = NULL;
+      if((job->w = upk_writer_new()) == NULL)
+	{
+	  failed++;
+	  break;
+	}
+      njobs++;
+      if(argc == 1)
+	{
+	  /* a build manifest, relative to this one */
+	  if(argv[0][0] == '/')
+	    snprintf(path, sizeof(path), "%s", argv[0]);
+	  else
+	    snprintf(path, sizeof(path), "%s/%s", dir, argv[0]);
+	  if(upk_writer_load(job->w, path, &package) != 0 ||
+	     (package && (job->package = strdup(package)) == NULL))
+	    {
+	      printf("%s:%d: bad build manifest\n", manifest, lineno);
+	      goto bad;
+	    }
+	}
+      else if(argc < 0 || upk_writer_args(job->w, argc, argv, &package) != 0 ||
+	 upk_writer_set_dir(job->w, dir) != 0 ||
+	 (job->package = strdup(package)) == NULL)
+	{
+	  printf("%s:%d: bad package line\n", manifest, lineno);
+	  goto bad;
+	}
+      upk_writer_set_copy(job->w, copy_flags, pool);
+      upk_writer_set_cache(job->w, cache);
+      upk_writer_set_stats(job->w, stats);
+      upk_writer_set_memo(job->w, memo);
+      continue;
+
+    bad:
+      /* counted as failed; the other lines are still built */
+      upk_writer_free(job->w);
+      free(job->package);
+      njobs--;
+      failed++;
+    }
+  free(line);
+  fclose(fp);
+
+  for(i = 0; i < njobs; i++)
+    pool_submit(pool, &grp, batch_run, &jobs[i]);
+  pool_wait(pool, &grp);
+  for(i = 0; i < njobs; i++)
+    if(jobs[i].ret != 0)
+      {
+	printf("%s:%d: building %s failed\n", manifest, jobs[i].line,
+	       jobs[i].package ? jobs[i].package : "its variants");
+	failed++;
+      }
+
+  for(i = 0; i < njobs; i++)
+    {
+      upk_writer_free(jobs[i].w);
+      free(jobs[i].package);
+    }
+  free(jobs);
+  crc_cache_free(own);
+  free(copy);
+  return failed;
+}
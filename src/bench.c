@@ -0,0 +1,354 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** bench.c
+ *
+ *  upk-bench: throughput of the hot paths, as one JSON document so runs
+ *  can be compared over time.
+ *
+ *    crc32      every crc kernel, 1 byte to 64M, aligned and not
+ *    crc_pool   stream_crc() of 64M on the pool
+ *    small      a package of one tiny image: the version files and
+ *               headers, per package
+ *    pack_*     whole packages from synthetic inputs (13M root.cramfs,
+ *               3M uImage, 200M programs tarball, MSP430 images) in a
+ *               scratch directory, best on tmpfs
+ *
+ *  The library's progress messages go to /dev/null, the results to
+ *  stdout (or -o FILE).
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "upk.h"
+#include "stream.h"
+
+#define BENCH_MAXLEN  (64 << 20)
+
+static const struct option long_opts[] = {
+  { "dir",     required_argument, NULL, 'd' },
+  { "threads", required_argument, NULL, 'j' },
+  { "output",  required_argument, NULL, 'o' },
+  { "quick",   no_argument, NULL, 'q' },
+  { "help",    no_argument, NULL, 'h' },
+  { NULL, 0, NULL, 0 }
+};
+
+static FILE  *out;
+static int    nresults;
+static double min_time = 0.25;  /* seconds each measurement runs for */
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* one entry of "results"; extra is more "key": value pairs, or "" */
+static void result(const char *name, const char *extra, double bytes,
+		   long iters, double secs)
+{
+  fprintf(out, "%s\n    { \"name\": \"%s\", %s%s\"bytes\": %.0f, \"iters\": %ld, "
+	  "\"seconds\": %.6f, \"ns_per_iter\": %.1f, \"gbps\": %.3f }",
+	  nresults++ ? "," : "", name, extra, extra[0] ? ", " : "",
+	  bytes, iters, secs, secs * 1e9 / iters, bytes * iters / secs / 1e9);
+}
+
+/* cheap reproducible filler */
+static void fill(uint8 *buf, size_t len, uint32 seed)
+{
+  uint32 x = seed | 1;
+  size_t i;
+
+  for(i = 0; i < len; i++)
+    {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      buf[i] = (uint8)x;
+    }
+}
+
+static void bench_crc(const uint8 *buf)
+{
+  static const size_t sizes[] = { 1, 16, 64, 256, 4096, 65536, 1 << 20, 16 << 20, 64 << 20 };
+  static const int aligns[] = { 0, 1, 3 };
+  char extra[128];
+  const char *kernel, *active = crc32_kernel_name(-1);
+  volatile unsigned long sink = 0;
+  double t0, t;
+  long iters;
+  int k, s, a;
+
+  for(k = 0; (kernel = crc32_kernel_name(k)) != NULL; k++)
+    {
+      if(crc32_set_kernel(kernel) != 0)
+	continue;
+      for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	for(a = 0; a < sizeof(aligns) / sizeof(aligns[0]); a++)
+	  {
+	    t0 = now();
+	    iters = 0;
+	    do
+	      {
+		sink += crc32(0, buf + aligns[a], sizes[s]);
+		iters++;
+	      }
+	    while((t = now() - t0) < min_time);
+	    snprintf(extra, sizeof(extra), "\"kernel\": \"%s\", \"align\": %d",
+		     kernel, aligns[a]);
+	    result("crc32", extra, sizes[s], iters, t);
+	  }
+    }
+  crc32_set_kernel(active);
+}
+
+static void bench_crc_pool(const uint8 *buf, pool_t *pool)
+{
+  char extra[64];
+  double t0, t;
+  long iters = 0;
+
+  t0 = now();
+  do
+    {
+      stream_crc(pool, 0, buf, BENCH_MAXLEN);
+      iters++;
+    }
+  while((t = now() - t0) < min_time);
+  snprintf(extra, sizeof(extra), "\"threads\": %d", pool ? pool_threads(pool) : 1);
+  result("crc_pool", extra, BENCH_MAXLEN, iters, t);
+}
+
+/* len bytes of filler, or text if not NULL */
+static int make_file(const char *dir, const char *name, size_t len,
+		     const char *text, uint32 seed)
+{
+  char path[PATH_MAX];
+  static uint8 buf[STREAM_BUFSIZE];
+  size_t n;
+  int fd;
+
+  if(snprintf(path, sizeof(path), "%s/%s", dir, name) >= sizeof(path) ||
+     (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    return -1;
+  if(text && stream_write_all(fd, text, strlen(text)) != 0)
+    {
+      close(fd);
+      return -1;
+    }
+  for(len = text ? 0 : len; len > 0; len -= n)
+    {
+      n = len < sizeof(buf) ? len : sizeof(buf);
+      fill(buf, n, seed++);
+      if(stream_write_all(fd, buf, n) != 0)
+	{
+	  close(fd);
+	  return -1;
+	}
+    }
+  return close(fd);
+}
+
+/* the package inputs; the versions are text as a build leaves it */
+static const struct {
+  const char *name;
+  size_t      len;
+  const char *text;
+} inputs[] = {
+  { "root.cramfs",        13 << 20 },   /* all a 16M board has room for */
+  { "uImage",             3 << 20 },
+  { "programs_0.tar.gz",  200 << 20 },
+  { "env.img",            1 },
+  { "hw1.bin",            32 << 10 },
+  { "hw2.bin",            8 << 10 },
+  { "u-boot.version",     0, "1.23-4.56-7.89\n" },
+  { "uImage.version",     0, "2.34-5.67-8.90\n" },
+  { "rootfs.version",     0, "3.45-6.78-9.01\n" },
+  { "extapp.version",     0, "4.56-7.89-0.12\n" },
+  { "hw1.version",        0, "1.02\n" },
+  { "hw2.version",        0, "3.04\n" },
+};
+
+#define NINPUTS  (sizeof(inputs) / sizeof(inputs[0]))
+
+/* a package built again and again from dir; returns 0 or -1 */
+static int bench_pack(const char *name, const char *dir, pool_t *pool,
+		      int flags, int hw, int nimages, const char *images[])
+{
+  upk_writer_t *w;
+  struct stat st;
+  char path[PATH_MAX];
+  double t0, t;
+  long iters = 0;
+  int i, ret = -1;
+
+  if((w = upk_writer_new()) == NULL)
+    return -1;
+  upk_writer_set_copy(w, flags, pool);
+  if(upk_writer_set_dir(w, dir) != 0 || upk_writer_set_desc(w, "bench") != 0 ||
+     (hw && upk_writer_set_hw(w, "hw1.bin", "hw2.bin") != 0))
+    goto out;
+  for(i = 0; i < nimages; i++)
+    if(upk_writer_add_image(w, images[i]) != 0)
+      goto out;
+
+  /* once to warm the page cache */
+  if(upk_writer_write(w, "bench.upk") != 0)
+    goto out;
+  t0 = now();
+  do
+    {
+      if(upk_writer_write(w, "bench.upk") != 0)
+	goto out;
+      iters++;
+    }
+  while((t = now() - t0) < min_time);
+
+  if(snprintf(path, sizeof(path), "%s/bench.upk", dir) >= sizeof(path) ||
+     stat(path, &st) != 0)
+    goto out;
+  unlink(path);
+  result(name, "", st.st_size, iters, t);
+  ret = 0;
+out:
+  upk_writer_free(w);
+  return ret;
+}
+
+static void usage(void)
+{
+  printf("usage: upk-bench [options]\n");
+  printf("  -d, --dir=DIR     scratch directory for the package inputs\n"
+	 "                    (default /dev/shm, else /tmp)\n");
+  printf("  -j, --threads=N   pool threads (0: one per CPU, default 1)\n");
+  printf("  -o, --output=FILE write the JSON there instead of stdout\n");
+  printf("  -q, --quick       short runs and a 20M tarball, for a smoke test\n");
+}
+
+int main(int argc, char *argv[])
+{
+  static const char *nh_images[] = { "uImage", "root.cramfs", "programs_0.tar.gz" };
+  static const char *small_images[] = { "env.img" };
+  const char *dir = NULL, *output = NULL;
+  char scratch[PATH_MAX], path[PATH_MAX];
+  pool_t *pool = NULL;
+  uint8 *buf;
+  int c, i, fd, threads = 1, quick = 0, ret = 0;
+
+  while((c = getopt_long(argc, argv, "d:j:o:qh", long_opts, NULL)) != -1)
+    {
+      switch(c)
+	{
+	case 'd':
+	  dir = optarg;
+	  break;
+	case 'j':
+	  threads = atoi(optarg);
+	  break;
+	case 'o':
+	  output = optarg;
+	  break;
+	case 'q':
+	  quick = 1;
+	  min_time = 0.02;
+	  break;
+	default:
+	  usage();
+	  return(-1);
+	}
+    }
+  if(dir == NULL)
+    dir = access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+
+  /* the library talks on stdout; keep that away from the JSON */
+  if(output)
+    out = fopen(output, "w");
+  else if((fd = dup(STDOUT_FILENO)) >= 0)
+    out = fdopen(fd, "w");
+  if(out == NULL || freopen("/dev/null", "w", stdout) == NULL)
+    {
+      fprintf(stderr, "can't set up the output\n");
+      return(-1);
+    }
+
+  if(threads != 1 && (pool = pool_create(threads)) == NULL)
+    {
+      fprintf(stderr, "can't start %d threads\n", threads);
+      return(-1);
+    }
+  if((buf = malloc(BENCH_MAXLEN + 64)) == NULL)
+    return(-1);
+  fill(buf, BENCH_MAXLEN + 64, 1);
+
+  fprintf(out, "{\n  \"upk_bench\": 1,\n  \"version\": \"%s\",\n"
+	  "  \"crc_kernel\": \"%s\",\n  \"threads\": %d,\n  \"dir\": ",
+	  VERSION, crc32_kernel_name(-1), pool ? pool_threads(pool) : 1);
+  upk_json_str(out, dir);
+  fprintf(out, ",\n  \"results\": [");
+
+  bench_crc(buf);
+  bench_crc_pool(buf, pool);
+  free(buf);
+
+  snprintf(scratch, sizeof(scratch), "%s/upk-bench.XXXXXX", dir);
+  if(mkdtemp(scratch) == NULL)
+    {
+      fprintf(stderr, "can't create a directory in %s\n", dir);
+      ret = -1;
+      goto done;
+    }
+  for(i = 0; i < NINPUTS; i++)
+    {
+      size_t len = inputs[i].len;
+
+      if(quick && len > (20 << 20))
+	len = 20 << 20;
+      if(make_file(scratch, inputs[i].name, len, inputs[i].text, i + 1) != 0)
+	{
+	  fprintf(stderr, "can't create %s/%s\n", scratch, inputs[i].name);
+	  ret = -1;
+	  goto clean;
+	}
+    }
+
+  if(bench_pack("small", scratch, pool, STREAM_ZERO_COPY, 0, 1, small_images) != 0 ||
+     bench_pack("pack_hw", scratch, pool, STREAM_ZERO_COPY, 1, 1, small_images) != 0 ||
+     bench_pack("pack_nh", scratch, pool, STREAM_ZERO_COPY, 0, 3, nh_images) != 0 ||
+     bench_pack("pack_hh", scratch, pool, STREAM_ZERO_COPY, 1, 3, nh_images) != 0 ||
+     bench_pack("pack_nh_user_copy", scratch, pool, 0, 0, 3, nh_images) != 0 ||
+     bench_pack("pack_nh_legacy", scratch, pool,
+		STREAM_ZERO_COPY | STREAM_LEGACY_EOF, 0, 3, nh_images) != 0)
+    {
+      fprintf(stderr, "building a package in %s failed\n", scratch);
+      ret = -1;
+    }
+
+clean:
+  for(i = 0; i < NINPUTS; i++)
+    {
+      if(snprintf(path, sizeof(path), "%s/%s", scratch, inputs[i].name) < sizeof(path))
+	unlink(path);
+    }
+  rmdir(scratch);
+done:
+  fprintf(out, "\n  ]\n}\n");
+  if(fclose(out) != 0)
+    ret = -1;
+  pool_destroy(pool);
+  return ret;
+}
@@ -0,0 +1,136 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** board.c
+ *
+ *  Flash layouts of the boards a package can be built for.  A package
+ *  records its board in p_reserve Bit[1:0] and the flash addresses in its
+ *  image table; nothing else about it depends on the board.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "upk.h"
+
+static const upk_board_t boards[] = {
+  { "16M", 0x02,
+    { UBOOT_ADDR_START, UBOOT_ADDR_END },
+    { KERNEL_ADDR_START, KERNEL_ADDR_END },
+    2, { { CRAMFS_ADDR_START1, CRAMFS_ADDR_END1 },
+	 { CRAMFS_ADDR_START2, CRAMFS_ADDR_END2 } } },
+  { "8M", 0x01,
+    { UBOOT_ADDR_START, UBOOT_ADDR_END },
+    { KERNEL_ADDR_START, KERNEL_ADDR_END_8M },
+    1, { { CRAMFS_ADDR_START, CRAMFS_ADDR_END } } },
+};
+
+#define NBOARDS  (sizeof(boards) / sizeof(boards[0]))
+
+const upk_board_t *upk_board_find(const char *name)
+{
+  int i;
+
+  for(i = 0; i < NBOARDS; i++)
+    if(strcmp(boards[i].name, name) == 0)
+      return &boards[i];
+  return NULL;
+}
+
+const upk_board_t *upk_board_by_flash(uint32 reserve)
+{
+  int i;
+
+  for(i = 0; i < NBOARDS; i++)
+    if(boards[i].flash == (reserve & 0x03))
+      return &boards[i];
+  return NULL;
+}
+
+const upk_board_t *upk_board_default(void)
+{
+#if FLASH_16M
+  return &boards[0];
+#else
+  return &boards[1];
+#endif
+}
+
+off_t upk_board_rootfs_size(const upk_board_t *board)
+{
+  off_t size = 0;
+  int i;
+
+  for(i = 0; i < board->nrootfs; i++)
+    size += UPK_REGION_SIZE(&board->rootfs[i]);
+  return size;
+}
+
+int upk_board_parse_regions(const char *s, upk_region_t *r, int max)
+{
+  unsigned long start, end;
+  char *e;
+  int n = 0;
+
+  while(1)
+    {
+      while(isspace((unsigned char)*s) || *s == ',')
+	s++;
+      if(*s == '\0')
+	break;
+      start = strtoul(s, &e, 0);
+      if(e == s || *e != '-')
+	goto bad;
+      s = e + 1;
+      end = strtoul(s, &e, 0);
+      if(e == s || end < start || end > 0xffffffffUL)
+	goto bad;
+      s = e;
+      if(n == max)
+	{
+	  printf("at most %d rootfs regions\n", max);
+	  return -1;
+	}
+      if(n > 0 && start <= r[n-1].end)
+	{
+	  printf("rootfs regions must be in order and not overlap\n");
+	  return -1;
+	}
+      r[n].start = start;
+      r[n].end   = end;
+      n++;
+    }
+  if(n == 0)
+    goto bad;
+  return n;
+
+bad:
+  printf("bad rootfs regions, want START-END ...\n");
+  return -1;
+}
+
+static int overlaps(const upk_region_t *a, const upk_region_t *b)
+{
+  return a->start <= b->end && b->start <= a->end;
+}
+
+int upk_board_check_regions(const upk_board_t *board, const upk_region_t *r, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    if(overlaps(&r[i], &board->uboot) || overlaps(&r[i], &board->kernel))
+      {
+	printf("rootfs region 0x%x-0x%x overlaps the %s board's %s\n",
+	       r[i].start, r[i].end, board->name,
+	       overlaps(&r[i], &board->uboot) ? "u-boot" : "kernel");
+	return -1;
+      }
+  return 0;
+}
@@ -0,0 +1,422 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** cache.c
+ *
+ *  Cache of input file CRCs, see cache.h.
+ *
+ *  With a cache directory every file also gets a record there, named
+ *  after its device and inode:
+ *
+ *    cache_rec_t                      identity, chunk size and counts
+ *    uint32      chunks[nchunks]      crc32(0, chunk) per CACHE_CHUNK
+ *    cache_range_t ranges[nranges]    CRCs of odd ranges asked for
+ *    uint32      crc                  crc32 of everything above
+ *
+ *  Records are written to a temporary file and rename()d into place, so
+ *  builders sharing the directory only ever see whole records; a record
+ *  that fails its CRC or no longer matches the file is ignored.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+#include "stream.h"
+
+#define CF_NEW      0
+#define CF_HASHING  1
+#define CF_READY    2
+#define CF_FAILED   3
+
+#define CACHE_MAGIC    0x434b5055   /* "UPKC" */
+#define CACHE_VERSION  1
+#define CACHE_RANGES   16           /* odd ranges remembered per file */
+#define SAMPLE_LEN     0x10000      /* bytes hashed at each sample point */
+
+typedef struct cache_range {
+  unsigned long long off;
+  unsigned long long len;
+  uint32             crc;
+  uint32             pad;
+} cache_range_t;
+
+typedef struct cache_rec {
+  uint32             magic;
+  uint32             version;
+  unsigned long long dev;
+  unsigned long long ino;
+  unsigned long long size;
+  long long          mtime_sec;
+  long long          mtime_nsec;
+  uint32             chunk;
+  uint32             nchunks;
+  uint32             nranges;
+  uint32             sample;        /* fast content hash, see sample_crc() */
+  uint32             filecrc;
+  uint32             pad;
+} cache_rec_t;
+
+typedef struct cache_file {
+  struct cache_file *next;
+  dev_t            dev;
+  ino_t            ino;
+  off_t            size;
+  struct timespec  mtime;
+  int              state;       /* CF_* */
+  uint32           sample;
+  uint32           filecrc;
+  size_t           nchunks;
+  uint32          *chunks;      /* crc32(0, chunk) for each CACHE_CHUNK */
+  int              nranges;
+  cache_range_t    ranges[CACHE_RANGES];
+} cache_file_t;
+
+struct crc_cache {
+  pthread_mutex_t  lock;
+  pthread_cond_t   ready;       /* some file left CF_HASHING */
+  cache_file_t    *files;
+  char            *dir;         /* persistent records, or NULL */
+  int              flags;       /* CRC_CACHE_* */
+};
+
+crc_cache_t *crc_cache_new(void)
+{
+  crc_cache_t *cache;
+
+  if((cache = calloc(1, sizeof(*cache))) == NULL)
+    return NULL;
+  pthread_mutex_init(&cache->lock, NULL);
+  pthread_cond_init(&cache->ready, NULL);
+  return cache;
+}
+
+int crc_cache_set_dir(crc_cache_t *cache, const char *dir, int flags)
+{
+  free(cache->dir);
+  cache->dir = NULL;
+  cache->flags = flags;
+  if(dir == NULL)
+    return 0;
+  if(mkdir(dir, 0777) != 0 && access(dir, W_OK) != 0)
+    {
+      printf("can't use cache directory %s\n", dir);
+      return -1;
+    }
+  cache->dir = strdup(dir);
+  return cache->dir ? 0 : -1;
+}
+
+void crc_cache_free(crc_cache_t *cache)
+{
+  cache_file_t *cf, *next;
+
+  if(cache == NULL)
+    return;
+  for(cf = cache->files; cf; cf = next)
+    {
+      next = cf->next;
+      free(cf->chunks);
+      free(cf);
+    }
+  pthread_mutex_destroy(&cache->lock);
+  pthread_cond_destroy(&cache->ready);
+  free(cache->dir);
+  free(cache);
+}
+
+/*
+ * Fast content hash: 64K at the start, middle and end of the file.  It
+ * catches a file rewritten in place with its old mtime restored, which
+ * device/inode/size/mtime alone would not.
+ */
+static int sample_crc(int fd, off_t size, uint32 *crc)
+{
+  off_t at[3];
+  size_t n;
+  int i;
+
+  at[0] = 0;
+  at[1] = size / 2;
+  at[2] = size > SAMPLE_LEN ? size - SAMPLE_LEN : 0;
+  *crc = 0;
+  for(i = 0; i < 3; i++)
+    {
+      n = size - at[i] < SAMPLE_LEN ? size - at[i] : SAMPLE_LEN;
+      if(stream_crc_fd(NULL, fd, at[i], n, crc) != 0)
+	return -1;
+    }
+  return 0;
+}
+
+static void rec_path(crc_cache_t *cache, const cache_file_t *cf, char *path,
+		     size_t len)
+{
+  snprintf(path, len, "%s/%llx-%llx.crc", cache->dir,
+	   (unsigned long long)cf->dev, (unsigned long long)cf->ino);
+}
+
+/* fill cf from its record if there is a valid one; runs without the lock */
+static int rec_load(crc_cache_t *cache, cache_file_t *cf)
+{
+  char path[PATH_MAX];
+  cache_rec_t rec;
+  uint32 crc, stored;
+  size_t n;
+  FILE *fp;
+  int ret = -1;
+
+  rec_path(cache, cf, path, sizeof(path));
+  if((fp = fopen(path, "rb")) == NULL)
+    return -1;
+  if(fread(&rec, sizeof(rec), 1, fp) != 1)
+    goto out;
+  if(rec.magic != CACHE_MAGIC || rec.version != CACHE_VERSION ||
+     rec.dev != cf->dev || rec.ino != cf->ino || rec.size != cf->size ||
+     rec.mtime_sec != cf->mtime.tv_sec || rec.mtime_nsec != cf->mtime.tv_nsec ||
+     rec.chunk != CACHE_CHUNK || rec.nranges > CACHE_RANGES ||
+     rec.nchunks != (cf->size + CACHE_CHUNK - 1) / CACHE_CHUNK)
+    goto out;
+  if((cache->flags & CRC_CACHE_VERIFY) && rec.sample != cf->sample)
+    goto out;
+
+  n = rec.nchunks ? rec.nchunks : 1;
+  if((cf->chunks = malloc(n * sizeof(uint32))) == NULL)
+    goto out;
+  if(fread(cf->chunks, sizeof(uint32), rec.nchunks, fp) != rec.nchunks ||
+     fread(cf->ranges, sizeof(cache_range_t), rec.nranges, fp) != rec.nranges ||
+     fread(&stored, sizeof(stored), 1, fp) != 1)
+    goto out;
+
+  crc = crc32(0, (uint8 *)&rec, sizeof(rec));
+  crc = crc32(crc, (uint8 *)cf->chunks, rec.nchunks * sizeof(uint32));
+  crc = crc32(crc, (uint8 *)cf->ranges, rec.nranges * sizeof(cache_range_t));
+  if(crc != stored)
+    goto out;
+
+  cf->nchunks = rec.nchunks;
+  cf->nranges = rec.nranges;
+  cf->filecrc = rec.filecrc;
+  ret = 0;
+out:
+  if(ret != 0)
+    {
+      free(cf->chunks);
+      cf->chunks = NULL;
+      cf->nranges = 0;
+    }
+  fclose(fp);
+  return ret;
+}
+
+/* write cf's record; called with the lock held so the ranges are stable */
+static void rec_store(crc_cache_t *cache, const cache_file_t *cf)
+{
+  char path[PATH_MAX], tmp[PATH_MAX + 32];
+  cache_rec_t rec;
+  uint32 crc;
+  FILE *fp;
+  int fd, ok;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.magic      = CACHE_MAGIC;
+  rec.version    = CACHE_VERSION;
+  rec.dev        = cf->dev;
+  rec.ino        = cf->ino;
+  rec.size       = cf->size;
+  rec.mtime_sec  = cf->mtime.tv_sec;
+  rec.mtime_nsec = cf->mtime.tv_nsec;
+  rec.chunk      = CACHE_CHUNK;
+  rec.nchunks    = cf->nchunks;
+  rec.nranges    = cf->nranges;
+  rec.sample     = cf->sample;
+  rec.filecrc    = cf->filecrc;
+
+  crc = crc32(0, (uint8 *)&rec, sizeof(rec));
+  crc = crc32(crc, (uint8 *)cf->chunks, cf->nchunks * sizeof(uint32));
+  crc = crc32(crc, (uint8 *)cf->ranges, cf->nranges * sizeof(cache_range_t));
+
+  rec_path(cache, cf, path, sizeof(path));
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+  if((fd = mkstemp(tmp)) < 0)
+    return;
+  fchmod(fd, 0644);
+  if((fp = fdopen(fd, "wb")) == NULL)
+    {
+      close(fd);
+      unlink(tmp);
+      return;
+    }
+  ok = fwrite(&rec, sizeof(rec), 1, fp) == 1 &&
+       fwrite(cf->chunks, sizeof(uint32), cf->nchunks, fp) == cf->nchunks &&
+       fwrite(cf->ranges, sizeof(cache_range_t), cf->nranges, fp) == cf->nranges &&
+       fwrite(&crc, sizeof(crc), 1, fp) == 1;
+  if(fclose(fp) != 0 || !ok || rename(tmp, path) != 0)
+    unlink(tmp);
+}
+
+/* called with the lock held */
+static cache_file_t *lookup(crc_cache_t *cache, const struct stat *st)
+{
+  cache_file_t *cf;
+
+  for(cf = cache->files; cf; cf = cf->next)
+    if(cf->dev == st->st_dev && cf->ino == st->st_ino &&
+       cf->size == st->st_size &&
+       cf->mtime.tv_sec == st->st_mtim.tv_sec &&
+       cf->mtime.tv_nsec == st->st_mtim.tv_nsec)
+      return cf;
+
+  if((cf = calloc(1, sizeof(*cf))) == NULL)
+    return NULL;
+  cf->dev   = st->st_dev;
+  cf->ino   = st->st_ino;
+  cf->size  = st->st_size;
+  cf->mtime = st->st_mtim;
+  cf->state = CF_NEW;
+  cf->next  = cache->files;
+  cache->files = cf;
+  return cf;
+}
+
+/* hash the whole file once; runs without the lock */
+static int hash_file(cache_file_t *cf, pool_t *pool, int fd)
+{
+  uint8 *map;
+  size_t k;
+
+  cf->nchunks = (cf->size + CACHE_CHUNK - 1) / CACHE_CHUNK;
+  if((cf->chunks = malloc((cf->nchunks ? cf->nchunks : 1) * sizeof(uint32))) == NULL)
+    return -1;
+  cf->filecrc = 0;
+  if(cf->nchunks == 0)
+    return 0;
+  map = mmap(NULL, cf->size, PROT_READ, MAP_SHARED, fd, 0);
+  if(map == MAP_FAILED)
+    return -1;
+  madvise(map, cf->size, MADV_WILLNEED);
+  stream_crc_chunks(pool, map, cf->size, CACHE_CHUNK, cf->chunks);
+  munmap(map, cf->size);
+
+  for(k = 0; k < cf->nchunks; k++)
+    cf->filecrc = crc32_combine(cf->filecrc, cf->chunks[k],
+				k == cf->nchunks - 1 ? cf->size - (off_t)k * CACHE_CHUNK
+						     : CACHE_CHUNK);
+  return 0;
+}
+
+/* make cf ready: from its record, else by hashing; runs without the lock */
+static int fill(crc_cache_t *cache, cache_file_t *cf, pool_t *pool, int fd,
+		int *fresh)
+{
+  *fresh = 0;
+  if(cache->dir == NULL)
+    return hash_file(cf, pool, fd);
+  if((cache->flags & CRC_CACHE_VERIFY) && sample_crc(fd, cf->size, &cf->sample) != 0)
+    return -1;
+  if(rec_load(cache, cf) == 0)
+    return 0;
+  *fresh = 1;
+  return hash_file(cf, pool, fd);
+}
+
+int crc_cache_range(crc_cache_t *cache, pool_t *pool, int fd,
+		    off_t off, size_t len, uint32 *crc)
+{
+  cache_file_t *cf;
+  struct stat st;
+  off_t end = off + len, lo, hi;
+  size_t k;
+  int ret, fresh, i;
+
+  if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || end > st.st_size)
+    return -1;
+
+  pthread_mutex_lock(&cache->lock);
+  if((cf = lookup(cache, &st)) == NULL)
+    {
+      pthread_mutex_unlock(&cache->lock);
+      return -1;
+    }
+  if(cf->state == CF_NEW)
+    {
+      cf->state = CF_HASHING;
+      pthread_mutex_unlock(&cache->lock);
+      ret = fill(cache, cf, pool, fd, &fresh);
+      pthread_mutex_lock(&cache->lock);
+      cf->state = (ret == 0) ? CF_READY : CF_FAILED;
+      if(ret == 0 && fresh)
+	rec_store(cache, cf);
+      pthread_cond_broadcast(&cache->ready);
+    }
+  while(cf->state == CF_HASHING)
+    pthread_cond_wait(&cache->ready, &cache->lock);
+  ret = (cf->state == CF_READY) ? 0 : -1;
+  for(i = 0; ret == 0 && i < cf->nranges; i++)
+    if(cf->ranges[i].off == off && cf->ranges[i].len == len)
+      {
+	*crc = cf->ranges[i].crc;
+	pthread_mutex_unlock(&cache->lock);
+	return 0;
+      }
+  pthread_mutex_unlock(&cache->lock);
+  if(ret != 0)
+    return -1;
+  if(off == 0 && end == cf->size)
+    {
+      *crc = cf->filecrc;
+      return 0;
+    }
+
+  /* whole chunks come from the table, partial ones are hashed directly */
+  *crc = 0;
+  fresh = 0;
+  for(k = off / CACHE_CHUNK; len && k < cf->nchunks; k++)
+    {
+      lo = (off_t)k * CACHE_CHUNK;
+      hi = lo + CACHE_CHUNK < cf->size ? lo + CACHE_CHUNK : cf->size;
+      if(lo >= end)
+	break;
+      if(lo >= off && hi <= end)
+	*crc = crc32_combine(*crc, cf->chunks[k], hi - lo);
+      else
+	{
+	  if(lo < off)
+	    lo = off;
+	  if(hi > end)
+	    hi = end;
+	  if(stream_crc_fd(NULL, fd, lo, hi - lo, crc) != 0)
+	    return -1;
+	  fresh = 1;
+	}
+    }
+
+  /* remember ranges that needed file reads so the next build doesn't */
+  if(fresh)
+    {
+      pthread_mutex_lock(&cache->lock);
+      if(cf->nranges < CACHE_RANGES)
+	{
+	  cf->ranges[cf->nranges].off = off;
+	  cf->ranges[cf->nranges].len = len;
+	  cf->ranges[cf->nranges].crc = *crc;
+	  cf->ranges[cf->nranges].pad = 0;
+	  cf->nranges++;
+	  if(cache->dir)
+	    rec_store(cache, cf);
+	}
+      pthread_mutex_unlock(&cache->lock);
+    }
+  return 0;
+}
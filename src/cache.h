@@ -0,0 +1,49 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** cache.h
+ *
+ * CRCs of input files, shared by every writer in the process.  A file is
+ * identified by device, inode, size and mtime; the first time any part of
+ * it is needed the whole file is hashed once, in CACHE_CHUNK pieces, and
+ * the CRC of any byte range is afterwards put together from those with
+ * crc32_combine(), touching at most two partial chunks.
+ *
+ * Given a directory the cache also persists between runs and may be
+ * shared by concurrent builders: an unchanged input costs one stat() and
+ * one small record read instead of a full hash.  The 7M cramfs cut falls
+ * on a chunk boundary, so both halves come straight from the chunk table.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <sys/types.h>
+#include "package.h"
+#include "pool.h"
+
+#define CACHE_CHUNK  0x100000
+
+/* crc_cache_set_dir() flags */
+#define CRC_CACHE_VERIFY  0x01   /* also key records on a sampled content hash */
+
+typedef struct crc_cache crc_cache_t;
+
+extern crc_cache_t *crc_cache_new(void);
+extern void         crc_cache_free(crc_cache_t *cache);
+
+/* keep records in dir (created if needed); NULL: in-memory only */
+extern int          crc_cache_set_dir(crc_cache_t *cache, const char *dir, int flags);
+
+/*
+ * *crc = crc32(0, bytes off..off+len of fd).  Safe to call from several
+ * threads; concurrent callers for the same file wait for one hash.
+ */
+extern int crc_cache_range(crc_cache_t *cache, pool_t *pool, int fd,
+			   off_t off, size_t len, uint32 *crc);
+
+#endif
@@ -0,0 +1,617 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** cramfs.c
+ *
+ *  root.cramfs built from a directory, see cramfs.h.
+ *
+ *  The tree is scanned first, which fixes the directory area right after
+ *  the superblock.  File data follows in the order of the scan: a batch
+ *  of CRAMFS_BATCH bytes of files is read, the pool compresses its blocks
+ *  CRAMFS_JOB_BLOCKS at a time, and each file's block pointers and blocks
+ *  are written in order.  The inodes are filled in and the superblock
+ *  CRC computed once all data is out.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "cramfs.h"
+#include "gzip.h"
+#include "stream.h"
+
+#define CRAMFS_MAGIC       0x28cd3d45
+#define CRAMFS_SIGNATURE   "Compressed ROMFS"
+#define CRAMFS_FSID_V2     0x00000001
+#define CRAMFS_SORTED_DIRS 0x00000002
+#define CRAMFS_SUPER       76          /* superblock with the root inode */
+#define CRAMFS_INODE       12
+#define CRAMFS_NAME_MAX    252         /* 6 bits of 4 byte units         */
+#define CRAMFS_SIZE_MAX    0xffffff    /* 24 bits                        */
+#define CRAMFS_OFFSET_MAX  0xfffffff   /* 26 bits of 4 byte units        */
+#define CRAMFS_PAD         CRAMFS_BLOCK
+#define CRAMFS_LEVEL       9
+
+typedef struct cfs_entry {
+  char              *name;
+  struct stat        st;
+  uint32             size;        /* the inode's size field            */
+  uint32             inode;       /* where the inode is in the image   */
+  uint32             offset;      /* of its data or entries, 0 if none */
+  char              *link;        /* a symlink's target                */
+  struct cfs_entry  *same;        /* a hard link seen before           */
+  struct cfs_entry **child;
+  int                nchild;
+} cfs_entry_t;
+
+typedef struct cfs_job {
+  const uint8 *in;
+  size_t       len;
+  int          nblocks;
+  uint8       *out;               /* nblocks * bound bytes */
+  size_t       bound;
+  size_t       blen[CRAMFS_JOB_BLOCKS];
+  int          ret;
+} cfs_job_t;
+
+typedef struct cfs_file {
+  cfs_entry_t *e;
+  uint8       *data;
+  size_t       len;
+} cfs_file_t;
+
+typedef struct cfs {
+  int           fd;
+  pool_t       *pool;
+  off_t         max;
+  const char   *dir;
+  char          path[PATH_MAX];
+  uint8        *dirs;             /* the directory area, after the superblock */
+  size_t        dirlen, dircap;
+  uint32        pos;              /* end of the image so far */
+  uint32        files, blocks;
+  off_t         in;
+  int           truncated;        /* uid or gid didn't fit   */
+  cfs_entry_t **links;            /* regular files with st_nlink > 1 */
+  int           nlinks, caplinks;
+  cfs_file_t   *batch;
+  int           nbatch, capbatch;
+  size_t        batchlen;
+} cfs_t;
+
+static void put_le32(uint8 *p, uint32 v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint32 pad4(size_t n)
+{
+  return (n + 3) & ~(size_t)3;
+}
+
+static void entry_free(cfs_entry_t *e)
+{
+  int i;
+
+  if(e == NULL)
+    return;
+  for(i = 0; i < e->nchild; i++)
+    entry_free(e->child[i]);
+  free(e->child);
+  free(e->name);
+  free(e->link);
+  free(e);
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* an earlier name of the same regular file */
+static int find_link(cfs_t *c, cfs_entry_t *e)
+{
+  cfs_entry_t **more;
+  int i;
+
+  for(i = 0; i < c->nlinks; i++)
+    if(c->links[i]->st.st_dev == e->st.st_dev &&
+       c->links[i]->st.st_ino == e->st.st_ino)
+      {
+	e->same = c->links[i];
+	return 0;
+      }
+  if(c->nlinks == c->caplinks)
+    {
+      c->caplinks = c->caplinks ? 2 * c->caplinks : 64;
+      if((more = realloc(c->links, c->caplinks * sizeof(*more))) == NULL)
+	return(-1);
+      c->links = more;
+    }
+  c->links[c->nlinks++] = e;
+  return 0;
+}
+
+/* the entries below c->path (len bytes long) into d, sorted by name */
+static int scan_dir(cfs_t *c, cfs_entry_t *d, size_t len)
+{
+  DIR *dp;
+  struct dirent *de;
+  char **names = NULL, **more, link[PATH_MAX];
+  size_t n = 0, cap = 0, i, l;
+  ssize_t ll;
+  cfs_entry_t *e;
+  uint32 size = 0;
+  int ret = -1;
+
+  if((dp = opendir(c->path)) == NULL)
+    {
+      printf("can't read directory: %s\n", c->path);
+      return(-1);
+    }
+  while((de = readdir(dp)) != NULL)
+    {
+      if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+	continue;
+      if(n == cap)
+	{
+	  cap = cap ? 2 * cap : 64;
+	  if((more = realloc(names, cap * sizeof(*names))) == NULL)
+	    goto out;
+	  names = more;
+	}
+      if((names[n] = strdup(de->d_name)) == NULL)
+	goto out;
+      n++;
+    }
+  /* the order the kernel's lookup expects (CRAMFS_FLAG_SORTED_DIRS) */
+  qsort(names, n, sizeof(*names), name_cmp);
+  if(n && (d->child = calloc(n, sizeof(*d->child))) == NULL)
+    goto out;
+
+  for(i = 0; i < n; i++)
+    {
+      l = strlen(names[i]);
+      if(l > CRAMFS_NAME_MAX)
+	{
+	  printf("name too long for cramfs: %s/%s\n", c->path, names[i]);
+	  goto out;
+	}
+      if(len + 1 + l + 1 >= sizeof(c->path))
+	{
+	  printf("path too long: %s/%s\n", c->path, names[i]);
+	  goto out;
+	}
+      c->path[len] = '/';
+      memcpy(c->path + len + 1, names[i], l + 1);
+      if((e = calloc(1, sizeof(*e))) == NULL)
+	goto out;
+      d->child[d->nchild++] = e;
+      e->name  = names[i];
+      names[i] = NULL;
+      if(lstat(c->path, &e->st) != 0)
+	{
+	  printf("can't stat %s\n", c->path);
+	  goto out;
+	}
+      if((e->st.st_uid & ~0xffff) || (e->st.st_gid & ~0xff))
+	c->truncated = 1;
+      if(S_ISDIR(e->st.st_mode))
+	{
+	  if(scan_dir(c, e, len + 1 + l) != 0)
+	    goto out;
+	}
+      else if(S_ISREG(e->st.st_mode))
+	{
+	  if(e->st.st_size > CRAMFS_SIZE_MAX)
+	    {
+	      printf("%s is too big for cramfs (%lld bytes)\n", c->path,
+		     (long long)e->st.st_size);
+	      goto out;
+	    }
+	  e->size = e->st.st_size;
+	  if(e->st.st_nlink > 1 && e->size && find_link(c, e) != 0)
+	    goto out;
+	}
+      else if(S_ISLNK(e->st.st_mode))
+	{
+	  if((ll = readlink(c->path, link, sizeof(link) - 1)) < 0)
+	    {
+	      printf("can't read link %s\n", c->path);
+	      goto out;
+	    }
+	  link[ll] = '\0';
+	  if((e->link = strdup(link)) == NULL)
+	    goto out;
+	  e->size = ll;
+	}
+      else if(S_ISCHR(e->st.st_mode) || S_ISBLK(e->st.st_mode))
+	/* old_decode_dev() in the kernel: 8 bits each */
+	e->size = (major(e->st.st_rdev) & 0xff) << 8 | (minor(e->st.st_rdev) & 0xff);
+      size += CRAMFS_INODE + pad4(l);
+      c->files++;
+    }
+  d->size = size;
+  ret = 0;
+
+out:
+  c->path[len] = '\0';
+  for(i = 0; i < n; i++)
+    free(names[i]);
+  free(names);
+  closedir(dp);
+  return ret;
+}
+
+/* d's entries in the directory area, then those of its subdirectories */
+static int lay_dirs(cfs_t *c, cfs_entry_t *d)
+{
+  cfs_entry_t *e;
+  uint8 *more;
+  size_t l;
+  int i;
+
+  if(c->dirlen + d->size > c->dircap)
+    {
+      c->dircap = 2 * (c->dirlen + d->size);
+      if((more = realloc(c->dirs, c->dircap)) == NULL)
+	return(-1);
+      c->dirs = more;
+    }
+  d->offset = d->nchild ? CRAMFS_SUPER + c->dirlen : 0;
+  for(i = 0; i < d->nchild; i++)
+    {
+      e = d->child[i];
+      l = strlen(e->name);
+      e->inode = CRAMFS_SUPER + c->dirlen;
+      memset(c->dirs + c->dirlen, 0, CRAMFS_INODE + pad4(l));
+      memcpy(c->dirs + c->dirlen + CRAMFS_INODE, e->name, l);
+      c->dirlen += CRAMFS_INODE + pad4(l);
+    }
+  for(i = 0; i < d->nchild; i++)
+    if(S_ISDIR(d->child[i]->st.st_mode) && lay_dirs(c, d->child[i]) != 0)
+      return(-1);
+  return 0;
+}
+
+static void inode_put(uint8 *p, const cfs_entry_t *e)
+{
+  size_t l = e->name ? strlen(e->name) : 0;
+  uint32 offset = e->same ? e->same->offset : e->offset;
+
+  put_le32(p,     (e->st.st_mode & 0xffff) | (e->st.st_uid & 0xffff) << 16);
+  put_le32(p + 4, (e->size & CRAMFS_SIZE_MAX) | (e->st.st_gid & 0xff) << 24);
+  put_le32(p + 8, pad4(l) / 4 | (offset / 4) << 6);
+}
+
+static void inodes_put(cfs_t *c, const cfs_entry_t *d)
+{
+  int i;
+
+  for(i = 0; i < d->nchild; i++)
+    {
+      inode_put(c->dirs + d->child[i]->inode - CRAMFS_SUPER, d->child[i]);
+      inodes_put(c, d->child[i]);
+    }
+}
+
+static void cfs_job_run(void *arg)
+{
+  cfs_job_t *job = arg;
+  size_t off, n;
+  int k;
+
+  job->ret = 0;
+  for(k = 0; k < job->nblocks; k++)
+    {
+      off = (size_t)k * CRAMFS_BLOCK;
+      n   = job->len - off < CRAMFS_BLOCK ? job->len - off : CRAMFS_BLOCK;
+      if(gzip_zlib(job->in + off, n, CRAMFS_LEVEL, job->out + k * job->bound,
+		   &job->blen[k]) != 0)
+	{
+	  job->ret = -1;
+	  return;
+	}
+    }
+}
+
+/* does the image still fit, with pos bytes of it done */
+static int cfs_fits(cfs_t *c, off_t pos)
+{
+  if(pos > (off_t)CRAMFS_OFFSET_MAX * 4)
+    {
+      printf("%s: too much for a cramfs image\n", c->dir);
+      return(-1);
+    }
+  if(c->max && (pos + CRAMFS_PAD - 1) / CRAMFS_PAD * CRAMFS_PAD > c->max)
+    {
+      printf("%s: the cramfs image needs more than the %lld bytes of flash "
+	     "for it\n", c->dir, (long long)c->max);
+      return(-1);
+    }
+  return 0;
+}
+
+/* compress the batch and write each file of it in turn */
+static int cfs_flush(cfs_t *c)
+{
+  pool_group_t grp = POOL_GROUP_INIT;
+  cfs_job_t *jobs = NULL, *job;
+  cfs_file_t *f;
+  size_t bound = gzip_zlib_bound(CRAMFS_BLOCK), off;
+  uint8 *buf = NULL, ptr[4];
+  uint32 start, end;
+  int i, k, b, n = 0, nb, ret = -1;
+
+  for(i = 0; i < c->nbatch; i++)
+    n += (c->batch[i].len + CRAMFS_JOB_BLOCKS * CRAMFS_BLOCK - 1) /
+      (CRAMFS_JOB_BLOCKS * CRAMFS_BLOCK);
+  if(n == 0)
+    return 0;
+  if((jobs = calloc(n, sizeof(*jobs))) == NULL ||
+     (buf = malloc((size_t)n * CRAMFS_JOB_BLOCKS * bound)) == NULL)
+    {
+      printf("out of memory\n");
+      goto out;
+    }
+  for(i = 0, k = 0; i < c->nbatch; i++)
+    for(off = 0; off < c->batch[i].len; off += CRAMFS_JOB_BLOCKS * CRAMFS_BLOCK, k++)
+      {
+	job = &jobs[k];
+	job->in      = c->batch[i].data + off;
+	job->len     = c->batch[i].len - off;
+	if(job->len > CRAMFS_JOB_BLOCKS * CRAMFS_BLOCK)
+	  job->len = CRAMFS_JOB_BLOCKS * CRAMFS_BLOCK;
+	job->nblocks = (job->len + CRAMFS_BLOCK - 1) / CRAMFS_BLOCK;
+	job->bound   = bound;
+	job->out     = buf + (size_t)k * CRAMFS_JOB_BLOCKS * bound;
+	pool_submit(c->pool, &grp, cfs_job_run, job);
+      }
+  pool_wait(c->pool, &grp);
+
+  /* each file: a pointer to the end of each block, then the blocks */
+  for(i = 0, k = 0; i < c->nbatch; i++)
+    {
+      f  = &c->batch[i];
+      nb = (f->len + CRAMFS_BLOCK - 1) / CRAMFS_BLOCK;
+      f->e->offset = start = c->pos;
+      end = start + 4 * nb;
+      for(b = 0; b < nb; b++)
+	{
+	  job = &jobs[k + b / CRAMFS_JOB_BLOCKS];
+	  if(job->ret != 0)
+	    {
+	      printf("can't compress %s\n", f->e->name);
+	      goto out;
+	    }
+	  if(cfs_fits(c, (off_t)end + job->blen[b % CRAMFS_JOB_BLOCKS]) != 0)
+	    goto out;
+	  if(pwrite(c->fd, job->out + (b % CRAMFS_JOB_BLOCKS) * bound,
+		    job->blen[b % CRAMFS_JOB_BLOCKS], end) !=
+	     (ssize_t)job->blen[b % CRAMFS_JOB_BLOCKS])
+	    goto fail;
+	  end += job->blen[b % CRAMFS_JOB_BLOCKS];
+	  put_le32(ptr, end);
+	  if(pwrite(c->fd, ptr, 4, start + 4 * b) != 4)
+	    goto fail;
+	}
+      k += (nb + CRAMFS_JOB_BLOCKS - 1) / CRAMFS_JOB_BLOCKS;
+      c->pos = pad4(end);
+      c->blocks += nb;
+    }
+  ret = 0;
+  goto out;
+
+fail:
+  printf("can't write the cramfs image of %s\n", c->dir);
+out:
+  for(i = 0; i < c->nbatch; i++)
+    free(c->batch[i].data);
+  c->nbatch   = 0;
+  c->batchlen = 0;
+  free(buf);
+  free(jobs);
+  return ret;
+}
+
+/* read a file (or take a link target) into the batch */
+static int cfs_add(cfs_t *c, cfs_entry_t *e)
+{
+  cfs_file_t *more, *f;
+  ssize_t r;
+  size_t got;
+  int fd;
+
+  if(c->nbatch == c->capbatch)
+    {
+      c->capbatch = c->capbatch ? 2 * c->capbatch : 256;
+      if((more = realloc(c->batch, c->capbatch * sizeof(*more))) == NULL)
+	{
+	  printf("out of memory\n");
+	  return(-1);
+	}
+      c->batch = more;
+    }
+  f = &c->batch[c->nbatch];
+  f->e   = e;
+  f->len = e->size;
+  if((f->data = malloc(f->len)) == NULL)
+    {
+      printf("out of memory\n");
+      return(-1);
+    }
+  if(e->link)
+    memcpy(f->data, e->link, f->len);
+  else
+    {
+      if((fd = open(c->path, O_RDONLY)) < 0)
+	{
+	  printf("can't open %s\n", c->path);
+	  free(f->data);
+	  return(-1);
+	}
+      for(got = 0; got < f->len; got += r)
+	if((r = read(fd, f->data + got, f->len - got)) <= 0)
+	  break;
+      close(fd);
+      if(got != f->len)
+	{
+	  printf("can't read %s (did it change?)\n", c->path);
+	  free(f->data);
+	  return(-1);
+	}
+      c->in += got;
+    }
+  c->nbatch++;
+  c->batchlen += f->len;
+  if(c->batchlen >= CRAMFS_BATCH)
+    return cfs_flush(c);
+  return 0;
+}
+
+/* the data of everything below c->path, in the order of the scan */
+static int cfs_data(cfs_t *c, cfs_entry_t *d, size_t len)
+{
+  cfs_entry_t *e;
+  size_t l;
+  int i, ret = 0;
+
+  for(i = 0; i < d->nchild && ret == 0; i++)
+    {
+      e = d->child[i];
+      l = strlen(e->name);
+      c->path[len] = '/';
+      memcpy(c->path + len + 1, e->name, l + 1);
+      if(S_ISDIR(e->st.st_mode))
+	ret = cfs_data(c, e, len + 1 + l);
+      else if((S_ISREG(e->st.st_mode) && e->size && e->same == NULL) ||
+	      S_ISLNK(e->st.st_mode))
+	ret = cfs_add(c, e);
+    }
+  c->path[len] = '\0';
+  return ret;
+}
+
+int cramfs_build(const char *dir, pool_t *pool, off_t max, int *fd,
+		 off_t *len, off_t *in)
+{
+  uint8 super[CRAMFS_SUPER];
+  cfs_entry_t *root = NULL;
+  cfs_t *c;
+  uint32 crc = 0, end;
+  size_t l;
+  int ret = -1;
+
+#if !defined(HAVE_ZLIB_H) || !defined(HAVE_LIBZ)
+  printf("built without zlib, can't make a cramfs image of %s\n", dir);
+  return(-1);
+#endif
+  if((c = calloc(1, sizeof(*c))) == NULL ||
+     (root = calloc(1, sizeof(*root))) == NULL)
+    {
+      printf("out of memory\n");
+      goto out;
+    }
+  c->fd   = -1;
+  c->pool = pool;
+  c->max  = max;
+  c->dir  = dir;
+  l = strlen(dir);
+  while(l > 1 && dir[l-1] == '/')
+    l--;
+  if(l + 2 >= sizeof(c->path))
+    {
+      printf("path too long: %s\n", dir);
+      goto out;
+    }
+  memcpy(c->path, dir, l);
+  if(stat(c->path, &root->st) != 0)
+    {
+      printf("can't stat %s\n", c->path);
+      goto out;
+    }
+
+  c->files = 1;
+  if(scan_dir(c, root, l) != 0)
+    goto out;
+  if(lay_dirs(c, root) != 0)
+    {
+      printf("out of memory\n");
+      goto out;
+    }
+  c->pos = CRAMFS_SUPER + c->dirlen;
+  if(cfs_fits(c, c->pos) != 0)
+    goto out;
+  if((c->fd = stream_anon_fd("upk-cramfs")) < 0)
+    {
+      printf("can't make a temporary file for %s\n", dir);
+      goto out;
+    }
+  if(cfs_data(c, root, l) != 0 || cfs_flush(c) != 0)
+    goto fail;
+
+  /* padded to a whole block, as mkfs.cramfs does */
+  end = (c->pos + CRAMFS_PAD - 1) / CRAMFS_PAD * CRAMFS_PAD;
+  if(cfs_fits(c, end) != 0)
+    goto fail;
+  inodes_put(c, root);
+  memset(super, 0, sizeof(super));
+  put_le32(super,      CRAMFS_MAGIC);
+  put_le32(super + 4,  end);
+  put_le32(super + 8,  CRAMFS_FSID_V2 | CRAMFS_SORTED_DIRS);
+  memcpy(super + 16, CRAMFS_SIGNATURE, 16);
+  put_le32(super + 40, c->blocks);
+  put_le32(super + 44, c->files);
+  memcpy(super + 48, "Compressed", 10);
+  inode_put(super + 64, root);
+  if(ftruncate(c->fd, end) != 0 ||
+     pwrite(c->fd, super, sizeof(super), 0) != sizeof(super) ||
+     pwrite(c->fd, c->dirs, c->dirlen, CRAMFS_SUPER) != (ssize_t)c->dirlen)
+    goto fail;
+  /* fsid.crc: crc32 of the whole image with the field itself zero */
+  if(stream_crc_fd(pool, c->fd, 0, end, &crc) != 0)
+    goto fail;
+  put_le32(super + 32, crc);
+  if(pwrite(c->fd, super + 32, 4, 32) != 4)
+    goto fail;
+  if(c->truncated)
+    printf("%s: uids over 65535 or gids over 255 were truncated\n", dir);
+
+  *fd  = c->fd;
+  *len = end;
+  *in  = c->in;
+  c->fd = -1;
+  ret = 0;
+  goto out;
+
+fail:
+  printf("can't make a cramfs image of %s\n", dir);
+out:
+  if(c)
+    {
+      if(c->fd >= 0)
+	close(c->fd);
+      while(c->nbatch > 0)
+	free(c->batch[--c->nbatch].data);
+      free(c->batch);
+      free(c->links);
+      free(c->dirs);
+    }
+  free(c);
+  entry_free(root);
+  return ret;
+}
@@ -0,0 +1,37 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** cramfs.h
+ *
+ * root.cramfs made from a staging directory, as mkcramfs would make it
+ * (version 2, sorted directories, 4K blocks, zlib level 9, padded to a block,
+ * little-endian) but with the blocks compressed on the pool.  Every
+ * block is compressed on its own, so the order they are done in does not
+ * matter; the image is assembled in order as batches finish.
+ */
+
+#ifndef CRAMFS_H
+#define CRAMFS_H
+
+#include <sys/types.h>
+#include "package.h"
+#include "pool.h"
+
+#define CRAMFS_BLOCK       4096        /* PAGE_SIZE of the target */
+#define CRAMFS_JOB_BLOCKS  32          /* blocks of one pool job  */
+#define CRAMFS_BATCH       0x800000    /* input read per round    */
+
+/*
+ * Build the image of dir in an anonymous in-memory file: *fd (the
+ * caller's to close) holding *len bytes, made from *in bytes of files.
+ * With max it gives up as soon as the image can't fit in max bytes.
+ * Returns 0, or -1 after printing why.
+ */
+extern int cramfs_build(const char *dir, pool_t *pool, off_t max, int *fd,
+			off_t *len, off_t *in);
+
+#endif
@@ -13,11 +13,16 @@
 #endif
 #endif
 
+#include <stdlib.h>
+#include <string.h>
 #include "zlib.h"
 
 #define local static
 #define ZEXPORT	/* empty */
 unsigned long crc32 (unsigned long, const unsigned char *, unsigned int);
+uLong crc32_combine (uLong, uLong, unsigned long long);
+int crc32_set_kernel (const char *);
+const char *crc32_kernel_name (int);
 
 #ifdef DYNAMIC_CRC_TABLE
 
@@ -151,10 +156,11 @@ const uLongf * ZEXPORT get_crc_table()
 #define DO8(buf)  DO4(buf); DO4(buf);
 
 /* ========================================================================= */
-uLong ZEXPORT crc32(crc, buf, len)
-    uLong crc;
-    const Bytef *buf;
-    uInt len;
+/*
+ * Byte-at-a-time kernel, the original zlib-1.1.3 loop.  Everything
+ * below must return exactly what this one returns.
+ */
+local uLong crc32_bytewise(uLong crc, const Bytef *buf, uInt len)
 {
 #ifdef DYNAMIC_CRC_TABLE
     if (crc_table_empty)
@@ -172,6 +178,331 @@ uLong ZEXPORT crc32(crc, buf, len)
     return crc ^ 0xffffffffL;
 }
 
+/* ========================================================================= */
+/*
+ * Slicing-by-8/16 tables: crc_slice[k][n] is the CRC of byte n followed
+ * by k zero bytes, so 8 or 16 input bytes can be folded into the register
+ * with independent table lookups instead of a serial chain.  Built once
+ * from crc_table by crc32_init().
+ */
+local uInt crc_slice[16][256];
+
+#define GET32(p) ((uInt)(p)[0] | ((uInt)(p)[1] << 8) | \
+		  ((uInt)(p)[2] << 16) | ((uInt)(p)[3] << 24))
+#define SL(k, w, s) crc_slice[k][((w) >> (s)) & 0xff]
+
+local void make_slice_tables(void)
+{
+  int n, k;
+
+#ifdef DYNAMIC_CRC_TABLE
+  if (crc_table_empty)
+    make_crc_table();
+#endif
+  for (n = 0; n < 256; n++)
+    crc_slice[0][n] = (uInt)crc_table[n];
+  for (n = 0; n < 256; n++)
+    for (k = 1; k < 16; k++)
+      crc_slice[k][n] = (crc_slice[k-1][n] >> 8) ^
+			crc_slice[0][crc_slice[k-1][n] & 0xff];
+}
+
+local uLong crc32_slice8(uLong crc, const Bytef *buf, uInt len)
+{
+    uInt c = (uInt)crc ^ 0xffffffffU;
+    uInt w0, w1;
+
+    while (len >= 8)
+    {
+      w0 = c ^ GET32(buf);
+      w1 = GET32(buf + 4);
+      c = SL(7, w0, 0) ^ SL(6, w0, 8) ^ SL(5, w0, 16) ^ SL(4, w0, 24) ^
+	  SL(3, w1, 0) ^ SL(2, w1, 8) ^ SL(1, w1, 16) ^ SL(0, w1, 24);
+      buf += 8;
+      len -= 8;
+    }
+    while (len--)
+      c = crc_slice[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+    return (uLong)(c ^ 0xffffffffU);
+}
+
+local uLong crc32_slice16(uLong crc, const Bytef *buf, uInt len)
+{
+    uInt c = (uInt)crc ^ 0xffffffffU;
+    uInt w0, w1, w2, w3;
+
+    while (len >= 16)
+    {
+      w0 = c ^ GET32(buf);
+      w1 = GET32(buf + 4);
+      w2 = GET32(buf + 8);
+      w3 = GET32(buf + 12);
+      c = SL(15, w0, 0) ^ SL(14, w0, 8) ^ SL(13, w0, 16) ^ SL(12, w0, 24) ^
+	  SL(11, w1, 0) ^ SL(10, w1, 8) ^ SL(9,  w1, 16) ^ SL(8,  w1, 24) ^
+	  SL(7,  w2, 0) ^ SL(6,  w2, 8) ^ SL(5,  w2, 16) ^ SL(4,  w2, 24) ^
+	  SL(3,  w3, 0) ^ SL(2,  w3, 8) ^ SL(1,  w3, 16) ^ SL(0,  w3, 24);
+      buf += 16;
+      len -= 16;
+    }
+    while (len--)
+      c = crc_slice[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+    return (uLong)(c ^ 0xffffffffU);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_CRC_PCLMUL 1
+#include <immintrin.h>
+
+/*
+ * Carry-less multiply folding, after Gopal et al., "Fast CRC Computation
+ * for Generic Polynomials Using PCLMULQDQ Instruction" (Intel, 2009).
+ * The constants are x^(4*128+32), x^(4*128-32), x^(128+32), x^(128-32),
+ * x^64 mod P and the Barrett pair, all bit-reflected.  Works on whole
+ * 16-byte blocks, at least 64 bytes; the caller does the rest.
+ */
+__attribute__((target("pclmul,sse4.1")))
+local uInt crc32_fold_pclmul(uInt crc, const Bytef *buf, uInt len)
+{
+    static const unsigned long long __attribute__((aligned(16)))
+      k1k2[2] = { 0x0154442bd4ULL, 0x01c6e41596ULL },
+      k3k4[2] = { 0x01751997d0ULL, 0x00ccaa009eULL },
+      k5k0[2] = { 0x0163cd6124ULL, 0x0000000000ULL },
+      poly[2] = { 0x01db710641ULL, 0x01f7011641ULL };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    len -= 64;
+
+    /* fold four lanes of 128 bits in parallel */
+    while (len >= 64)
+    {
+      x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+      x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+      x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+      x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+      x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+      y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+      y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+      y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+      y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+      x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+      x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+      x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+      buf += 64;
+      len -= 64;
+    }
+
+    /* fold the four lanes into one */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* remaining 16-byte blocks */
+    while (len >= 16)
+    {
+      x2 = _mm_loadu_si128((const __m128i *)buf);
+      x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+      buf += 16;
+      len -= 16;
+    }
+
+    /* 128 -> 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (uInt)_mm_extract_epi32(x1, 1);
+}
+
+local uLong crc32_pclmul(uLong crc, const Bytef *buf, uInt len)
+{
+    uInt n;
+
+    if (len < 64)
+      return crc32_slice16(crc, buf, len);
+    n = len & ~15U;
+    crc = (uLong)~crc32_fold_pclmul(~(uInt)crc, buf, n);
+    return crc32_slice16(crc, buf + n, len - n);
+}
+#endif
+
+/* ========================================================================= */
+/*
+ * CRC combination, as in zlib-1.2.12: crc32(A||B) is crc32(A) multiplied
+ * by x^(8*len(B)) modulo P, xor crc32(B).  x2n_table[n] holds x^(2^n) mod
+ * P so any power is a product of at most 64 table entries.
+ */
+#define POLY 0xedb88320U
+
+local uInt x2n_table[32];
+
+local uInt multmodp(uInt a, uInt b)
+{
+    uInt m = 1U << 31, p = 0;
+
+    for (;;) {
+      if (a & m) {
+	p ^= b;
+	if ((a & (m - 1)) == 0)
+	  break;
+      }
+      m >>= 1;
+      b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+    }
+    return p;
+}
+
+local uInt x2nmodp(unsigned long long n, unsigned k)
+{
+    uInt p = 1U << 31;           /* x^0 == 1 */
+
+    while (n) {
+      if (n & 1)
+	p = multmodp(x2n_table[k & 31], p);
+      n >>= 1;
+      k++;
+    }
+    return p;
+}
+
+local void make_x2n_table(void)
+{
+    uInt p = 1U << 30;           /* x^1 */
+    int n;
+
+    x2n_table[0] = p;
+    for (n = 1; n < 32; n++)
+      x2n_table[n] = p = multmodp(p, p);
+}
+
+uLong crc32_combine(uLong crc1, uLong crc2, unsigned long long len2)
+{
+    return multmodp(x2nmodp(len2, 3), (uInt)crc1) ^ (uInt)crc2;
+}
+
+/* ========================================================================= */
+/*
+ * Kernel dispatch.  crc32_init() runs once at startup, builds the slicing
+ * tables and picks the fastest kernel this CPU supports; UPK_CRC_KERNEL
+ * in the environment overrides the choice.  Until then crc32() falls back
+ * to the byte loop, so early callers still get the right answer.
+ */
+typedef uLong (*crc_kernel_t) OF((uLong, const Bytef *, uInt));
+
+local const struct {
+  const char  *name;
+  crc_kernel_t fn;
+} crc_kernels[] = {
+  { "bytewise", crc32_bytewise },
+  { "slice8",   crc32_slice8   },
+  { "slice16",  crc32_slice16  },
+#ifdef HAVE_CRC_PCLMUL
+  { "pclmul",   crc32_pclmul   },
+#endif
+};
+#define NKERNELS (sizeof(crc_kernels)/sizeof(crc_kernels[0]))
+
+local int crc_kernel_cur = 0;
+local crc_kernel_t crc_kernel = crc32_bytewise;
+
+local int crc32_kernel_supported(int k)
+{
+#ifdef HAVE_CRC_PCLMUL
+  if (crc_kernels[k].fn == crc32_pclmul)
+    {
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("pclmul") &&
+	     __builtin_cpu_supports("sse4.1");
+    }
+#endif
+  return 1;
+}
+
+int crc32_set_kernel(const char *name)
+{
+  int k;
+
+  for (k = 0; k < NKERNELS; k++)
+    {
+      if (strcmp(crc_kernels[k].name, name) != 0)
+	continue;
+      if (!crc32_kernel_supported(k))
+	return -1;
+      crc_kernel_cur = k;
+      crc_kernel = crc_kernels[k].fn;
+      return 0;
+    }
+  return -1;
+}
+
+const char *crc32_kernel_name(int k)
+{
+  if (k < 0)
+    k = crc_kernel_cur;
+  if (k >= NKERNELS)
+    return NULL;
+  return crc_kernels[k].name;
+}
+
+__attribute__((constructor))
+local void crc32_init(void)
+{
+  const char *env = getenv("UPK_CRC_KERNEL");
+  int k;
+
+  make_slice_tables();
+  make_x2n_table();
+  if (env && crc32_set_kernel(env) == 0)
+    return;
+  for (k = NKERNELS - 1; k >= 0; k--)
+    if (crc32_kernel_supported(k))
+      break;
+  crc_kernel_cur = k;
+  crc_kernel = crc_kernels[k].fn;
+}
+
+/* ========================================================================= */
+uLong ZEXPORT crc32(crc, buf, len)
+    uLong crc;
+    const Bytef *buf;
+    uInt len;
+{
+    return crc_kernel(crc, buf, len);
+}
+
 #if (CONFIG_COMMANDS & CFG_CMD_JFFS2)
 
 /* No ones complement version. JFFS2 (and other things ?)
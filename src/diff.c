@@ -0,0 +1,306 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** diff.c
+ *
+ *  Compares two finished packages image by image.  Both files are mapped
+ *  and every image the two have in common is cut into DIFF_CHUNK chunks;
+ *  pool jobs of DIFF_JOB chunks memcmp() them, and only the first and
+ *  last chunk of each run that differs are looked at byte by byte to
+ *  report exact ranges.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "upk.h"
+
+#define DIFF_CHUNK   0x10000     /* bytes under one flag      */
+#define DIFF_JOB     64          /* chunks of one pool job    */
+#define DIFF_RANGES  16          /* ranges printed per image  */
+
+typedef struct diff_job {
+  const uint8 *a, *b;
+  size_t       len;              /* bytes of this job, in both */
+  uint8       *differ;           /* a flag per chunk           */
+} diff_job_t;
+
+/* an image of a and its match in b, by name and occurrence (the
+   parts of a split root.cramfs pair up in order) */
+typedef struct diff_image {
+  int          ia, ib;           /* -1: not in that package    */
+  const uint8 *a, *b;
+  size_t       alen, blen;
+  size_t       nchunks;          /* of the bytes both have     */
+  uint8       *differ;
+} diff_image_t;
+
+static void diff_job_run(void *arg)
+{
+  diff_job_t *job = arg;
+  size_t off, n;
+  int k;
+
+  for(k = 0, off = 0; off < job->len; k++, off += n)
+    {
+      n = job->len - off < DIFF_CHUNK ? job->len - off : DIFF_CHUNK;
+      job->differ[k] = memcmp(job->a + off, job->b + off, n) != 0;
+    }
+}
+
+/* the n-th (from 0) image of pkg named name, -1 if none */
+static int find_image(const upk_pkg_t *pkg, const uint8 *name, int n)
+{
+  int i;
+
+  for(i = 0; i < pkg->head.p_imagenum; i++)
+    if(strncmp((const char *)pkg->info[i].i_name, (const char *)name, NAMELEN) == 0 &&
+       n-- == 0)
+      return i;
+  return -1;
+}
+
+static int occurrence(const upk_pkg_t *pkg, int i)
+{
+  int j, n = 0;
+
+  for(j = 0; j < i; j++)
+    if(strncmp((const char *)pkg->info[j].i_name,
+	       (const char *)pkg->info[i].i_name, NAMELEN) == 0)
+      n++;
+  return n;
+}
+
+static int field_diff(const char *what, const uint8 *a, const uint8 *b, size_t len)
+{
+  if(strncmp((const char *)a, (const char *)b, len) == 0)
+    return 0;
+  printf("  %-18s \"%.*s\" -> \"%.*s\"\n", what, (int)len, a, (int)len, b);
+  return 1;
+}
+
+/* what differs outside the images: names, versions, board, hw section */
+static int header_diff(const upk_pkg_t *a, const upk_pkg_t *b)
+{
+  const package_header_t *ha = &a->head, *hb = &b->head;
+  const version_info *va = &a->ver[0], *vb = &b->ver[0];
+  size_t la = a->hw_len - sizeof(signature_t), lb = b->hw_len - sizeof(signature_t);
+  int n = 0;
+
+  if((ha->p_reserve & 3) != (hb->p_reserve & 3))
+    {
+      printf("  %-18s %s -> %s\n", "board", upk_board_by_flash(ha->p_reserve) ?
+	     upk_board_by_flash(ha->p_reserve)->name : "?", upk_board_by_flash(hb->p_reserve) ?
+	     upk_board_by_flash(hb->p_reserve)->name : "?");
+      n++;
+    }
+  n += field_diff("p_name",    ha->p_name,    hb->p_name,    NAMELEN);
+  n += field_diff("p_vuboot",  ha->p_vuboot,  hb->p_vuboot,  VERLEN);
+  n += field_diff("p_vkernel", ha->p_vkernel, hb->p_vkernel, VERLEN);
+  n += field_diff("p_vrootfs", ha->p_vrootfs, hb->p_vrootfs, VERLEN);
+  n += field_diff("upk_desc",  va->upk_desc,  vb->upk_desc,  DESCLEN);
+  n += field_diff("pack_id",   va->pack_id,   vb->pack_id,   NAMELEN);
+  n += field_diff("hw1_ver",   va->hw1_ver,   vb->hw1_ver,   VERLEN);
+  n += field_diff("hw2_ver",   va->hw2_ver,   vb->hw2_ver,   VERLEN);
+  n += field_diff("os_ver",    va->os_ver,    vb->os_ver,    VERLEN);
+  n += field_diff("app_ver",   va->app_ver,   vb->app_ver,   VERLEN);
+  if(la != lb || memcmp(a->map, b->map, la) != 0)
+    {
+      if(la == 0 || lb == 0)
+	printf("  %-18s %s\n", "hw section", la ? "removed" : "added");
+      else
+	printf("  %-18s changed, %zu -> %zu bytes\n", "hw section", la, lb);
+      n++;
+    }
+  return n;
+}
+
+/* first (dir 1) or last (dir -1) byte that differs in [from, to) */
+static size_t first_diff(const diff_image_t *d, size_t from, size_t to, int dir)
+{
+  size_t i;
+
+  if(dir > 0)
+    {
+      for(i = from; i < to - 1 && d->a[i] == d->b[i]; i++)
+	;
+      return i;
+    }
+  for(i = to - 1; i > from && d->a[i] == d->b[i]; i--)
+    ;
+  return i;
+}
+
+static void print_range(size_t start, size_t end, int *printed)
+{
+  if((*printed)++ < DIFF_RANGES)
+    printf("      0x%08zx-0x%08zx (%zu bytes)\n", start, end - 1, end - start);
+}
+
+/* the ranges that differ, exact to the byte at both ends */
+static void print_ranges(const diff_image_t *d)
+{
+  size_t common = d->alen < d->blen ? d->alen : d->blen;
+  size_t s, e, start = 0, end = 0;
+  int open = 0, printed = 0;
+
+  for(s = 0; s < d->nchunks; s = e)
+    {
+      for(; s < d->nchunks && !d->differ[s]; s++)
+	;
+      if(s == d->nchunks)
+	break;
+      for(e = s; e < d->nchunks && d->differ[e]; e++)
+	;
+      start = first_diff(d, s * DIFF_CHUNK, s * DIFF_CHUNK + DIFF_CHUNK < common ?
+			 s * DIFF_CHUNK + DIFF_CHUNK : common, 1);
+      end = first_diff(d, (e - 1) * DIFF_CHUNK, e * DIFF_CHUNK < common ?
+		       e * DIFF_CHUNK : common, -1) + 1;
+      if(e < d->nchunks || d->alen == d->blen)
+	print_range(start, end, &printed);
+      else
+	open = 1;          /* runs on into the bytes only one has */
+    }
+  if(d->alen != d->blen)
+    print_range(open ? start : common, d->alen > d->blen ? d->alen : d->blen,
+		&printed);
+  if(printed > DIFF_RANGES)
+    printf("      ... %d more\n", printed - DIFF_RANGES);
+}
+
+static void print_image(const upk_pkg_t *a, const upk_pkg_t *b, const diff_image_t *d)
+{
+  const image_info_t *ia = d->ia >= 0 ? &a->info[d->ia] : NULL;
+  const image_info_t *ib = d->ib >= 0 ? &b->info[d->ib] : NULL;
+  const image_info_t *iif = ia ? ia : ib;
+  size_t k;
+  int changed = 0;
+
+  printf("  %-18.*s ", NAMELEN, iif->i_name);
+  if(ia == NULL || ib == NULL)
+    {
+      printf("%s, %u bytes\n", ia ? "removed" : "added", iif->i_imagesize);
+      return;
+    }
+  for(k = 0; k < d->nchunks; k++)
+    changed |= d->differ[k];
+  changed |= d->alen != d->blen;
+  if(changed)
+    printf("changed, %zu -> %zu bytes", d->alen, d->blen);
+  if(strncmp((const char *)ia->i_version, (const char *)ib->i_version, VERLEN) != 0)
+    printf("%sversion \"%.*s\" -> \"%.*s\"", changed ? ", " : "",
+	   VERLEN, ia->i_version, VERLEN, ib->i_version);
+  else if(!changed)
+    printf("same");
+  if(ia->i_startaddr_f != ib->i_startaddr_f || ia->i_endaddr_f != ib->i_endaddr_f)
+    printf(", flash 0x%x-0x%x -> 0x%x-0x%x", ia->i_startaddr_f, ia->i_endaddr_f,
+	   ib->i_startaddr_f, ib->i_endaddr_f);
+  printf("\n");
+  if(changed)
+    print_ranges(d);
+}
+
+int upk_diff(const char *pa, const char *pb, pool_t *pool)
+{
+  upk_pkg_t a, b;
+  diff_image_t img[2 * UPK_MAX_IMAGES], *d;
+  diff_job_t *jobs = NULL;
+  pool_group_t grp = POOL_GROUP_INIT;
+  size_t common, off, njobs = 0, k;
+  int i, n = 0, differ, ret = -1;
+
+  memset(img, 0, sizeof(img));
+  if(upk_pkg_open(&a, pa, 0) != 0)
+    return -1;
+  if(upk_pkg_open(&b, pb, 0) != 0)
+    {
+      upk_pkg_close(&a);
+      return -1;
+    }
+  if(upk_pkg_map(&a) != 0 || upk_pkg_map(&b) != 0)
+    {
+      printf("can't map %s\n", a.map ? pb : pa);
+      goto out;
+    }
+  madvise(a.map, a.size, MADV_WILLNEED);
+  madvise(b.map, b.size, MADV_WILLNEED);
+
+  /* pair the images up, a's order first, then those only b has */
+  for(i = 0; i < a.head.p_imagenum; i++, n++)
+    {
+      img[n].ia = i;
+      img[n].ib = find_image(&b, a.info[i].i_name, occurrence(&a, i));
+    }
+  for(i = 0; i < b.head.p_imagenum; i++)
+    if(find_image(&a, b.info[i].i_name, occurrence(&b, i)) < 0)
+      {
+	img[n].ia = -1;
+	img[n++].ib = i;
+      }
+
+  for(d = img; d < img + n; d++)
+    if(d->ia >= 0 && d->ib >= 0)
+      {
+	d->a = a.map + UPK_IMG_OFF(&a, d->ia);
+	d->b = b.map + UPK_IMG_OFF(&b, d->ib);
+	d->alen = a.info[d->ia].i_imagesize;
+	d->blen = b.info[d->ib].i_imagesize;
+	common = d->alen < d->blen ? d->alen : d->blen;
+	d->nchunks = (common + DIFF_CHUNK - 1) / DIFF_CHUNK;
+	njobs += (d->nchunks + DIFF_JOB - 1) / DIFF_JOB;
+	if(d->nchunks && (d->differ = calloc(d->nchunks, 1)) == NULL)
+	  {
+	    printf("out of memory\n");
+	    goto out;
+	  }
+      }
+  if(njobs && (jobs = calloc(njobs, sizeof(*jobs))) == NULL)
+    {
+      printf("out of memory\n");
+      goto out;
+    }
+  for(d = img, k = 0; d < img + n; d++)
+    {
+      common = d->alen < d->blen ? d->alen : d->blen;
+      for(off = 0; off < common; off += (size_t)DIFF_JOB * DIFF_CHUNK, k++)
+	{
+	  jobs[k].a      = d->a + off;
+	  jobs[k].b      = d->b + off;
+	  jobs[k].len    = common - off < (size_t)DIFF_JOB * DIFF_CHUNK ?
+	    common - off : (size_t)DIFF_JOB * DIFF_CHUNK;
+	  jobs[k].differ = d->differ + off / DIFF_CHUNK;
+	  pool_submit(pool, &grp, diff_job_run, &jobs[k]);
+	}
+    }
+
+  /* the headers are compared while the images are */
+  printf("%s -> %s\n", pa, pb);
+  differ = header_diff(&a, &b);
+  pool_wait(pool, &grp);
+
+  for(d = img; d < img + n; d++)
+    {
+      print_image(&a, &b, d);
+      if(d->ia < 0 || d->ib < 0 || d->alen != d->blen ||
+	 strncmp((const char *)a.info[d->ia].i_version,
+		 (const char *)b.info[d->ib].i_version, VERLEN) != 0)
+	differ++;
+      for(k = 0; k < d->nchunks; k++)
+	differ += d->differ[k];
+    }
+  ret = differ ? 1 : 0;
+
+out:
+  for(d = img; d < img + n; d++)
+    free(d->differ);
+  free(jobs);
+  upk_pkg_close(&a);
+  upk_pkg_close(&b);
+  return ret;
+}
@@ -0,0 +1,267 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** extract.c
+ *
+ *  Unpacks a package back into the files it was built from: the images
+ *  (root.cramfs rejoined, ext crc stripped), the MSP430 images of an "hh"
+ *  package and optionally the *.version files, so that the same
+ *  upk-builder command line rebuilds it.  The payloads are moved with
+ *  stream_copy_range(), never through user space.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "upk.h"
+
+/* write len bytes of the package at off into dir/name at out */
+static int extract_range(upk_pkg_t *pkg, const char *dir, const char *name,
+			 off_t out, off_t off, uint32 len)
+{
+  char path[PATH_MAX];
+  int fd, ret;
+
+  if(snprintf(path, sizeof(path), "%s/%s", dir, name) >= sizeof(path))
+    return -1;
+  if((fd = open(path, O_WRONLY | O_CREAT | (out ? 0 : O_TRUNC), 0644)) < 0)
+    {
+      printf("can't create %s\n", path);
+      return -1;
+    }
+  ret = stream_copy_range(pkg->fd, off, fd, out, len);
+  if(close(fd) != 0 || ret != 0)
+    {
+      printf("can not write %s\n", path);
+      return -1;
+    }
+  return 0;
+}
+
+/* the trailing byte the old copy loop added, if the package has one */
+static uint32 strip_eof(upk_pkg_t *pkg, off_t off, uint32 len, int flags)
+{
+  if(!(flags & STREAM_LEGACY_EOF) || len == 0 ||
+     pkg->map[off + len - 1] != LEGACY_EOF_BYTE)
+    return len;
+  return len - 1;
+}
+
+static int write_version(const char *dir, const char *name, const uint8 *ver)
+{
+  char path[PATH_MAX];
+  int n;
+  FILE *fp;
+
+  /* stop at the NUL, and drop the 0xff the old readers stored at EOF */
+  for(n = 0; n < VERLEN && ver[n] != '\0' && ver[n] != LEGACY_EOF_BYTE; n++)
+    ;
+  if(snprintf(path, sizeof(path), "%s/%s", dir, name) >= sizeof(path) ||
+     (fp = fopen(path, "w")) == NULL)
+    {
+      printf("can't create %s/%s\n", dir, name);
+      return -1;
+    }
+  fprintf(fp, "%.*s\n", n, (const char *)ver);
+  if(fclose(fp) != 0)
+    {
+      printf("can not write %s\n", path);
+      return -1;
+    }
+  return 0;
+}
+
+static uint32 rd32(const uint8 *p)
+{
+  uint32 v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/*
+ * The hw section is hw1, hw2_crc, hw2_len, hw2, zero padded (to 8K,
+ * unless built with another alignment); only hw2's length is stored, so
+ * look for the hw1 length that makes it all add up (and the crc match).
+ */
+static int find_hw1_len(const uint8 *hw, uint32 size, uint32 *hw1_len)
+{
+  uint32 o, len, end, i;
+
+  for(o = 0; o + 2 * sizeof(uint32) <= size; o++)
+    {
+      len = rd32(hw + o + sizeof(uint32));
+      end = o + 2 * sizeof(uint32) + len;
+      if(len > size || end > size)
+	continue;
+      for(i = end; i < size && hw[i] == 0; i++)
+	;
+      if(i == size && crc32(0, hw + o + 2 * sizeof(uint32), len) == rd32(hw + o))
+	{
+	  *hw1_len = o;
+	  return 0;
+	}
+    }
+  return -1;
+}
+
+/* whether root.cramfs went into other flash regions than the board's */
+static int other_regions(const upk_board_t *board, const upk_region_t *r, int n)
+{
+  int i;
+
+  if(n > board->nrootfs)
+    return 1;
+  for(i = 0; i < n; i++)
+    if(r[i].start != board->rootfs[i].start || r[i].end != board->rootfs[i].end)
+      return 1;
+  return 0;
+}
+
+static const char *base_name(const char *path)
+{
+  const char *p = strrchr(path, '/');
+
+  return p ? p + 1 : path;
+}
+
+int upk_extract(const char *package, const char *dir, int flags)
+{
+  upk_pkg_t pkg;
+  package_header_t *phd = &pkg.head;
+  image_info_t *iif;
+  char names[UPK_MAX_IMAGES][NAMELEN + 1];
+  const char *name, *ext_ver = NULL;
+  const upk_board_t *board;
+  upk_region_t rootfs[UPK_MAX_REGIONS];
+  uint32 hwsize, hw1_len, len, limit;
+  off_t off, out = 0;
+  int i, n = 0, nrootfs = 0, ret = -1;
+
+  if(upk_pkg_open(&pkg, package, 0) != 0)
+    return -1;
+  if(upk_pkg_map(&pkg) != 0)
+    {
+      printf("%s: can't map the package\n", package);
+      goto out;
+    }
+  /* strip the EOF bytes, and say so in the command, unasked */
+  if(upk_pkg_legacy(&pkg))
+    flags |= STREAM_LEGACY_EOF;
+  if(mkdir(dir, 0755) != 0 && errno != EEXIST)
+    {
+      printf("can't create %s\n", dir);
+      goto out;
+    }
+
+  board = upk_board_by_flash(phd->p_reserve);
+  hwsize = pkg.hw_len - sizeof(signature_t);
+  if(hwsize)
+    {
+      if(find_hw1_len(pkg.map, hwsize, &hw1_len) != 0)
+	{
+	  printf("%s: can't make sense of the hw section\n", package);
+	  goto out;
+	}
+      len = rd32(pkg.map + hw1_len + sizeof(uint32));
+      off = hw1_len + 2 * sizeof(uint32);
+      if(extract_range(&pkg, dir, "hw1.bin", 0, 0,
+		       strip_eof(&pkg, 0, hw1_len, flags)) != 0 ||
+	 extract_range(&pkg, dir, "hw2.bin", 0, off,
+		       strip_eof(&pkg, off, len, flags)) != 0)
+	goto out;
+    }
+
+  for(i = 0; i < phd->p_imagenum; i++)
+    {
+      iif = &pkg.info[i];
+      off = UPK_IMG_OFF(&pkg, i);
+      len = iif->i_imagesize;
+      if(iif->i_type == IH_TYPE_COMPRESS)
+	{
+	  if(len < sizeof(uint32))
+	    goto damaged;
+	  len -= sizeof(uint32);
+	  if(ext_ver == NULL)
+	    ext_ver = (const char *)iif->i_version;
+	}
+      if(iif->i_type == IH_TYPE_CRAMFS && nrootfs < UPK_MAX_REGIONS)
+	{
+	  rootfs[nrootfs].start = iif->i_startaddr_f;
+	  rootfs[nrootfs++].end = iif->i_endaddr_f;
+	}
+      /* a part of root.cramfs that filled its region has no EOF byte */
+      limit = upk_pkg_part_limit(&pkg, i);
+      if(!(limit && len == limit))
+	len = strip_eof(&pkg, off, len, flags);
+
+      if(iif->i_type == IH_TYPE_CRAMFS && out)
+	name = names[n-1];         /* a later part, append to the first */
+      else
+	{
+	  memcpy(names[n], iif->i_name, NAMELEN);
+	  names[n][NAMELEN] = '\0';
+	  name = base_name(names[n]);
+	  if(name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+	    goto damaged;
+	  memmove(names[n], name, strlen(name) + 1);
+	  name = names[n++];
+	  out = 0;
+	}
+      if(extract_range(&pkg, dir, name, out, off, len) != 0)
+	goto out;
+      printf("%s/%s\n", dir, name);
+      out = (limit && len == limit) ? out + len : 0;
+    }
+
+  if(flags & UPK_EXTRACT_VERSIONS)
+    {
+      /* the builder wants these three even when the image is not there */
+      if(write_version(dir, UBOOT_VER_FILE,  phd->p_vuboot) != 0 ||
+	 write_version(dir, KERNEL_VER_FILE, phd->p_vkernel) != 0 ||
+	 write_version(dir, ROOTFS_VER_FILE, phd->p_vrootfs) != 0)
+	goto out;
+      if(ext_ver && write_version(dir, EXTAPP_VER_FILE, (const uint8 *)ext_ver) != 0)
+	goto out;
+      if(hwsize && (write_version(dir, HW1_VER_FILE, pkg.ver[0].hw1_ver) != 0 ||
+		    write_version(dir, HW2_VER_FILE, pkg.ver[0].hw2_ver) != 0))
+	goto out;
+    }
+
+  /* the command line that builds it again */
+  printf("upk-builder%s", (flags & STREAM_LEGACY_EOF) ? " --legacy-eof" : "");
+  if(board && board != upk_board_default())
+    printf(" --board=%s", board->name);
+  /* its own size is an alignment that pads the hw section just so */
+  if(hwsize && (hwsize % SZ_8K != 0 || hwsize > HW_MAX_LEN))
+    printf(" --hw-align=%u", hwsize);
+  /* --rootfs regions: the ones root.cramfs was cut at are all that
+     matter, later ones were never reached */
+  if(board && other_regions(board, rootfs, nrootfs))
+    for(i = 0; i < nrootfs; i++)
+      printf("%s0x%x-0x%x", i ? "," : " --rootfs=", rootfs[i].start, rootfs[i].end);
+  printf(" %s \"%.*s\" %.*s", hwsize ? "hh" : "nh", DESCLEN, pkg.ver[0].upk_desc,
+	 NAMELEN, phd->p_name);
+  if(hwsize)
+    printf(" hw1.bin hw2.bin");
+  for(i = 0; i < n; i++)
+    printf(" %s", names[i]);
+  printf("\n");
+  ret = 0;
+  goto out;
+
+damaged:
+  printf("%s: damaged image table\n", package);
+out:
+  upk_pkg_close(&pkg);
+  return ret;
+}
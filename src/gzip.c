@@ -0,0 +1,102 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** gzip.c
+ *
+ *  Deflate on the system zlib, see gzip.h.  The gzip header and trailer
+ *  are written by tgz.c with our own crc32(); zlib only ever sees raw
+ *  deflate, so it never computes one itself.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#include <zlib.h>
+#endif
+#include "gzip.h"
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+
+int gzip_block(const unsigned char *in, size_t len,
+	       const unsigned char *dict, size_t dictlen, int level,
+	       int last, unsigned char **out, size_t *outlen)
+{
+  z_stream strm;
+  size_t cap;
+  int ret;
+
+  strm.zalloc = Z_NULL;
+  strm.zfree  = Z_NULL;
+  strm.opaque = Z_NULL;
+  if(deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return -1;
+  if(dictlen && deflateSetDictionary(&strm, dict, dictlen) != Z_OK)
+    {
+      deflateEnd(&strm);
+      return -1;
+    }
+  /* the bound covers the final block; a sync flush adds at most 5 bytes
+     for its empty stored block, and the bits before it one more */
+  cap = deflateBound(&strm, len) + 8;
+  if((*out = malloc(cap)) == NULL)
+    {
+      deflateEnd(&strm);
+      return -1;
+    }
+  strm.next_in   = (Bytef *)in;
+  strm.avail_in  = len;
+  strm.next_out  = *out;
+  strm.avail_out = cap;
+  ret = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+  *outlen = cap - strm.avail_out;
+  deflateEnd(&strm);
+  if(strm.avail_in != 0 || (last ? ret != Z_STREAM_END : ret != Z_OK))
+    {
+      free(*out);
+      *out = NULL;
+      return -1;
+    }
+  return 0;
+}
+
+size_t gzip_zlib_bound(size_t len)
+{
+  return compressBound(len);
+}
+
+int gzip_zlib(const unsigned char *in, size_t len, int level,
+	      unsigned char *out, size_t *outlen)
+{
+  uLongf n = compressBound(len);
+
+  if(compress2(out, &n, in, len, level) != Z_OK)
+    return -1;
+  *outlen = n;
+  return 0;
+}
+
+#else
+
+int gzip_block(const unsigned char *in, size_t len,
+	       const unsigned char *dict, size_t dictlen, int level,
+	       int last, unsigned char **out, size_t *outlen)
+{
+  return -1;
+}
+
+size_t gzip_zlib_bound(size_t len)
+{
+  return len + 64;
+}
+
+int gzip_zlib(const unsigned char *in, size_t len, int level,
+	      unsigned char *out, size_t *outlen)
+{
+  return -1;
+}
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** gzip.h
+ *
+ * The one place that talks to the system zlib.  gzip.c includes its
+ * <zlib.h> and nothing of ours: our zlib.h and crc32() would clash with
+ * it, so only plain C types cross this header.
+ */
+
+#ifndef GZIP_H
+#define GZIP_H
+
+#include <stddef.h>
+
+/*
+ * Raw deflate of one block of a pigz-style stream: primed with dict (the
+ * bytes just before it, up to 32K), ended with a sync flush so the next
+ * block's output can simply follow, or with the final block if last.
+ * *out is malloc()ed.  Returns 0, or -1 (always, without zlib).
+ */
+extern int gzip_block(const unsigned char *in, size_t len,
+		      const unsigned char *dict, size_t dictlen, int level,
+		      int last, unsigned char **out, size_t *outlen);
+
+/* a zlib stream (header, deflate, adler32) of in, as compress2() makes
+   it, into out of gzip_zlib_bound(len) bytes.  0 or -1 */
+extern size_t gzip_zlib_bound(size_t len);
+extern int    gzip_zlib(const unsigned char *in, size_t len, int level,
+			unsigned char *out, size_t *outlen);
+
+#endif
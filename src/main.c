@@ -0,0 +1,438 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** main.c
+ *
+ *  upk-builder command line, a thin wrapper around libupk.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "upk.h"
+#include "stream.h"
+
+static const struct option long_opts[] = {
+  { "legacy-eof",   no_argument, NULL, 'L' },
+  { "no-zero-copy", no_argument, NULL, 'Z' },
+  { "threads",      required_argument, NULL, 'j' },
+  { "cache",        required_argument, NULL, 'C' },
+  { "cache-verify", no_argument, NULL, 'V' },
+  { "image-version", required_argument, NULL, 'I' },
+  { "with-versions", no_argument, NULL, 'E' },
+  { "manifest",     required_argument, NULL, 'M' },
+  { "output",       required_argument, NULL, 'o' },
+  { "board",        required_argument, NULL, 'B' },
+  { "variant",      required_argument, NULL, 'A' },
+  { "rootfs",       required_argument, NULL, 'R' },
+  { "hw-align",     required_argument, NULL, 'H' },
+  { "stats",        required_argument, NULL, 'S' },
+  { "fsync",        no_argument, NULL, 'F' },
+  { "io-uring",     no_argument, NULL, 'U' },
+  { "memo",         required_argument, NULL, 'K' },
+  { "verbose",      no_argument, NULL, 'v' },
+  { "help",         no_argument, NULL, 'h' },
+  { NULL, 0, NULL, 0 }
+};
+
+static void usage(void)
+{
+  printf("usage: packet [options] flag upk_desc package_name hw1 hw2 image1 image2 ...\n");
+  printf("       packet [options] --manifest=file\n");
+  printf("       packet [options] batch manifest\n");
+  printf("       packet [options] update package image [name]\n");
+  printf("       packet [options] verify package ...\n");
+  printf("       packet [options] extract package dir\n");
+  printf("       packet [options] diff old_package new_package\n");
+  printf("options:\n");
+  printf("  --legacy-eof   reproduce old packages byte for byte: every image\n"
+	 "                 gets the trailing 0xff byte the old copy loop wrote\n");
+  printf("  --no-zero-copy copy images through user-space buffers instead of\n"
+	 "                 reflink/copy_file_range\n");
+  printf("  -j, --threads=N hash images (and build batch packages) on N\n"
+	 "                 threads (0: one per CPU)\n");
+  printf("  --cache=DIR    keep input CRCs in DIR and reuse them while the\n"
+	 "                 inputs are unchanged; safe to share between builders\n");
+  printf("  --cache-verify also compare a sampled content hash before\n"
+	 "                 trusting a cached CRC\n");
+  printf("  --image-version=VER  update: also set the version of the\n"
+	 "                 replaced image (and of the package, for\n"
+	 "                 uImage, root.cramfs and u-boot.bin)\n");
+  printf("  --with-versions  extract: also write the *.version files\n");
+  printf("  -o, --output=FILE write the package to FILE (- for stdout, which\n"
+	 "                 may be a pipe) instead of package_name; package_name\n"
+	 "                 is still what the package calls itself; builds\n"
+	 "                 only\n");
+  printf("  --board=NAME   build for the 16M or 8M board (default %s)\n",
+	 upk_board_default()->name);
+  printf("  --rootfs=START-END,...  put root.cramfs in these flash regions\n"
+	 "                 instead of the board's, cut across as many as needed\n");
+  printf("  --hw-align=ALIGN[,MAX]  pad the hw section to a multiple of ALIGN\n"
+	 "                 bytes (default 8K) and allow up to MAX of them\n"
+	 "                 (default: no limit; 14 x 8K without this option)\n");
+  printf("  --variant=BOARD:hh|nh:PACKAGE[:DESC]  also build PACKAGE from the\n"
+	 "                 same images for BOARD, with or without the hw images\n"
+	 "                 and with its own upk_desc; may be repeated, every\n"
+	 "                 input is still read and hashed only once\n");
+  printf("  --stats=json[:FILE]  time every phase (open, read, hash, write,\n"
+	 "                 fsync) of every package and image and write it all\n"
+	 "                 as JSON to FILE, or to stderr\n");
+  printf("  --fsync        fsync() each package before it counts as written\n");
+  printf("  --io-uring     read all images and write the package through one\n"
+	 "                 io_uring queue (plain reads where unavailable)\n");
+  printf("  --memo=DIR     keep every package built in DIR and, when one is\n"
+	 "                 wanted again from the same inputs, flags, board and\n"
+	 "                 versions, reflink or hard link it from there instead\n"
+	 "                 of writing it; input CRCs go to DIR/crc unless --cache;\n"
+	 "                 not with -o\n");
+  printf("  -v, --verbose  also dump every header built\n");
+}
+
+/* --stats=json[:FILE] */
+static int stats_file(const char *arg, const char **file)
+{
+  if(strncmp(arg, "json", 4) != 0 || (arg[4] != '\0' && arg[4] != ':'))
+    {
+      printf("bad --stats, want json[:FILE]\n");
+      return(-1);
+    }
+  *file = arg[4] ? arg + 5 : NULL;
+  return 0;
+}
+
+static int write_stats(upk_stats_t *stats, const char *file)
+{
+  FILE *fp;
+  int ret;
+
+  if(stats == NULL)
+    return 0;
+  if(file == NULL)
+    return upk_stats_json(stats, stderr);
+  if((fp = fopen(file, "w")) == NULL)
+    {
+      printf("Can't open %s\n", file);
+      return(-1);
+    }
+  ret = upk_stats_json(stats, fp);
+  if(fclose(fp) != 0)
+    ret = -1;
+  return ret;
+}
+
+/* the commands that don't build a package */
+static int subcommand(const char *cmd)
+{
+  return strcmp(cmd, "batch") == 0 || strcmp(cmd, "verify") == 0 ||
+    strcmp(cmd, "update") == 0 || strcmp(cmd, "extract") == 0 ||
+    strcmp(cmd, "diff") == 0;
+}
+
+/* BOARD:hh|nh:PACKAGE[:DESC] */
+static int add_variant(upk_writer_t *w, char *arg)
+{
+  char *f[4] = { NULL, NULL, NULL, NULL };
+  int n;
+
+  for(n = 0; n < 4 && arg; n++)
+    {
+      f[n] = arg;
+      if(n < 3 && (arg = strchr(arg, ':')) != NULL)
+	*arg++ = '\0';
+    }
+  if(n < 3 || (strcmp(f[1], "hh") != 0 && strcmp(f[1], "nh") != 0))
+    {
+      printf("bad variant, want BOARD:hh|nh:PACKAGE[:DESC]\n");
+      return(-1);
+    }
+  return upk_writer_add_variant(w, f[0], strcmp(f[1], "hh") == 0, f[3], f[2]);
+}
+
+int main(int argc, char *argv[])
+{
+  upk_writer_t *w;
+  pool_t *pool = NULL;
+  crc_cache_t *cache = NULL;
+  const char *package = NULL, *cache_dir = NULL, *image_version = NULL;
+  const char *manifest = NULL, *output = NULL, *board = NULL, *cmd;
+  const char *hw_align = NULL, *stats_json = NULL, *memo_dir = NULL;
+  char memo_cache[PATH_MAX];
+  upk_stats_t *stats = NULL;
+  memo_t *memo = NULL;
+  upk_region_t rootfs[UPK_MAX_REGIONS];
+  int nrootfs = 0;
+  char *variants[16];
+  int nvariants = 0;
+  int out_fd = -1;
+  struct stat st;
+  int c, ret, bad, threads = 1, cache_flags = 0, extract_flags = 0;
+  int copy_flags = STREAM_ZERO_COPY;
+
+  while((c = getopt_long(argc, argv, "+hj:o:v", long_opts, NULL)) != -1)
+    {
+      switch(c)
+	{
+	case 'L':
+	  copy_flags |= STREAM_LEGACY_EOF;
+	  break;
+	case 'Z':
+	  copy_flags &= ~STREAM_ZERO_COPY;
+	  break;
+	case 'j':
+	  threads = atoi(optarg);
+	  break;
+	case 'C':
+	  cache_dir = optarg;
+	  break;
+	case 'V':
+	  cache_flags |= CRC_CACHE_VERIFY;
+	  break;
+	case 'I':
+	  image_version = optarg;
+	  break;
+	case 'E':
+	  extract_flags |= UPK_EXTRACT_VERSIONS;
+	  break;
+	case 'M':
+	  manifest = optarg;
+	  break;
+	case 'o':
+	  output = optarg;
+	  break;
+	case 'B':
+	  board = optarg;
+	  break;
+	case 'H':
+	  hw_align = optarg;
+	  break;
+	case 'R':
+	  if((nrootfs = upk_board_parse_regions(optarg, rootfs, UPK_MAX_REGIONS)) < 0)
+	    return(-1);
+	  break;
+	case 'S':
+	  if(stats_file(optarg, &stats_json) != 0)
+	    return(-1);
+	  if(stats == NULL && (stats = upk_stats_new()) == NULL)
+	    return(-1);
+	  break;
+	case 'F':
+	  copy_flags |= STREAM_FSYNC;
+	  break;
+	case 'U':
+	  copy_flags |= STREAM_URING;
+	  break;
+	case 'K':
+	  memo_dir = optarg;
+	  break;
+	case 'v':
+	  upk_set_log_level(2);
+	  break;
+	case 'A':
+	  if(nvariants == sizeof(variants) / sizeof(variants[0]))
+	    {
+	      printf("too many variants\n");
+	      return(-1);
+	    }
+	  variants[nvariants++] = optarg;
+	  break;
+	default:
+	  usage();
+	  return(-1);
+	}
+    }
+  /* leave the positional arguments where the code below expects them */
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  /* a manifest stands in for the build arguments */
+  cmd = manifest ? "" : argc > 1 ? argv[1] : "";
+  /* exactly the arguments each command takes: options stop at the
+     command, so one given after it must not be silently dropped */
+  if(manifest)
+    bad = argc != 1;
+  else if(strcmp(cmd, "batch") == 0)
+    bad = argc != 3;
+  else if(strcmp(cmd, "verify") == 0)
+    bad = argc < 3;
+  else if(strcmp(cmd, "update") == 0)
+    bad = argc != 4 && argc != 5;
+  else if(strcmp(cmd, "extract") == 0 || strcmp(cmd, "diff") == 0)
+    bad = argc != 4;
+  else
+    bad = argc < 4;
+  /* only a build writes a package, so only a build takes -o; a stream
+     can't be linked to or from the memo store */
+  if(output && (subcommand(cmd) || memo_dir))
+    bad = 1;
+
+  /* opened once the arguments are known good, not to truncate it for
+     nothing; the package owns stdout, everything we have to say goes to
+     stderr */
+  if(!bad && output && strcmp(output, "-") == 0)
+    {
+      if((out_fd = dup(STDOUT_FILENO)) < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+	return(-1);
+    }
+  else if(!bad && output)
+    {
+      /* a hard link, into a --memo store say, is replaced rather than
+	 truncated under its other names */
+      if(stat(output, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1)
+	unlink(output);
+      if((out_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+	{
+	  printf("Can't open %s\n", output);
+	  return(-1);
+	}
+    }
+
+  printf("\npackage tool version %s ", VERSION);
+  printf("for %s board\n\n", board ? board : upk_board_default()->name);
+
+  if(bad)
+    {
+      if(output && memo_dir)
+	printf("-o and --memo don't go together\n");
+      for(c = 2; subcommand(cmd) && c < argc; c++)
+	if(argv[c][0] == '-' && argv[c][1] != '\0')
+	  printf("options go before the command: %s\n", argv[c]);
+      usage();
+      return(-1);
+    }
+
+  if(threads != 1 && (pool = pool_create(threads)) == NULL)
+    {
+      printf("can't start %d threads\n", threads);
+      return(-1);
+    }
+
+  /* the key needs every input's crc: without a cache of its own the
+     store keeps one, so an unchanged input is not read again */
+  if(memo_dir)
+    {
+      if((memo = memo_new(memo_dir)) == NULL)
+	return(-1);
+      if(cache_dir == NULL)
+	{
+	  snprintf(memo_cache, sizeof(memo_cache), "%s/crc", memo_dir);
+	  cache_dir = memo_cache;
+	}
+    }
+  if(cache_dir)
+    {
+      if((cache = crc_cache_new()) == NULL ||
+	 crc_cache_set_dir(cache, cache_dir, cache_flags) != 0)
+	return(-1);
+    }
+
+  if(strcmp(cmd, "batch") == 0)
+    {
+      ret = upk_batch(argv[2], copy_flags, pool, cache, stats, memo);
+      if(write_stats(stats, stats_json) != 0)
+	ret = -1;
+      upk_stats_free(stats);
+      memo_free(memo);
+      crc_cache_free(cache);
+      pool_destroy(pool);
+      return ret == 0 ? 0 : -1;
+    }
+
+  if(strcmp(cmd, "verify") == 0)
+    {
+      int i, bad = 0;
+
+      for(i = 2; i < argc; i++)
+	if(upk_verify(argv[i], pool) != 0)
+	  bad++;
+      memo_free(memo);
+      crc_cache_free(cache);
+      pool_destroy(pool);
+      return bad ? -1 : 0;
+    }
+
+  if(strcmp(cmd, "extract") == 0)
+    {
+      ret = upk_extract(argv[2], argv[3],
+			extract_flags | (copy_flags & STREAM_LEGACY_EOF));
+      memo_free(memo);
+      crc_cache_free(cache);
+      pool_destroy(pool);
+      return ret;
+    }
+
+  if(strcmp(cmd, "diff") == 0)
+    {
+      ret = upk_diff(argv[2], argv[3], pool);
+      memo_free(memo);
+      crc_cache_free(cache);
+      pool_destroy(pool);
+      return ret < 0 ? 2 : ret;      /* as cmp(1) */
+    }
+
+  if(strcmp(cmd, "update") == 0)
+    {
+      stream_opts_t opts = { copy_flags, pool, cache };
+
+      ret = upk_update(argv[2], argv[3], argc > 4 ? argv[4] : NULL,
+		       image_version, &opts);
+      memo_free(memo);
+      crc_cache_free(cache);
+      pool_destroy(pool);
+      return ret;
+    }
+
+  if((w = upk_writer_new()) == NULL)
+    {
+      printf("out of memory\n");
+      return(-1);
+    }
+  upk_writer_set_copy(w, copy_flags, pool);
+  upk_writer_set_cache(w, cache);
+  upk_writer_set_stats(w, stats);
+  upk_writer_set_memo(w, memo);
+  ret = (board && upk_writer_set_board(w, board) != 0) ? -1 : 0;
+  if(ret == 0 && hw_align)
+    ret = upk_parse_hw_align(w, hw_align);
+  if(ret == 0 && nrootfs)
+    ret = upk_writer_set_rootfs(w, rootfs, nrootfs);
+  for(c = 0; ret == 0 && c < nvariants; c++)
+    ret = add_variant(w, variants[c]);
+  if(ret == 0 && manifest)
+    ret = upk_writer_load(w, manifest, &package);
+  else if(ret == 0)
+    ret = upk_writer_args(w, argc - 1, &argv[1], &package);
+  /* package is NULL for a manifest that only lists variants */
+  if(ret == 0 && package && out_fd >= 0)
+    {
+      ret = upk_writer_write_fd(w, package, out_fd);
+      if(close(out_fd) != 0 && ret == 0)
+	{
+	  printf("can not write %s\n", output);
+	  ret = -1;
+	}
+    }
+  else if(ret == 0 && package)
+    ret = upk_writer_write(w, package);
+  if(ret == 0 && upk_writer_write_variants(w) != 0)
+    ret = -1;
+  if(write_stats(stats, stats_json) != 0)
+    ret = -1;
+
+  upk_writer_free(w);
+  upk_stats_free(stats);
+  memo_free(memo);
+  crc_cache_free(cache);
+  pool_destroy(pool);
+
+  return ret;
+}
@@ -0,0 +1,292 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** manifest.c
+ *
+ *  Reads a build manifest, one "key = value" per line, into a writer:
+ *
+ *    # safe.upk for the 16M board
+ *    package        = safe.upk
+ *    desc           = Safer UPK
+ *    board          = 16M
+ *    dir            = images
+ *    image          = uImage
+ *    image          = root.cramfs
+ *    image          = build/programs.tgz compress
+ *    uImage.version = 2.34-5.67-8.90
+ *    rootfs.version = 3.45-6.78-9.01
+ *
+ * Paths are relative to the manifest.  An image may name its type
+ * (uboot, script, kernel, cramfs, compress) instead of relying on its
+ * file name, and a version given here is used instead of the matching
+ * *.version file; the others are still read from dir, once per package.
+ * "rootfs = START-END ..." replaces the board's rootfs regions; a big
+ * root.cramfs is cut across as many of them as it needs, and
+ * "hw_align = ALIGN [MAX]" pads the hw section to ALIGN bytes instead of
+ * 8K, at most MAX of them (none if not given).
+ *
+ * Instead of (or as well as) one package, a manifest may list variants
+ * of it, built from one read of the images (see
+ * upk_writer_write_variants()):
+ *
+ *    hw             = hw1.bin hw2.bin
+ *    #              board flag upk_desc     package
+ *    variant        = 16M   hh   "Full UPK"   full-16M.upk
+ *    variant        = 8M    nh   "Safer UPK"  safe-8M.upk
+ *
+ * upk_writer_args() does the same from upk-builder's own arguments, for
+ * the command line and for the lines of a batch manifest.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <libgen.h>
+#include "upk.h"
+
+static const struct {
+  const char *name;
+  int         type;
+} image_types[] = {
+  { "uboot",    IH_TYPE_UBOOT },
+  { "script",   IH_TYPE_SCRIPT },
+  { "kernel",   IH_TYPE_KERNEL },
+  { "cramfs",   IH_TYPE_CRAMFS },
+  { "compress", IH_TYPE_COMPRESS },
+};
+
+int upk_split_line(char *p, char *argv[], int max)
+{
+  int argc = 0;
+  char quote, *out;
+
+  while(1)
+    {
+      while(isspace((unsigned char)*p))
+	p++;
+      if(*p == '\0' || *p == '#')
+	return argc;
+      if(argc == max)
+	return -1;
+
+      argv[argc++] = out = p;
+      quote = 0;
+      while(*p && (quote || !isspace((unsigned char)*p)))
+	{
+	  if(quote && *p == quote)
+	    quote = 0;
+	  else if(!quote && (*p == '"' || *p == '\''))
+	    quote = *p;
+	  else
+	    *out++ = *p;
+	  p++;
+	}
+      if(quote)
+	return -1;
+      if(*p)
+	p++;
+      *out = '\0';
+    }
+}
+
+int upk_parse_hw_align(upk_writer_t *w, const char *val)
+{
+  unsigned long align, max = 0;
+  char *e;
+
+  align = strtoul(val, &e, 0);
+  if(*e == ',' || isspace((unsigned char)*e))
+    max = strtoul(e + 1, &e, 0);
+  if(e == val || *e != '\0' || align > 0xffffffffUL || max > 0xffffffffUL)
+    {
+      printf("bad hw alignment, want ALIGN[,MAX]\n");
+      return -1;
+    }
+  return upk_writer_set_hw_align(w, align, max);
+}
+
+static char *trim(char *p)
+{
+  char *e;
+
+  while(isspace((unsigned char)*p))
+    p++;
+  for(e = p + strlen(p); e > p && isspace((unsigned char)e[-1]); e--)
+    ;
+  *e = '\0';
+  if(e - p >= 2 && (*p == '"' || *p == '\'') && e[-1] == *p)
+    {
+      e[-1] = '\0';
+      p++;
+    }
+  return p;
+}
+
+static int manifest_line(upk_writer_t *w, char *key, char *val, char *hw[2])
+{
+  char *argv[4];
+  upk_region_t r[UPK_MAX_REGIONS];
+  int argc, i;
+  size_t n = strlen(key);
+
+  if(strcmp(key, "package") == 0)
+    return upk_writer_set_output(w, val);
+  if(strcmp(key, "desc") == 0)
+    return upk_writer_set_desc(w, val);
+  if(strcmp(key, "board") == 0)
+    return upk_writer_set_board(w, val);
+  if(strcmp(key, "hw_align") == 0)
+    return upk_parse_hw_align(w, val);
+  if(strcmp(key, "rootfs") == 0)
+    {
+      if((argc = upk_board_parse_regions(val, r, UPK_MAX_REGIONS)) < 0)
+	return -1;
+      return upk_writer_set_rootfs(w, r, argc);
+    }
+  if(strcmp(key, "variant") == 0)
+    {
+      if(upk_split_line(val, argv, 4) != 4 ||
+	 (strcmp(argv[1], "hh") != 0 && strcmp(argv[1], "nh") != 0))
+	return -1;
+      return upk_writer_add_variant(w, argv[0], strcmp(argv[1], "hh") == 0,
+				    argv[2], argv[3]);
+    }
+  if(strcmp(key, "hw") == 0)
+    {
+      free(hw[0]);
+      free(hw[1]);
+      hw[0] = hw[1] = NULL;
+      if(upk_split_line(val, argv, 3) != 2 ||
+	 (hw[0] = strdup(argv[0])) == NULL || (hw[1] = strdup(argv[1])) == NULL)
+	return -1;
+      return 0;
+    }
+  if(strcmp(key, "image") == 0)
+    {
+      argc = upk_split_line(val, argv, 3);
+      if(argc == 1)
+	return upk_writer_add_image(w, argv[0]);
+      if(argc != 2)
+	return -1;
+      for(i = 0; i < sizeof(image_types) / sizeof(image_types[0]); i++)
+	if(strcmp(argv[1], image_types[i].name) == 0)
+	  return upk_writer_add_image_type(w, argv[0], image_types[i].type);
+      printf("unknown image type: %s\n", argv[1]);
+      return -1;
+    }
+  if(n > 8 && strcmp(key + n - 8, ".version") == 0)
+    return upk_writer_set_version(w, key, val);
+  printf("unknown key: %s\n", key);
+  return -1;
+}
+
+int upk_writer_args(upk_writer_t *w, int argc, char *argv[],
+		    const char **package)
+{
+  int flag, img_pos, i;
+
+  if(argc >= 1 && strcmp(argv[0], "hh") == 0)
+    {
+      flag = 1;    /* has hw */
+      img_pos = 5;
+    }
+  else if(argc >= 1 && strcmp(argv[0], "nh") == 0)
+    {
+      flag = 0;    /* has no hw*/
+      img_pos = 3;
+    }
+  else
+    {
+      printf("ERROR:pass wrong flag\n");
+      return(-1);
+    }
+
+  if(argc < img_pos+1)
+    {
+      if(flag)
+	  printf("usage: packet flag upk_desc package_name hw1 hw2 image1 image2 ...\n");
+      else
+	  printf("usage: packet flag upk_desc package_name image1 image2 ...\n");
+      return(-1);
+    }
+
+  if(upk_writer_set_desc(w, argv[1]) != 0)
+    return(-1);
+  if(flag && upk_writer_set_hw(w, argv[3], argv[4]) != 0)
+    return(-1);
+  for(i = img_pos; i < argc; i++)
+    if(upk_writer_add_image(w, argv[i]) != 0)
+      return(-1);
+  *package = argv[2];
+  return 0;
+}
+
+int upk_writer_load(upk_writer_t *w, const char *manifest, const char **package)
+{
+  FILE *fp;
+  char *line = NULL, *copy, *base, *eq, *hw[2] = { NULL, NULL };
+  char dir[PATH_MAX] = "";
+  size_t cap = 0;
+  int lineno = 0, ret = -1;
+
+  if((fp = fopen(manifest, "r")) == NULL)
+    {
+      printf("Can't open manifest: %s\n", manifest);
+      return(-1);
+    }
+  if((copy = strdup(manifest)) == NULL)
+    {
+      fclose(fp);
+      return(-1);
+    }
+  base = dirname(copy);
+
+  while(getline(&line, &cap, fp) > 0)
+    {
+      lineno++;
+      eq = trim(line);
+      if(*eq == '\0' || *eq == '#')
+	continue;
+      if((eq = strchr(line, '=')) == NULL)
+	goto bad;
+      *eq = '\0';
+      if(strcmp(trim(line), "dir") == 0)
+	{
+	  eq = trim(eq + 1);
+	  if(eq[0] == '/' ? snprintf(dir, sizeof(dir), "%s", eq) >= sizeof(dir)
+	     : snprintf(dir, sizeof(dir), "%s/%s", base, eq) >= sizeof(dir))
+	    goto bad;
+	}
+      else if(manifest_line(w, trim(line), trim(eq + 1), hw) != 0)
+	goto bad;
+    }
+
+  if(upk_writer_output(w) == NULL && upk_writer_variants(w) == 0)
+    {
+      printf("%s: no package given\n", manifest);
+      goto out;
+    }
+  if(upk_writer_set_dir(w, dir[0] ? dir : base) != 0 ||
+     (hw[0] && upk_writer_set_hw(w, hw[0], hw[1]) != 0))
+    goto out;
+  *package = upk_writer_output(w);
+  ret = 0;
+  goto out;
+
+bad:
+  printf("%s:%d: bad manifest line\n", manifest, lineno);
+out:
+  free(hw[0]);
+  free(hw[1]);
+  free(line);
+  free(copy);
+  fclose(fp);
+  return ret;
+}
@@ -0,0 +1,222 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** memo.c
+ *
+ *  The package store, see memo.h.  An entry is DIR/KEY.upk.
+ *
+ *  Putting a file in place, whichever way round, goes through a
+ *  temporary name next to the destination: a reflink (FICLONE) into a
+ *  new file, or a hard link, or failing both (another filesystem) a
+ *  copy, then rename() over the destination.  A destination that was a
+ *  hard link into the store is replaced, never written through.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+#include "memo.h"
+#include "stream.h"
+
+#define FNV_BASIS  0xcbf29ce484222325ULL
+#define FNV_PRIME  0x100000001b3ULL
+
+struct memo {
+  char *dir;
+};
+
+static unsigned tmp_seq;        /* names of this process's temporaries */
+
+memo_t *memo_new(const char *dir)
+{
+  memo_t *memo;
+
+  if(mkdir(dir, 0777) != 0 && access(dir, W_OK) != 0)
+    {
+      printf("can't use memo directory %s\n", dir);
+      return NULL;
+    }
+  if((memo = calloc(1, sizeof(*memo))) == NULL ||
+     (memo->dir = strdup(dir)) == NULL)
+    {
+      free(memo);
+      return NULL;
+    }
+  return memo;
+}
+
+void memo_free(memo_t *memo)
+{
+  if(memo == NULL)
+    return;
+  free(memo->dir);
+  free(memo);
+}
+
+void memo_hash_init(memo_hash_t *h)
+{
+  h->crc = 0;
+  h->fnv = FNV_BASIS;
+}
+
+void memo_hash_add(memo_hash_t *h, const void *buf, size_t len)
+{
+  const uint8 *p = buf;
+  size_t i;
+
+  h->crc = crc32(h->crc, p, len);
+  for(i = 0; i < len; i++)
+    h->fnv = (h->fnv ^ p[i]) * FNV_PRIME;
+}
+
+void memo_hash_key(const memo_hash_t *h, char *key)
+{
+  snprintf(key, MEMO_KEY_LEN, "%08x%016llx", h->crc, (unsigned long long)h->fnv);
+}
+
+static int entry_path(const memo_t *memo, const char *key, char *path)
+{
+  return snprintf(path, PATH_MAX, "%s/%s.upk", memo->dir, key) < PATH_MAX ? 0 : -1;
+}
+
+int memo_open(memo_t *memo, const char *key)
+{
+  char path[PATH_MAX];
+
+  if(entry_path(memo, key, path) != 0)
+    return -1;
+  return open(path, O_RDONLY);
+}
+
+int memo_tmp(const char *path, char *tmp, size_t len)
+{
+  int fd;
+
+  do
+    {
+      if(snprintf(tmp, len, "%s.%ld.%u", path, (long)getpid(),
+		  __atomic_fetch_add(&tmp_seq, 1, __ATOMIC_RELAXED)) >= (int)len)
+	return -1;
+      fd = open(tmp, O_RDWR | O_CREAT | O_EXCL, 0666);
+    }
+  while(fd < 0 && errno == EEXIST);
+  return fd;
+}
+
+/* a hard link to src named tmp, made up next to dst */
+static int link_tmp(const char *src, const char *dst, char *tmp, size_t len)
+{
+  int ret;
+
+  do
+    {
+      if(snprintf(tmp, len, "%s.%ld.%u", dst, (long)getpid(),
+		  __atomic_fetch_add(&tmp_seq, 1, __ATOMIC_RELAXED)) >= (int)len)
+	return -1;
+      ret = link(src, tmp);
+    }
+  while(ret != 0 && errno == EEXIST);
+  return ret;
+}
+
+/* src over dst, by the cheapest means there is */
+static int install(const char *src, const char *dst, int flags)
+{
+  char tmp[PATH_MAX + 32];
+  struct stat st, st_d;
+  int fd_r, fd_w = -1, how = -1;
+
+  if((fd_r = open(src, O_RDONLY)) < 0 || fstat(fd_r, &st) != 0)
+    goto out;
+  /* already linked: rename() would leave both names be */
+  if(stat(dst, &st_d) == 0 && st_d.st_dev == st.st_dev && st_d.st_ino == st.st_ino)
+    {
+      how = MEMO_LINK;
+      goto out;
+    }
+  if((fd_w = memo_tmp(dst, tmp, sizeof(tmp))) < 0)
+    goto out;
+#ifdef FICLONE
+  /* a file of its own sharing the blocks: nothing written, and free to
+     be changed in place later */
+  if(ioctl(fd_w, FICLONE, fd_r) == 0)
+    how = MEMO_REFLINK;
+#endif
+  if(how < 0)
+    {
+      close(fd_w);
+      fd_w = -1;
+      unlink(tmp);
+      if(link_tmp(src, dst, tmp, sizeof(tmp)) == 0)
+	how = MEMO_LINK;
+      else if((fd_w = memo_tmp(dst, tmp, sizeof(tmp))) < 0)
+	goto out;
+      else if(stream_copy_range(fd_r, 0, fd_w, 0, st.st_size) == 0 &&
+	      (!(flags & STREAM_FSYNC) || fsync(fd_w) == 0))
+	how = MEMO_COPY;
+    }
+  if(fd_w >= 0 && close(fd_w) != 0)
+    how = -1;
+  fd_w = -1;
+  if(how < 0 || rename(tmp, dst) != 0)
+    {
+      unlink(tmp);
+      how = -1;
+    }
+
+out:
+  if(fd_w >= 0)
+    {
+      close(fd_w);
+      unlink(tmp);
+    }
+  if(fd_r >= 0)
+    close(fd_r);
+  return how;
+}
+
+int memo_get(memo_t *memo, const char *key, const char *path, int flags)
+{
+  char entry[PATH_MAX];
+
+  if(entry_path(memo, key, entry) != 0)
+    return -1;
+  return install(entry, path, flags);
+}
+
+int memo_put(memo_t *memo, const char *key, const char *path, int flags)
+{
+  char entry[PATH_MAX];
+
+  if(entry_path(memo, key, entry) != 0)
+    return -1;
+  return install(path, entry, flags);
+}
+
+const char *memo_how(int how)
+{
+  switch(how)
+    {
+    case MEMO_REFLINK:
+      return "reflinked";
+    case MEMO_LINK:
+      return "hard-linked";
+    case MEMO_COPY:
+      return "copied";
+    }
+  return "?";
+}
@@ -0,0 +1,66 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** memo.h
+ *
+ * A store of finished packages, one file per key.  The key is a hash of
+ * everything a package's bytes follow from (the writer works it out from
+ * the planned layout, see package.c), so a package built before from the
+ * same inputs, flags, board and versions is put in place again from the
+ * store instead of being written: a reflink where the filesystem can,
+ * else a hard link, else a copy.
+ *
+ * Entries are written to a temporary name and rename()d into place, so
+ * builders sharing the store only ever see whole packages.
+ */
+
+#ifndef MEMO_H
+#define MEMO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "package.h"
+
+#define MEMO_KEY_LEN  25          /* hex digits of a key and the NUL */
+
+/* how memo_get()/memo_put() did it */
+#define MEMO_REFLINK  1
+#define MEMO_LINK     2
+#define MEMO_COPY     3
+
+typedef struct memo memo_t;
+
+/* crc32 and 64-bit FNV-1a side by side: 96 bits of key */
+typedef struct memo_hash {
+  uint32  crc;
+  uint64  fnv;
+} memo_hash_t;
+
+/* a store in dir (created if needed); NULL on failure */
+extern memo_t *memo_new(const char *dir);
+extern void    memo_free(memo_t *memo);
+
+extern void memo_hash_init(memo_hash_t *h);
+extern void memo_hash_add(memo_hash_t *h, const void *buf, size_t len);
+/* key: MEMO_KEY_LEN bytes */
+extern void memo_hash_key(const memo_hash_t *h, char *key);
+
+/* key's entry opened read-only, -1 if there is none */
+extern int memo_open(memo_t *memo, const char *key);
+
+/* replace path with key's entry / make path key's entry.  MEMO_*, or -1
+   with path (the entry) untouched; STREAM_FSYNC in flags syncs a copy */
+extern int memo_get(memo_t *memo, const char *key, const char *path, int flags);
+extern int memo_put(memo_t *memo, const char *key, const char *path, int flags);
+
+/* a new empty file next to path (mode 0666 less the umask) for writing
+   and then rename()ing over it; its name goes to tmp.  fd or -1 */
+extern int memo_tmp(const char *path, char *tmp, size_t len);
+
+extern const char *memo_how(int how);
+
+#endif
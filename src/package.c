@@ -33,23 +33,284 @@
 #include <config.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include "package.h"
+#include "stream.h"
+#include "stats.h"
+#include "tgz.h"
+#include "cramfs.h"
+#include "pipeline.h"
+#include "memo.h"
+#include "upk.h"
 
-#define SZ_7M  0x700000
-#define SZ_8K  0x2000
-
-#define RETRYTIMES  15
-#define VER_LIMIT_LEN	14
 #define VER_HW2_LEN	4
 
-static package_header_t p_head;
-static image_info_t     i_info[10];
+static const uint32 hw_flag = HW_FLAG; /* for judging if have hw */
+static const uint8  legacy_eof = LEGACY_EOF_BYTE;
+static const uint8  zeros[SZ_8K];      /* hw section padding into a stream */
+
+static int log_level = 1;              /* upk_set_log_level() */
+
+/* the *.version files */
+enum { VER_UBOOT, VER_KERNEL, VER_ROOTFS, VER_EXTAPP, VER_HW1, VER_HW2, VER_FILES };
+
+static const char *const ver_files[VER_FILES] = {
+  UBOOT_VER_FILE, KERNEL_VER_FILE, ROOTFS_VER_FILE,
+  EXTAPP_VER_FILE, HW1_VER_FILE, HW2_VER_FILE
+};
+
+typedef struct upk_ver {
+  uint8 text[VERLEN + 1];  /* contents, enough of them to tell if too long */
+  int   len;               /* -1: not loaded yet                           */
+  int   given;             /* from upk_writer_set_version(), not a file    */
+} upk_ver_t;
+
+/* one stretch of an input file in the package */
+typedef struct upk_part {
+  upk_writer_t *w;
+  int           fd;
+  int           own;       /* fd is closed with this part            */
+  off_t         off;       /* first byte taken from the file         */
+  uint32        len;       /* bytes taken from it                    */
+  uint32        eof;       /* 1: followed by the legacy EOF byte     */
+  uint32        crc;       /* of those bytes and the EOF byte        */
+  int           ret;
+  int           packed;    /* a packed directory, crc already known  */
+  int           anon;      /* in memory: not for the crc cache       */
+  struct upk_part *next;   /* the file's next part, hashed in turn   */
+} upk_part_t;
+
+/* a directory image, packed into memory once per package (or set of
+   variants) */
+typedef struct upk_packed {
+  char   *name;            /* as added */
+  int     type;            /* IH_TYPE_COMPRESS: .tar.gz, IH_TYPE_CRAMFS */
+  int     fd;
+  off_t   len;
+  uint32  crc;             /* .tar.gz only */
+} upk_packed_t;
+
+#define UPK_MAX_VARIANTS  16
 
-static uint32 hw_flag = 0x55AAAA55; /* for judging if have hw */
+/* one package of upk_writer_write_variants() */
+typedef struct upk_variant {
+  const upk_board_t *board;
+  int                hw;
+  char              *desc;     /* NULL: the writer's */
+  char              *path;
+} upk_variant_t;
+
+struct upk_writer {
+  package_header_t head;
+  image_info_t     info[UPK_MAX_IMAGES];
+  signature_t      sig;
+  version_info     vinfo;
+  upk_part_t       hwp[2];                 /* hw1, hw2                   */
+  upk_part_t       part[UPK_MAX_IMAGES];   /* one per image_info_t       */
+  uint32           hw2_len;
+  uint32           hw_len;                 /* trailer: bytes before head */
+  uint32           hw_align;               /* hw section padded to this  */
+  uint32           hw_max;                 /* and no longer, 0: any      */
+  char            *dir;                    /* images and *.version files */
+  char            *desc;                   /* upk_desc                   */
+  char            *output;                 /* package named by a manifest */
+  char            *hw[2];                  /* MSP430 images, hh only     */
+  char            *names[UPK_MAX_IMAGES];  /* images as added            */
+  int              types[UPK_MAX_IMAGES];  /* IH_TYPE_*, 0: by file name */
+  int              num;
+  upk_ver_t        ver[VER_FILES];         /* read once per package      */
+  upk_packed_t     packed[UPK_MAX_IMAGES]; /* and so are directories     */
+  int              npacked;
+  const upk_board_t *board;
+  upk_region_t     rootfs[UPK_MAX_REGIONS];  /* instead of the board's */
+  int              nrootfs;
+  upk_board_t      layout;                 /* board, rootfs regions  */
+  upk_variant_t    variant[UPK_MAX_VARIANTS];
+  int              nvariants;
+  stream_opts_t    copy;
+  upk_stats_t     *stats;                  /* --stats, may be NULL       */
+  int              srec;                   /* this package's record      */
+  memo_t          *memo;                   /* --memo, may be NULL        */
+};
+
+/* stats image of the hw parts, after the image table's */
+#define STATS_HW  UPK_MAX_IMAGES
+
+void upk_set_log_level(int level)
+{
+  log_level = level;
+}
+
+static void stat_begin(const upk_writer_t *w, upk_mark_t *m)
+{
+  if(w->stats)
+    upk_stats_mark(w->stats, m);
+}
+
+/* account what this thread did since m to a phase of image (or of the
+   package, UPK_STATS_PACKAGE) */
+static void stat_end(const upk_writer_t *w, const upk_mark_t *m, int image,
+		     int phase, uint64_t bytes)
+{
+  upk_counters_t d;
+
+  if(w->stats == NULL)
+    return;
+  upk_stats_since(w->stats, m, bytes, &d);
+  upk_stats_add(w->stats, w->srec, image, phase, &d);
+}
+
+/* the same, also counted for the package as a whole */
+static void stat_end_both(const upk_writer_t *w, const upk_mark_t *m, int image,
+			  int phase, uint64_t bytes)
+{
+  upk_counters_t d;
+
+  if(w->stats == NULL)
+    return;
+  upk_stats_since(w->stats, m, bytes, &d);
+  upk_stats_add(w->stats, w->srec, image, phase, &d);
+  upk_stats_add(w->stats, w->srec, UPK_STATS_PACKAGE, phase, &d);
+}
+
+/* the stats image of a part */
+static int part_image(const upk_part_t *p)
+{
+  const upk_writer_t *w = p->w;
+
+  if(p == &w->hwp[0] || p == &w->hwp[1])
+    return STATS_HW + (p - w->hwp);
+  return p - w->part;
+}
+
+static char *dup_str(const char *s)
+{
+  char *d;
+
+  if(s == NULL)
+    return NULL;
+  if((d = malloc(strlen(s) + 1)) != NULL)
+    strcpy(d, s);
+  return d;
+}
+
+/* a name relative to the writer's directory, in path[PATH_MAX]; NULL if
+   that is too long */
+static const char *upk_path(upk_writer_t *w, const char *name, char *path)
+{
+  if(w->dir == NULL || name[0] == '/')
+    return name;
+  if(snprintf(path, PATH_MAX, "%s/%s", w->dir, name) >= PATH_MAX)
+    return NULL;
+  return path;
+}
+
+/* open a file relative to the writer's directory */
+static FILE *upk_fopen_mode(upk_writer_t *w, const char *name, const char *mode)
+{
+  char path[PATH_MAX];
+
+  if((name = upk_path(w, name, path)) == NULL)
+    return NULL;
+  return fopen(name, mode);
+}
+
+#define upk_fopen(w, name)  upk_fopen_mode(w, name, "rb")
+
+static int upk_open_mode(upk_writer_t *w, const char *name, int flags)
+{
+  char path[PATH_MAX];
+
+  if((name = upk_path(w, name, path)) == NULL)
+    return -1;
+  return open(name, flags, 0666);
+}
+
+#define upk_open(w, name)  upk_open_mode(w, name, O_RDONLY)
+
+static int load_version(upk_writer_t *w, int k)
+{
+  upk_ver_t *v = &w->ver[k];
+  upk_mark_t m;
+  FILE *fp_r;
+
+  if(v->len >= 0)
+    return 0;
+  stat_begin(w, &m);
+  if((fp_r = upk_fopen(w, ver_files[k])) == NULL)
+    {
+      printf("Can't open version file: %s\n", ver_files[k]);
+      return(-1);
+    }
+  v->len = fread(v->text, 1, sizeof(v->text), fp_r);
+  fclose(fp_r);
+  stat_end(w, &m, UPK_STATS_PACKAGE, UPK_PHASE_READ, v->len);
+  return 0;
+}
+
+/*
+ * Store version file k in a VERLEN field.  The old readers copied the
+ * file a byte at a time over whatever the field held, turning CR/LF into
+ * NUL and storing the EOF from fgetc() as a 0xff after the last byte;
+ * STREAM_LEGACY_EOF keeps that, otherwise the field is the first line,
+ * zero padded.  With a limit, files longer than limit+1 bytes are
+ * refused as they always were.
+ */
+static int put_version(upk_writer_t *w, int k, uint8 *field, int limit,
+		       const char *what)
+{
+  upk_ver_t *v = &w->ver[k];
+  int i;
+
+  if(load_version(w, k) != 0)
+    return(-1);
+  if(limit && v->len > limit + 1)
+    {
+      printf("%s version can't be longer than %d\n", what, limit);
+      return(-1);
+    }
+  if(w->copy.flags & STREAM_LEGACY_EOF)
+    {
+      for(i = 0; i < v->len && i < VERLEN; i++)
+	field[i] = (v->text[i] == 0x0d || v->text[i] == 0x0a) ? '\0' : v->text[i];
+      if(i < VERLEN)
+	field[i] = LEGACY_EOF_BYTE;
+      return 0;
+    }
+  memset(field, 0, VERLEN);
+  for(i = 0; i < v->len && i < VERLEN - 1; i++)
+    {
+      if(v->text[i] == 0x0d || v->text[i] == 0x0a || v->text[i] == '\0')
+	break;
+      field[i] = v->text[i];
+    }
+  return 0;
+}
+
+/* what the file name says an image is */
+static int image_type(const char *name)
+{
+  if(strncmp(name, CRAMFS_FILE_NAME, strlen(CRAMFS_FILE_NAME)) == 0)
+    return IH_TYPE_CRAMFS;
+  if(strncmp(name, KERNEL_FILE_NAME, strlen(KERNEL_FILE_NAME)) == 0)
+    return IH_TYPE_KERNEL;
+  if(strncmp(name, UBOOT_FILE_NAME, strlen(UBOOT_FILE_NAME)) == 0)
+    return IH_TYPE_UBOOT;
+  if(strncmp(name, SCRIPT_FILE_NAME, strlen(SCRIPT_FILE_NAME)) == 0)
+    return IH_TYPE_SCRIPT;
+  return IH_TYPE_COMPRESS;
+}
 
 static void print_image_info(image_info_t *iif)
 {
+  if(log_level < 2)
+    return;
   printf("iif->i_type: %x\n",        iif->i_type);
   printf("iif->i_imagesize: %x\n",   iif->i_imagesize);
   printf("iif->i_startaddr_p: %x\n", iif->i_startaddr_p);
@@ -59,10 +320,10 @@ static void print_image_info(image_info_t *iif)
   printf("iif->i_version: %s\n",     iif->i_version);
 }
 
-static void print_head_info(void)
+static void print_head_info(package_header_t *phd)
 {
-  package_header_t *phd = &p_head;
-
+  if(log_level < 2)
+    return;
   printf("phd->p_headsize: %x\n", phd->p_headsize);
   printf("phd->p_reserve: %x\n",  phd->p_reserve);
   printf("phd->p_headcrc: %x\n",  phd->p_headcrc);
@@ -77,6 +338,8 @@ static void print_head_info(void)
 
 static void print_version_info(version_info *ver_t)
 {
+  if(log_level < 2)
+    return;
   printf("ver_t->upk_desc: %s\n", ver_t->upk_desc);
   printf("ver_t->pack_id: %s\n",  ver_t->pack_id);
   printf("ver_t->hw1_ver: %s\n",  ver_t->hw1_ver);
@@ -85,120 +348,259 @@ static void print_version_info(version_info *ver_t)
   printf("ver_t->app_ver: %s\n",  ver_t->app_ver);
 }
 
-static int pack_firmware(FILE *fp_w, uint32 offst, int num, char *name[])
+/* open a part of the package's input, sizing it the way the old copy
+   loop would have: limit bytes at most (0: to EOF), then the legacy EOF
+   byte unless the limit was reached */
+static int plan_part(upk_writer_t *w, upk_part_t *p, const char *name,
+		     off_t off, uint32 limit)
 {
-  FILE *fp_r;
-  int i, j;
-  uint32 curptr, extcrc;
-  char ch;
-  package_header_t *phd = &p_head;
-  image_info_t     *iif;
-  struct stat statbuf;
-  int isfirst = 1, ithave = 0;
+  struct stat st;
+  upk_mark_t m;
+  off_t len;
 
-  /* read version file */
-  if((fp_r = fopen(UBOOT_VER_FILE, "rb")) == NULL)
+  p->w = w;
+  stat_begin(w, &m);
+  if(name)
     {
-      printf("Can't open uboot version file: %s\n", UBOOT_VER_FILE);
-      return(-1);
+      if((p->fd = upk_open(w, name)) < 0)
+	{
+	  printf("can't open file: %s\n", name);
+	  return(-1);
+	}
+      p->own = 1;
     }
-  j=0;
-  while(1)
+  if(fstat(p->fd, &st) != 0 || !S_ISREG(st.st_mode))
     {
-      if(feof(fp_r)) break;
-      if(j > VER_LIMIT_LEN+1) 
-      {
-	   printf("uboot version can't be longer than 14\n");
-	   goto bail;
-      }
-      phd->p_vuboot[j] = fgetc(fp_r);
-      if((phd->p_vuboot[j]==0x0d) || (phd->p_vuboot[j]==0x0a))
-	phd->p_vuboot[j] = '\0';
-      j++;
+      printf("%s is not a regular file\n", name ? name : "input");
+      return(-1);
     }
-  fclose(fp_r);
-
-  if((fp_r = fopen(KERNEL_VER_FILE, "rb")) == NULL)
+  stat_end_both(w, &m, part_image(p), UPK_PHASE_OPEN, 0);
+  len = off < st.st_size ? st.st_size - off : 0;
+  if(limit && len > limit)
+    len = limit;
+  /* room left for the EOF byte and an ext crc, so len never wraps when
+     an image size is made of it */
+  if((uint64)len > UPK_SIZE_MAX - 1 - sizeof(uint32))
     {
-      printf("Can't open kernel version file: %s\n", KERNEL_VER_FILE);
+      printf("%s is too big: %llu bytes, an image takes 4G at most\n",
+	     name ? name : "input", (unsigned long long)len);
       return(-1);
     }
-  j=0;
-  while(1)
+  p->off = off;
+  p->len = len;
+  p->eof = (w->copy.flags & STREAM_LEGACY_EOF) && (!limit || p->len < limit);
+  return 0;
+}
+
+static void part_close(upk_part_t *p)
+{
+  if(p->own && p->fd >= 0)
+    close(p->fd);
+  memset(p, 0, sizeof(*p));
+  p->fd = -1;
+}
+
+/* what a directory image is called: NAME.tar.gz */
+static void packed_name(char *dst, const char *dir)
+{
+  size_t l = strlen(dir);
+
+  while(l > 1 && dir[l-1] == '/')
+    l--;
+  if(l >= 7 && strncmp(dir + l - 7, ".tar.gz", 7) == 0)
+    snprintf(dst, NAMELEN, "%.*s", (int)l, dir);
+  else
+    snprintf(dst, NAMELEN, "%.*s.tar.gz", (int)l, dir);
+}
+
+static int is_dir(upk_writer_t *w, const char *name)
+{
+  char path[PATH_MAX];
+  struct stat st;
+
+  return (name = upk_path(w, name, path)) != NULL &&
+    stat(name, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/* an image made from a directory, into memory the first time the
+   package needs it: tarred and gzipped (hashed as it is compressed), or
+   for root.cramfs a cramfs image that must fit in max bytes */
+static upk_packed_t *get_packed(upk_writer_t *w, const char *name, int type,
+				int image, off_t max)
+{
+  upk_packed_t *pk;
+  char path[PATH_MAX];
+  const char *dir;
+  off_t in;
+  upk_mark_t m;
+  int i, ret;
+
+  for(i = 0; i < w->npacked; i++)
+    if(strcmp(w->packed[i].name, name) == 0 && w->packed[i].type == type)
+      return &w->packed[i];
+  pk = &w->packed[i];
+  stat_begin(w, &m);
+  if((dir = upk_path(w, name, path)) == NULL || (pk->name = dup_str(name)) == NULL)
+    return NULL;
+  pk->type = type;
+  if(type == IH_TYPE_CRAMFS)
+    ret = cramfs_build(dir, w->copy.pool, max, &pk->fd, &pk->len, &in);
+  else
+    ret = tgz_pack(dir, w->copy.pool, TGZ_LEVEL, &pk->fd, &pk->len, &pk->crc, &in);
+  if(ret != 0)
     {
-      if(feof(fp_r)) break;
-      if(j > VER_LIMIT_LEN+1)
-      {
-	   printf("kernel version can't be longer than 14\n");
-	   goto bail;
-      }
-      phd->p_vkernel[j]=fgetc(fp_r);
-      if((phd->p_vkernel[j]==0x0d) || (phd->p_vkernel[j]==0x0a)) 
-	 phd->p_vkernel[j] = '\0';
-      j++; 
+      free(pk->name);
+      return NULL;
     }
-  fclose(fp_r);
+  w->npacked++;
+  stat_end_both(w, &m, image, UPK_PHASE_READ, in);
+  return pk;
+}
 
-  if((fp_r = fopen(ROOTFS_VER_FILE, "rb")) == NULL)
+static int plan_packed(upk_writer_t *w, upk_part_t *p, const char *name)
+{
+  upk_packed_t *pk;
+
+  p->w = w;
+  if((pk = get_packed(w, name, IH_TYPE_COMPRESS, part_image(p), 0)) == NULL)
+    return(-1);
+  p->fd  = pk->fd;
+  p->own = 0;
+  if(plan_part(w, p, NULL, 0, 0) != 0)
+    return(-1);
+  p->packed = 1;
+  p->crc    = pk->crc;
+  return 0;
+}
+
+static void drop_packed(upk_writer_t *w)
+{
+  int i;
+
+  for(i = 0; i < w->npacked; i++)
     {
-      printf("Can't open rootfs version file: %s\n", ROOTFS_VER_FILE);
-      return(-1);
+      close(w->packed[i].fd);
+      free(w->packed[i].name);
     }
-  j=0;
-  while(1)
+  w->npacked = 0;
+}
+
+/* pool job: the crc of one part and of the parts after it in the same
+   file, in one pass front to back; from the cache when it has them */
+static void part_hash(void *arg)
+{
+  upk_part_t *p = arg;
+  const stream_opts_t *opt = &p->w->copy;
+  upk_mark_t m;
+
+  for(; p; p = p->next)
     {
-      if(feof(fp_r)) break;
-      if(j > VER_LIMIT_LEN+1)
-      {
-	   printf("rootfs version can't be longer than 14\n");
-	   goto bail;
-      }
-      phd->p_vrootfs[j] = fgetc(fp_r);
-      if((phd->p_vrootfs[j]==0x0d) ||(phd->p_vrootfs[j]==0x0a)) 
-	phd->p_vrootfs[j] = '\0';
-      j++;
+      stat_begin(p->w, &m);
+      if(!p->packed)        /* a packed directory came with its crc */
+	{
+	  p->crc = 0;
+	  if(opt->cache && !p->anon)
+	    p->ret = crc_cache_range(opt->cache, opt->pool, p->fd, p->off, p->len, &p->crc);
+	  else
+	    p->ret = stream_crc_fd(opt->pool, p->fd, p->off, p->len, &p->crc);
+	}
+      if(p->eof)
+	p->crc = crc32(p->crc, &legacy_eof, 1);
+      stat_end(p->w, &m, part_image(p), UPK_PHASE_HASH, p->len);
     }
-  fclose(fp_r);
+}
+
+static int plan_firmware(upk_writer_t *w, int num, char *name[], int type[])
+{
+  int i, j, k;
+  uint32 limit;
+  uint64 curptr, size64, datasize = 0;
+  off_t room;
+  package_header_t *phd = &w->head;
+  image_info_t     *iif;
+  upk_part_t       *p;
+  const upk_board_t *board = &w->layout;
+  const upk_region_t *region = NULL;
+  upk_packed_t *pk = NULL;
+  struct stat statbuf;
+  off_t size = 0;
+  int ithave = 0;
+
+  /* version files */
+  if(put_version(w, VER_UBOOT,  phd->p_vuboot,  VER_LIMIT_LEN, "uboot") != 0 ||
+     put_version(w, VER_KERNEL, phd->p_vkernel, VER_LIMIT_LEN, "kernel") != 0 ||
+     put_version(w, VER_ROOTFS, phd->p_vrootfs, VER_LIMIT_LEN, "rootfs") != 0)
+    return(-1);
 
-  /* if rootfs size bigger than 7M, split it to two*/
+  /* if rootfs is bigger than the board's first rootfs region, split it
+     across as many regions as it takes */
   for(i=0; i<num; i++)
     {
-      if(strncmp(name[i], CRAMFS_FILE_NAME, strlen(CRAMFS_FILE_NAME)) == 0)
+      if(type[i] == IH_TYPE_CRAMFS)
 	{
 	    ithave=1;
 	    break;
 	}
     }
-  if(ithave)
+  phd->p_imagenum = (uint8)num;
+  if(ithave && is_dir(w, name[i]))
+    {
+      /* a staging directory: made into the image here, giving up as soon
+	 as it can't fit in the flash */
+      if((pk = get_packed(w, name[i], IH_TYPE_CRAMFS, i,
+			  upk_board_rootfs_size(board))) == NULL)
+	return -1;
+      size = pk->len;
+    }
+  else if(ithave)
     {
-      if(stat(CRAMFS_FILE_NAME, &statbuf)<0)
+      if((j = upk_open(w, name[i])) < 0 || fstat(j, &statbuf) < 0)
 	{
 	  printf("can't stat root.cramfs\n");
-	  phd->p_imagenum = (uint8)num;
+	  if(j >= 0)
+	    close(j);
+	  return -1;
 	}
-      else if( statbuf.st_size > (CRAMFS_ADDR_END2+ 1 - CRAMFS_ADDR_START1) )
+      close(j);
+      size = statbuf.st_size;
+    }
+  if(ithave)
+    {
+      if(size > upk_board_rootfs_size(board))
 	{
 	    printf("Error: the %s size is larger than the flash assigned to it!!!\n", CRAMFS_FILE_NAME);
 	    return -1;
 	}
-      else if(statbuf.st_size > SZ_7M)
+      room = UPK_REGION_SIZE(&board->rootfs[0]);
+      for(k = 1; size > room; k++)
+	room += UPK_REGION_SIZE(&board->rootfs[k]);
+      if(k > 1)
 	{
-	  printf("root.cramfs size bigger than SZ_7M\n");
-	  phd->p_imagenum = (uint8)num+1;
-	  for(j=num; j>i; j--)
-	      name[j] = name[j-1];
+	  if(log_level >= 2)
+	    printf("root.cramfs size bigger than %x, split in %d\n",
+		   UPK_REGION_SIZE(&board->rootfs[0]), k);
+	  phd->p_imagenum = (uint8)num + k - 1;
+	  for(j = num - 1; j > i; j--)
+	    {
+	      name[j+k-1] = name[j];
+	      type[j+k-1] = type[j];
+	    }
+	  for(j = i + 1; j < i + k; j++)
+	    {
+	      name[j] = name[i];
+	      type[j] = type[i];
+	    }
 	}
-      else phd->p_imagenum = (uint8)num;
     }
-  else phd->p_imagenum = (uint8)num;
+  if(phd->p_imagenum > UPK_MAX_IMAGES)
+    {
+      printf("too many images, at most %d fit in a package\n", UPK_MAX_IMAGES);
+      return -1;
+    }
   phd->p_headsize = sizeof(package_header_t) + phd->p_imagenum * sizeof(image_info_t);
 
   /* Bit[1:0] use to indicate 8M or 16M flash package */
-#if FLASH_16M
-  phd->p_reserve  = 0x02; 
-#else
-  phd->p_reserve  = 0x01;
-#endif
+  phd->p_reserve  = board->flash;
   phd->p_reserve |= 0x04;
 
   phd->p_datasize = 0;
@@ -210,117 +612,56 @@ static int pack_firmware(FILE *fp_w, uint32 offst, int num, char *name[])
   for(i=0; i < phd->p_imagenum; i++)
     {
       /* image info */
-      iif = &i_info[i];
-      if(strncmp(name[i], CRAMFS_FILE_NAME, strlen(CRAMFS_FILE_NAME)) == 0)
+      iif = &w->info[i];
+      iif->i_type = type[i];
+      switch(iif->i_type)
 	{
-	  iif->i_type = IH_TYPE_CRAMFS;
+	case IH_TYPE_CRAMFS:
 	  strncpy((char *)iif->i_name, CRAMFS_FILE_NAME, NAMELEN-1);
-
-	  if((fp_r = fopen(ROOTFS_VER_FILE, "rb")) == NULL)
-	    {
-	      printf("Can't open kernel version file: %s\n", ROOTFS_VER_FILE);
-	      break;
-	    }
-	  for(j = 0; j < sizeof(iif->i_version); j++)
-	    {
-	      if(feof(fp_r)) break;
-	      iif->i_version[j] = fgetc(fp_r);
-	      if((iif->i_version[j]==0x0d) || (iif->i_version[j]==0x0a))
-		 iif->i_version[j] = '\0';
-	    }
-	  fclose(fp_r);
-	}
-      else if(strncmp(name[i], KERNEL_FILE_NAME, strlen(KERNEL_FILE_NAME)) == 0)
-	{
-	  iif->i_type = IH_TYPE_KERNEL;
+	  if(put_version(w, VER_ROOTFS, iif->i_version, 0, "rootfs") != 0)
+	    return(-1);
+	  break;
+	case IH_TYPE_KERNEL:
 	  strncpy((char *)iif->i_name, KERNEL_FILE_NAME, NAMELEN-1);
-
-	  if((fp_r = fopen(KERNEL_VER_FILE, "rb")) == NULL)
-	    {
-	      printf("Can't open kernel version file: %s\n", KERNEL_VER_FILE);
-	      break;
-	    }
-	  for(j = 0; j < sizeof(iif->i_version); j++)
-	    {
-	      if(feof(fp_r)) break;
-	      iif->i_version[j] = fgetc(fp_r);
-	      if((iif->i_version[j]==0x0d) ||(iif->i_version[j]==0x0a))
-		iif->i_version[j] = '\0';
-	    }
-	  fclose(fp_r);
-	}
-      else if(strncmp(name[i], UBOOT_FILE_NAME, strlen(UBOOT_FILE_NAME)) == 0)
-	{
-	  iif->i_type = IH_TYPE_UBOOT;
+	  if(put_version(w, VER_KERNEL, iif->i_version, 0, "kernel") != 0)
+	    return(-1);
+	  break;
+	case IH_TYPE_UBOOT:
 	  strncpy((char *)iif->i_name, UBOOT_FILE_NAME, NAMELEN-1);
-
-	  if((fp_r = fopen(UBOOT_VER_FILE, "rb")) == NULL)
-	    {
-	      printf("Can't open uboot version file: %s\n", UBOOT_VER_FILE);
-	      break;
-	    }
-	  for(j = 0; j < sizeof(iif->i_version); j++)
-	    {
-	      if(feof(fp_r)) break;
-	      iif->i_version[j] = fgetc(fp_r);
-	      if((iif->i_version[j]==0x0d)|| (iif->i_version[j]==0x0a))
-		 iif->i_version[j] = '\0';
-	    }
-	  fclose(fp_r);
-	}
-      else if(strncmp(name[i], SCRIPT_FILE_NAME, strlen(SCRIPT_FILE_NAME)) == 0)
-	{
-	  iif->i_type = IH_TYPE_SCRIPT;
+	  if(put_version(w, VER_UBOOT, iif->i_version, 0, "uboot") != 0)
+	    return(-1);
+	  break;
+	case IH_TYPE_SCRIPT:
 	  strncpy((char *)iif->i_name, SCRIPT_FILE_NAME, NAMELEN-1);
-	}
-      else
-	{
-	    iif->i_type = IH_TYPE_COMPRESS;
-	    strncpy((char *)iif->i_name, name[i], NAMELEN-1);
-	    if((fp_r = fopen(EXTAPP_VER_FILE, "rb")) == NULL)
-	      {
-		  printf("Can't open extapp version file: %s\n", EXTAPP_VER_FILE);
-		  break;
-	      }
-	    j=0;
-	    while(1)
-	      {
-		  if(feof(fp_r)) break;
-		  if(j > VER_LIMIT_LEN+1)
-		  {
-		       printf("\nextapp version can't be longer than 14\n");
-		       goto bail;
-		  }
-		  iif->i_version[j] = fgetc(fp_r);
-		  if((iif->i_version[j]==0x0d)|| (iif->i_version[j]==0x0a))
-		      iif->i_version[j] = '\0';
-		  j++;
-	      }
-	    fclose(fp_r);
+	  break;
+	default:
+	  strncpy((char *)iif->i_name, name[i], NAMELEN-1);
+	  if(put_version(w, VER_EXTAPP, iif->i_version, VER_LIMIT_LEN, "extapp") != 0)
+	    return(-1);
+	  break;
 	}
 
       /* address in flash*/
       switch(iif->i_type)
 	{
 	case IH_TYPE_CRAMFS:
-	  if(isfirst)
+	  region = (i == 0 || type[i-1] != IH_TYPE_CRAMFS) ?
+	    &board->rootfs[0] : region + 1;
+	  if(region >= &board->rootfs[board->nrootfs])
 	    {
-	      iif->i_startaddr_f = CRAMFS_ADDR_START1;
-	      iif->i_endaddr_f   = CRAMFS_ADDR_END1;
-	    }
-	  else
-	    {
-	      iif->i_startaddr_f = CRAMFS_ADDR_START2;
-	      iif->i_endaddr_f   = CRAMFS_ADDR_END2;	    
+	      printf("the %s board has no room for another rootfs\n", board->name);
+	      return(-1);
 	    }
+	  iif->i_startaddr_f = region->start;
+	  iif->i_endaddr_f   = region->end;
 	  break;
 	case IH_TYPE_KERNEL:
-	  iif->i_startaddr_f = KERNEL_ADDR_START;
-	  iif->i_endaddr_f   = KERNEL_ADDR_END;
+	  iif->i_startaddr_f = board->kernel.start;
+	  iif->i_endaddr_f   = board->kernel.end;
 	  break;       
 	case IH_TYPE_UBOOT:
-	  iif->i_startaddr_f = UBOOT_ADDR_START;
-	  iif->i_endaddr_f   = UBOOT_ADDR_END;
+	  iif->i_startaddr_f = board->uboot.start;
+	  iif->i_endaddr_f   = board->uboot.end;
 	  break;
 	case IH_TYPE_SCRIPT:
 	case IH_TYPE_COMPRESS:
@@ -330,380 +671,990 @@ static int pack_firmware(FILE *fp_w, uint32 offst, int num, char *name[])
 	  break;
 	}
 
-      /* write whole image to package and calculate the imagesize*/
-      iif->i_imagesize = 0;
-      /* images file */
-      if((fp_r = fopen(name[i], "rb")) == NULL)
+      /* where the image comes from: a part of root.cramfs fills its
+	 region and later parts share the file of the first, carrying on
+	 where it stopped.  Only the board's own last rootfs region takes
+	 the rest: that is all upk_pkg_part_limit() can tell later */
+      p = &w->part[i];
+      limit = 0;
+      if(iif->i_type == IH_TYPE_CRAMFS &&
+	 region->end != w->board->rootfs[w->board->nrootfs - 1].end)
+	limit = UPK_REGION_SIZE(region);
+      if(iif->i_type == IH_TYPE_CRAMFS && i > 0 && type[i-1] == IH_TYPE_CRAMFS)
 	{
-	  printf("can't open file: %s\n", name[i]);
-	  break;
+	  p->fd   = w->part[i-1].fd;
+	  p->anon = w->part[i-1].anon;
+	  w->part[i-1].next = p;
+	  if(plan_part(w, p, NULL, w->part[i-1].off + w->part[i-1].len, limit) != 0)
+	    return(-1);
 	}
-
-      if(iif->i_type == IH_TYPE_CRAMFS && !isfirst)
-	  fseek(fp_r, SZ_7M, SEEK_SET);
-
-      fseek(fp_w, offst+curptr,SEEK_SET);
-      extcrc = 0;
-      while(!feof(fp_r))
+      else if(iif->i_type == IH_TYPE_CRAMFS && pk)
 	{
-	  ch = fgetc(fp_r);
-	  fputc(ch, fp_w);
-	  if(iif->i_type != IH_TYPE_COMPRESS)
-	      phd->p_datacrc = crc32(phd->p_datacrc,(uint8 *)&ch, 1);
-	  else
-	      extcrc = crc32(extcrc,(uint8 *)&ch, 1);
-	  iif->i_imagesize ++;
-	  if(iif->i_type == IH_TYPE_CRAMFS)
-	    {
-	      if(isfirst && (iif->i_imagesize >= SZ_7M))
-		{
-		  isfirst = 0;
-		  break;
-		}
-	    }
+	  p->fd   = pk->fd;
+	  p->own  = 0;
+	  p->anon = 1;
+	  if(plan_part(w, p, NULL, 0, limit) != 0)
+	    return(-1);
 	}
-      fclose(fp_r);
-      if(iif->i_type == IH_TYPE_COMPRESS)
+      else if(iif->i_type == IH_TYPE_COMPRESS && is_dir(w, name[i]))
 	{
-	    /* write ext app crc */
-	    if(fwrite(&extcrc, sizeof(extcrc), 1, fp_w) != 1)
-	      {
-		  printf("can not write ext crc into package");
-		  return(0);
-	      }
-	    iif->i_imagesize += sizeof(extcrc);
+	  if(plan_packed(w, p, name[i]) != 0)
+	    return(-1);
+	  packed_name((char *)iif->i_name, name[i]);
 	}
+      else if(plan_part(w, p, name[i], 0, limit) != 0)
+	return(-1);
 
-      iif->i_startaddr_p = curptr;
-      curptr += iif->i_imagesize;
+      if(w->stats)
+	upk_stats_image(w->stats, w->srec, i, (char *)iif->i_name);
+      size64 = (uint64)p->len + p->eof;
+      if(iif->i_type == IH_TYPE_COMPRESS)
+	size64 += sizeof(uint32);   /* ext app crc */
+      /* everything below is narrowed into 32-bit fields: check first */
+      if(curptr + size64 > UPK_SIZE_MAX)
+	{
+	  printf("the package is too big: %.*s ends at %llu, past 4G\n",
+		 NAMELEN, iif->i_name, (unsigned long long)(curptr + size64));
+	  return(-1);
+	}
+      iif->i_imagesize   = (uint32)size64;
+      iif->i_startaddr_p = (uint32)curptr;
+      curptr += size64;
       if(iif->i_type != IH_TYPE_COMPRESS)
-	  phd->p_datasize += iif->i_imagesize;
+	datasize += size64;
+      phd->p_datasize = (uint32)datasize;   /* <= curptr */
       
       print_image_info(iif); /* print iff*/
-
-       /*write image info */
-      fseek(fp_w, offst+sizeof(package_header_t)+i*sizeof(image_info_t), 0);
-      if(fwrite(iif, sizeof(image_info_t), 1, fp_w) != 1) 
-	{
-	  printf("can not write iif into package\n");
-	  break;
-	}
-    }
-
-  /* write package head*/
-  phd->p_headcrc = crc32(phd->p_headcrc, (uint8 *)phd, sizeof(package_header_t));
-  phd->p_headcrc = crc32(phd->p_headcrc, (uint8 *)i_info, phd->p_imagenum*sizeof(image_info_t));
-
-  print_head_info();  /* print phd */
-
-  fseek(fp_w, offst, SEEK_SET);
-  if(fwrite((uint8 *)phd, sizeof(package_header_t), 1, fp_w) != 1)
-    {
-      printf("can not write head into package");
-      return(-1);
     }
   return 0;
-
-bail:
-  fclose(fp_r);
-
-  return -1;
 }
 
-static uint32 pack_hw(FILE *fp_w, char *name[])
+/* the hw section: hw1, hw2_crc, hw2_len, hw2, zero padding to the hw
+   alignment (8K); returns its padded length, 0 on error */
+static uint32 plan_hw(upk_writer_t *w)
 {
-     FILE *fp_r;
-     char ch;
-     uint32 hw_len = 0, hw2_crc = 0, hw1_len =0, hw2_len=0;
-     int i;
-     
-     if((fp_r = fopen(name[0], "rb")) ==NULL)
-     {
-	  printf("can't open %s\n", name[0]);
-	  return (0);
-     }
-     else
-     {/* write the first one into package */
-	  while(!feof(fp_r)) 
-	  {
-	       fputc(fgetc(fp_r), fp_w);
-	       hw1_len++;
-	  }
-	  fclose(fp_r);
-     }
-     /* fill the space with 0 first */
-     if(fwrite(&hw2_crc, sizeof(hw2_crc), 1, fp_w) != 1 )
-     {
-	  printf("can't not write hw2_crc1 into package\n");
-	  return (0);
-     }
-     if(fwrite(&hw2_len, sizeof(hw2_len), 1, fp_w) != 1 )
-     {
-	  printf("can't not write hw2_len1 into package\n");
-	  return(0);
-     }
-     
-     if((fp_r = fopen(name[1], "rb")) ==NULL)
-     {
-	  printf("can't open %s\n", name[1]);
-	  return(0);
-     }
-     else
-     {/* write the second one into package */
-	  while(!feof(fp_r))
-	  {
-	       ch = fgetc(fp_r);
-	       fputc(ch, fp_w);
-	       hw2_crc = crc32(hw2_crc, (uint8 *)&ch, 1);
-	       hw2_len++;
-	  }
-	  fclose(fp_r);
-     }
-     //printf("hw2_crc = %x\n", hw2_crc);
-     /* write the actual value */
-     fseek(fp_w, hw1_len, SEEK_SET); 
-     if(fwrite(&hw2_crc, sizeof(hw2_crc), 1, fp_w) != 1 )
-     {
-	  printf("can't not write hw2_crc2 into package\n");
-	  return(0);
-     }
-     if(fwrite(&hw2_len, sizeof(hw2_len), 1, fp_w) != 1 )
-     {
-	  printf("can't not write hw2_len2 into package\n");
-	  return(0);
-     }
-     
-     hw_len = hw1_len+hw2_len+sizeof(hw2_crc)+sizeof(hw2_len);
-     printf("hw_len = %x\n", hw_len);
-     fseek(fp_w, hw_len, SEEK_SET);
-     
-     for(i=0; i< RETRYTIMES; i++)
+     char **name = w->hw;
+     off_t hw_len, padded;
+
+     if(w->stats)
      {
-	  if( hw_len < (i*SZ_8K) )
-	  {
-	       int j;
-	       for(j=hw_len; j<(i*SZ_8K); j++)
-		    fputc(0, fp_w);
-	       hw_len = (i*SZ_8K);
-	       break;
-	  }
-	  else if( hw_len == (i*SZ_8K) ) 
-	       break;
+	  upk_stats_image(w->stats, w->srec, STATS_HW, "hw1");
+	  upk_stats_image(w->stats, w->srec, STATS_HW + 1, "hw2");
      }
-     if(i == RETRYTIMES) 
+     if(plan_part(w, &w->hwp[0], name[0], 0, 0) != 0 ||
+	plan_part(w, &w->hwp[1], name[1], 0, 0) != 0)
+	  return 0;
+     w->hw2_len = w->hwp[1].len + w->hwp[1].eof;
+     hw_len = (off_t)w->hwp[0].len + w->hwp[0].eof + 2 * sizeof(uint32) + w->hw2_len;
+     if(log_level >= 2)
+	  printf("hw_len = %llx\n", (unsigned long long)hw_len);
+
+     padded = (hw_len + w->hw_align - 1) / w->hw_align * w->hw_align;
+     if((w->hw_max && padded > w->hw_max) ||
+	padded > 0xffffffffLL - sizeof(signature_t))
      {
 	  printf("Oops, the hw parts is too big!\n");
 	  return 0;
      }
-     
-     return hw_len;
+     return padded;
 }
 
-static int pack_signature(FILE *fp_w)
+static void plan_signature(upk_writer_t *w)
 {
-    signature_t signature;
+    signature_t *signature = &w->sig;
 
-    memset((char *)&signature, 0, sizeof(signature_t));
-    memcpy(signature.string, NEUROS_UPK_SIGNATURE, strlen(NEUROS_UPK_SIGNATURE));
-    signature.strcrc = crc32(0, signature.string, sizeof(signature.string));
-    if(fwrite((uint8 *)&signature, sizeof(signature_t), 1, fp_w) != 1)
-      {
-	  printf("can not write the signature into package\n");
-	  return(0);
-      }
-    return sizeof(signature_t);
+    memset((char *)signature, 0, sizeof(signature_t));
+    memcpy(signature->string, NEUROS_UPK_SIGNATURE, strlen(NEUROS_UPK_SIGNATURE));
+    signature->strcrc = crc32(0, signature->string, sizeof(signature->string));
 }
 
-static int pack_ver_info(FILE *fp_w, uint32 offset, int flag, char *desc)
+static int plan_ver_info(upk_writer_t *w)
 {
-  version_info ver_t;
-  FILE *fp_r;
-  int i;
-  
-  memset((char *)&ver_t, 0, sizeof(version_info));
+  version_info *ver_t = &w->vinfo;
+  int flag = (w->hw[0] != NULL);
+  const char *desc = w->desc ? w->desc : "";
+
+  memset((char *)ver_t, 0, sizeof(version_info));
 
   if(strlen(desc) >= DESCLEN)
     {
       printf("The upk_desc is too long\n");
       return(-1);
     }
-  strncpy((char *)ver_t.upk_desc, desc, DESCLEN-1);
-  strncpy((char *)ver_t.pack_id, (char *)PACKAGE_ID, NAMELEN-1);
-  strncpy((char *)ver_t.hw1_ver, "D.ev", VERLEN-1);
-  strncpy((char *)ver_t.hw2_ver, "D.ev", VERLEN-1);
-  strncpy((char *)ver_t.os_ver,  "0.00", VERLEN-1);
-  strncpy((char *)ver_t.app_ver, "0.00", VERLEN-1);
+  strncpy((char *)ver_t->upk_desc, desc, DESCLEN-1);
+  strncpy((char *)ver_t->pack_id, (char *)PACKAGE_ID, NAMELEN-1);
+  strncpy((char *)ver_t->hw1_ver, "D.ev", VERLEN-1);
+  strncpy((char *)ver_t->hw2_ver, "D.ev", VERLEN-1);
+  strncpy((char *)ver_t->os_ver,  "0.00", VERLEN-1);
+  strncpy((char *)ver_t->app_ver, "0.00", VERLEN-1);
+
+  if(flag &&
+     (put_version(w, VER_HW1, ver_t->hw1_ver, 0, "hw") != 0 ||
+      put_version(w, VER_HW2, ver_t->hw2_ver, VER_HW2_LEN, "hw") != 0))
+    return(-1);
+  if(put_version(w, VER_KERNEL, ver_t->os_ver, 0, "OS") != 0 ||
+     put_version(w, VER_ROOTFS, ver_t->app_ver, 0, "App") != 0)
+    return(-1);
+
+  print_version_info(ver_t);
+
+  return (0);
+}
+
+/* hash every part concurrently, then fold the results into the header */
+static void hash_finish(upk_writer_t *w);
+
+static int hash_parts(upk_writer_t *w)
+{
+  package_header_t *phd = &w->head;
+  pool_group_t grp = POOL_GROUP_INIT;
+  upk_part_t *p;
+  upk_mark_t m;
+  uint64_t bytes = 0;
+  int i;
+
+  stat_begin(w, &m);
+  /* hw1's crc is not stored, but the memo key needs it */
+  if(w->hw[0] && w->memo)
+    pool_submit(w->copy.pool, &grp, part_hash, &w->hwp[0]);
+  if(w->hw[0])
+    pool_submit(w->copy.pool, &grp, part_hash, &w->hwp[1]);
+  for(i = 0; i < phd->p_imagenum; i++)
+    if(i == 0 || w->part[i-1].next != &w->part[i])
+      pool_submit(w->copy.pool, &grp, part_hash, &w->part[i]);
+  pool_wait(w->copy.pool, &grp);
+  if(w->stats)
+    {
+      if(w->hw[0])
+	bytes += w->hwp[1].len + (w->memo ? w->hwp[0].len : 0);
+      for(i = 0; i < phd->p_imagenum; i++)
+	bytes += w->part[i].len;
+      stat_end(w, &m, UPK_STATS_PACKAGE, UPK_PHASE_HASH, bytes);
+    }
 
-  if(flag)
+  if(w->hw[0] && (w->hwp[0].ret != 0 || w->hwp[1].ret != 0))
+    return(-1);
+  for(i = 0; i < phd->p_imagenum; i++)
     {
-      if((fp_r = fopen(HW1_VER_FILE, "rb")) == NULL)
+      p = &w->part[i];
+      if(p->ret != 0)
 	{
-	  printf("Can't open HW1 version file: %s\n", HW1_VER_FILE);
+	  printf("can't read %s\n", w->info[i].i_name);
 	  return(-1);
 	}
-      for(i = 0; i < sizeof(ver_t.hw1_ver); i++)
-	{
-	  if(feof(fp_r)) break;
-	  ver_t.hw1_ver[i] = fgetc(fp_r);
-	  if((ver_t.hw1_ver[i]==0x0d) || (ver_t.hw1_ver[i]==0x0a))
-	    ver_t.hw1_ver[i] = '\0';
-	}
-      fclose(fp_r);
-      
-      if((fp_r = fopen(HW2_VER_FILE, "rb")) == NULL)
+    }
+  hash_finish(w);
+  return 0;
+}
+
+/* the header checksums, from the crc of every part */
+static void hash_finish(upk_writer_t *w)
+{
+  package_header_t *phd = &w->head;
+  upk_part_t *p;
+  int i;
+
+  for(i = 0; i < phd->p_imagenum; i++)
+    {
+      p = &w->part[i];
+      if(w->info[i].i_type != IH_TYPE_COMPRESS)
+	phd->p_datacrc = crc32_combine(phd->p_datacrc, p->crc, p->len + p->eof);
+    }
+
+  phd->p_headcrc = crc32(0, (uint8 *)phd, sizeof(package_header_t));
+  phd->p_headcrc = crc32(phd->p_headcrc, (uint8 *)w->info, phd->p_imagenum*sizeof(image_info_t));
+
+  print_head_info(phd);  /* print phd */
+}
+
+/* every part read, hashed and written in one pass instead (see
+   pipeline.h), straight to where it goes in the package */
+static int pipe_parts(upk_writer_t *w, int fd)
+{
+  pipeline_part_t pp[UPK_MAX_IMAGES + 2];
+  upk_part_t *p[UPK_MAX_IMAGES + 2];
+  int i, n = 0;
+
+  if(w->hw[0])
+    {
+      p[n] = &w->hwp[0];
+      pp[n].off_w = 0;
+      pp[n++].hash = 0;          /* only hw2 has its crc stored */
+      p[n] = &w->hwp[1];
+      pp[n].off_w = (off_t)w->hwp[0].len + w->hwp[0].eof + 2 * sizeof(uint32);
+      pp[n++].hash = 1;
+    }
+  for(i = 0; i < w->head.p_imagenum; i++)
+    {
+      p[n] = &w->part[i];
+      pp[n].off_w = (off_t)w->hw_len + w->info[i].i_startaddr_p;
+      pp[n++].hash = !w->part[i].packed;
+    }
+  for(i = 0; i < n; i++)
+    {
+      pp[i].fd  = p[i]->fd;
+      pp[i].off = p[i]->off;
+      pp[i].len = p[i]->len;
+    }
+  if(pipeline_copy(pp, n, fd) != 0)
+    {
+      printf("can't copy the images\n");
+      return(-1);
+    }
+  for(i = 0; i < n; i++)
+    {
+      if(p[i] == &w->hwp[0])
+	continue;
+      if(pp[i].hash)
+	p[i]->crc = pp[i].crc;
+      if(p[i]->eof)
+	p[i]->crc = crc32(p[i]->crc, &legacy_eof, 1);
+    }
+  return 0;
+}
+
+/*
+ * The package goes out front to back: small pieces are gathered into
+ * one pwritev(), image payloads are copied file to file.  With
+ * STREAM_URING payloads are left as holes and collected instead, to be
+ * copied all at once by stream_copy_extents() at the end; after
+ * pipe_parts() they are already there.
+ */
+#define SINK_IOV  16
+
+typedef struct upk_sink {
+  int           fd;
+  off_t         pos;            /* -1: a pipe or the like, just append */
+  int           flags;          /* STREAM_ZERO_COPY */
+  struct iovec  iov[SINK_IOV];
+  int           n;
+  const upk_writer_t *w;        /* for --stats */
+  uint64_t      bytes;          /* put so far, holes included */
+  stream_extent_t x[UPK_MAX_IMAGES + 2];  /* STREAM_URING payloads */
+  int           nx;
+  int           written;        /* payloads are in place already */
+} upk_sink_t;
+
+static int sink_flush(upk_sink_t *s)
+{
+  struct iovec *iov = s->iov;
+  int n = s->n;
+  ssize_t done;
+
+  while(n > 0)
+    {
+      done = (s->pos < 0) ? writev(s->fd, iov, n) : pwritev(s->fd, iov, n, s->pos);
+      if(done < 0)
 	{
-	  printf("Can't open HW2 version file: %s\n", HW2_VER_FILE);
+	  if(errno == EINTR)
+	    continue;
 	  return(-1);
 	}
-      i = 0;
-      while(1)
+      if(s->pos >= 0)
+	s->pos += done;
+      for(; n > 0 && done >= iov->iov_len; iov++, n--)
+	done -= iov->iov_len;
+      if(n > 0)
 	{
-	  if(feof(fp_r)) break;
-	  if(i > VER_HW2_LEN+1)
-	  {
-	       printf("hw version can't be longer than 4\n");
-	       fclose(fp_r);
-	       return (-1);
-	  }
-	  ver_t.hw2_ver[i] = fgetc(fp_r);
-	  if((ver_t.hw2_ver[i]==0x0d) || (ver_t.hw2_ver[i]==0x0a))
-	    ver_t.hw2_ver[i] = '\0';
-	  i++;
+	  iov->iov_base = (uint8 *)iov->iov_base + done;
+	  iov->iov_len -= done;
 	}
-      fclose(fp_r);
     }
-  
-  if((fp_r = fopen(KERNEL_VER_FILE, "rb")) == NULL)
+  s->n = 0;
+  return 0;
+}
+
+/* buf must stay valid until the next flush */
+static int sink_put(upk_sink_t *s, const void *buf, size_t len)
+{
+  if(len == 0)
+    return 0;
+  if(s->n == SINK_IOV && sink_flush(s) != 0)
+    return(-1);
+  s->bytes += len;
+  s->iov[s->n].iov_base = (void *)buf;
+  s->iov[s->n].iov_len  = len;
+  s->n++;
+  return 0;
+}
+
+/* len zero bytes: a hole in a file, written out only into a stream */
+static int sink_zero(upk_sink_t *s, off_t len)
+{
+  size_t n;
+
+  if(s->pos >= 0)
     {
-      printf("Can't open OS version file: %s\n", KERNEL_VER_FILE);
-      return(-1);
+      if(sink_flush(s) != 0)
+	return(-1);
+      s->pos += len;      /* whatever follows extends the file over it */
+      s->bytes += len;
+      return 0;
     }
-  for(i = 0; i < sizeof(ver_t.os_ver); i++)
+  for(; len > 0; len -= n)
     {
-      if(feof(fp_r)) break;
-      ver_t.os_ver[i] = fgetc(fp_r);
-      if((ver_t.os_ver[i]==0x0d) || (ver_t.os_ver[i]==0x0a))
-	ver_t.os_ver[i] = '\0';
+      n = len < sizeof(zeros) ? len : sizeof(zeros);
+      if(sink_put(s, zeros, n) != 0)
+	return(-1);
     }
-  fclose(fp_r);
+  return 0;
+}
+
+/* a part and its legacy EOF byte */
+static int sink_part(upk_sink_t *s, const upk_part_t *p)
+{
+  upk_mark_t m;
+  int ret;
 
-  if((fp_r = fopen(ROOTFS_VER_FILE, "rb")) == NULL)
+  if(sink_flush(s) != 0)
+    return(-1);
+  if(s->written || ((s->flags & STREAM_URING) && s->pos >= 0))
     {
-      printf("Can't open App version file: %s\n", ROOTFS_VER_FILE);
-      return(-1);
+      if(!s->written)
+	{
+	  s->x[s->nx].fd    = p->fd;
+	  s->x[s->nx].off   = p->off;
+	  s->x[s->nx].off_w = s->pos;
+	  s->x[s->nx].len   = p->len;
+	  s->nx++;
+	}
+      s->pos   += p->len;
+      s->bytes += p->len;
+      return p->eof ? sink_put(s, &legacy_eof, 1) : 0;
     }
-  for(i = 0; i < sizeof(ver_t.app_ver); i++)
+  stat_begin(s->w, &m);
+  if(s->pos < 0)
+    ret = stream_copy_out(p->fd, p->off, s->fd, p->len, s->flags);
+  else
+    ret = (s->flags & STREAM_ZERO_COPY) ?
+    stream_copy_range(p->fd, p->off, s->fd, s->pos, p->len) :
+    stream_copy_user(p->fd, p->off, s->fd, s->pos, p->len);
+  if(ret != 0)
+    return(-1);
+  if(s->pos >= 0)
+    s->pos += p->len;
+  s->bytes += p->len;
+  stat_end(s->w, &m, part_image(p), UPK_PHASE_WRITE, p->len);
+  return p->eof ? sink_put(s, &legacy_eof, 1) : 0;
+}
+
+/* pipelined: the parts still have to be read and hashed (into a file,
+   pos 0) */
+static int emit_package(upk_writer_t *w, int fd, off_t pos, int pipelined)
+{
+  package_header_t *phd = &w->head;
+  upk_sink_t sink = { fd, pos, w->copy.flags };
+  upk_mark_t m;
+  off_t hw_used;
+  int i;
+
+  sink.w = w;
+  stat_begin(w, &m);
+  if(pipelined)
     {
-      if(feof(fp_r)) break;
-      ver_t.app_ver[i] = fgetc(fp_r);
-      if((ver_t.app_ver[i]==0x0d) || (ver_t.app_ver[i]==0x0a))
-	ver_t.app_ver[i] = '\0';
+      if(pipe_parts(w, fd) != 0)
+	return(-1);
+      hash_finish(w);
+      sink.written = 1;
     }
-  fclose(fp_r);
+  if(w->hw[0])
+    {
+      hw_used = (off_t)w->hwp[0].len + w->hwp[0].eof + 2 * sizeof(uint32) + w->hw2_len;
+      if(sink_part(&sink, &w->hwp[0]) != 0 ||
+	 sink_put(&sink, &w->hwp[1].crc, sizeof(uint32)) != 0 ||
+	 sink_put(&sink, &w->hw2_len, sizeof(uint32)) != 0 ||
+	 sink_part(&sink, &w->hwp[1]) != 0 ||
+	 sink_zero(&sink, w->hw_len - sizeof(signature_t) - hw_used) != 0)
+	return(-1);
+    }
+  if(sink_put(&sink, &w->sig, sizeof(signature_t)) != 0 ||
+     sink_put(&sink, phd, sizeof(package_header_t)) != 0 ||
+     sink_put(&sink, w->info, phd->p_imagenum * sizeof(image_info_t)) != 0 ||
+     sink_put(&sink, &w->vinfo, sizeof(version_info)) != 0)
+    return(-1);
+  for(i = 0; i < phd->p_imagenum; i++)
+    {
+      if(sink_part(&sink, &w->part[i]) != 0)
+	return(-1);
+      /* write ext app crc */
+      if(w->info[i].i_type == IH_TYPE_COMPRESS &&
+	 sink_put(&sink, &w->part[i].crc, sizeof(uint32)) != 0)
+	return(-1);
+    }
+  /* the version_info copy, hw flag and hw_len */
+  if(sink_put(&sink, &w->vinfo, sizeof(version_info)) != 0 ||
+     sink_put(&sink, &hw_flag, sizeof(hw_flag)) != 0 ||
+     sink_put(&sink, &w->hw_len, sizeof(w->hw_len)) != 0 ||
+     sink_flush(&sink) != 0 ||
+     stream_copy_extents(sink.x, sink.nx, fd, sink.flags) != 0)
+    return(-1);
+  stat_end(w, &m, UPK_STATS_PACKAGE, UPK_PHASE_WRITE, sink.bytes);
 
-  fseek(fp_w, offset, SEEK_SET);
-  if(fwrite((uint8 *)&ver_t, sizeof(version_info), 1, fp_w) != 1)
+  if(w->copy.flags & STREAM_FSYNC)
     {
-      printf("can not write the version struct into package\n");
-      return(-1);
+      stat_begin(w, &m);
+      /* a pipe has nothing to sync */
+      if(fsync(fd) != 0 && errno != EINVAL && errno != EROFS)
+	return(-1);
+      stat_end(w, &m, UPK_STATS_PACKAGE, UPK_PHASE_FSYNC, sink.bytes);
+    }
+  return 0;
+}
+
+upk_writer_t *upk_writer_new(void)
+{
+  upk_writer_t *w;
+
+  int k;
+
+  if((w = calloc(1, sizeof(*w))) == NULL)
+    return NULL;
+  w->copy.flags = STREAM_ZERO_COPY;
+  w->board = upk_board_default();
+  w->hw_align = SZ_8K;
+  w->hw_max   = HW_MAX_LEN;
+  for(k = 0; k < VER_FILES; k++)
+    w->ver[k].len = -1;
+  return w;
+}
+
+void upk_writer_free(upk_writer_t *w)
+{
+  int i;
+
+  if(w == NULL)
+    return;
+  for(i = 0; i < w->num; i++)
+    free(w->names[i]);
+  for(i = 0; i < w->nvariants; i++)
+    {
+      free(w->variant[i].desc);
+      free(w->variant[i].path);
     }
-  fseek(fp_w, 0, SEEK_END);
-  if(fwrite((uint8 *)&ver_t, sizeof(version_info), 1, fp_w) != 1)
+  drop_packed(w);
+  free(w->hw[0]);
+  free(w->hw[1]);
+  free(w->dir);
+  free(w->desc);
+  free(w->output);
+  free(w);
+}
+
+int upk_writer_set_dir(upk_writer_t *w, const char *dir)
+{
+  free(w->dir);
+  w->dir = dup_str(dir);
+  return (dir && !w->dir) ? -1 : 0;
+}
+
+int upk_writer_set_desc(upk_writer_t *w, const char *desc)
+{
+  if(strlen(desc) >= DESCLEN)
     {
-      printf("can not write the version struct into package\n");
+      printf("The upk_desc is too long\n");
       return(-1);
     }
+  free(w->desc);
+  w->desc = dup_str(desc);
+  return w->desc ? 0 : -1;
+}
 
-  print_version_info(&ver_t);
+void upk_writer_set_copy(upk_writer_t *w, int flags, pool_t *pool)
+{
+  w->copy.flags = flags;
+  w->copy.pool  = pool;
+}
 
-  return (0);
+void upk_writer_set_cache(upk_writer_t *w, crc_cache_t *cache)
+{
+  w->copy.cache = cache;
+}
+
+void upk_writer_set_stats(upk_writer_t *w, upk_stats_t *stats)
+{
+  w->stats = stats;
 }
 
-int main(int argc, char *argv[])
+void upk_writer_set_memo(upk_writer_t *w, memo_t *memo)
 {
-  FILE *fp_w;
-  uint32 hw_len = 0, siglen;
-  int flag, img_pos;
-  package_header_t *phd = &p_head;
+  w->memo = memo;
+}
 
-  printf("\npackage tool version %s ", VERSION);
-  #if FLASH_16M
-  printf("for 16M board\n\n");
-  #else
-  printf("for 8M board\n\n");
-  #endif
+int upk_writer_set_hw(upk_writer_t *w, const char *hw1, const char *hw2)
+{
+  free(w->hw[0]);
+  free(w->hw[1]);
+  w->hw[0] = dup_str(hw1);
+  w->hw[1] = dup_str(hw2);
+  return (!w->hw[0] || !w->hw[1]) ? -1 : 0;
+}
 
-  if(argc < 4)
+int upk_writer_set_hw_align(upk_writer_t *w, uint32 align, uint32 max)
+{
+  if(align == 0 || (max && max % align != 0))
     {
-      printf("usage: packet flag upk_desc package_name hw1 hw2 image1 image2 ...\n");
+      printf("the hw section size limit must be a multiple of its alignment\n");
       return(-1);
     }
+  w->hw_align = align;
+  w->hw_max   = max;
+  return 0;
+}
 
-  if(strcmp(argv[1], "hh") == 0)  
+int upk_writer_add_image_type(upk_writer_t *w, const char *name, int type)
+{
+  if(w->num >= UPK_MAX_IMAGES)
     {
-      flag = 1;    /* has hw */
-      img_pos = 6;
+      printf("too many images, at most %d fit in a package\n", UPK_MAX_IMAGES);
+      return(-1);
     }
-  else if(strcmp(argv[1], "nh") == 0) 
+  if((w->names[w->num] = dup_str(name)) == NULL)
+    return(-1);
+  w->types[w->num] = type;
+  w->num++;
+  return 0;
+}
+
+int upk_writer_add_image(upk_writer_t *w, const char *name)
+{
+  return upk_writer_add_image_type(w, name, IH_TYPE_INVALID);
+}
+
+int upk_writer_set_version(upk_writer_t *w, const char *file, const char *version)
+{
+  int k;
+
+  for(k = 0; k < VER_FILES; k++)
+    if(strcmp(file, ver_files[k]) == 0)
+      break;
+  if(k == VER_FILES)
     {
-      flag =0; /* has no hw*/
-      img_pos =4;
+      printf("unknown version file: %s\n", file);
+      return(-1);
     }
-  else 
+  if(strlen(version) >= VERLEN)
     {
-      printf("ERROR:pass wrong flag\n");
+      printf("%s is too long\n", file);
       return(-1);
     }
+  /* exactly what a one line file would hold */
+  memset(w->ver[k].text, 0, sizeof(w->ver[k].text));
+  w->ver[k].len = sprintf((char *)w->ver[k].text, "%s\n", version);
+  w->ver[k].given = 1;
+  return 0;
+}
+
+int upk_writer_set_board(upk_writer_t *w, const char *board)
+{
+  const upk_board_t *b = upk_board_find(board);
 
-  if(argc < img_pos+1)
+  if(b == NULL)
     {
-      if(flag)
-	  printf("usage: packet flag upk_desc package_name hw1 hw2 image1 image2 ...\n");
-      else 
-	  printf("usage: packet flag upk_desc package_name image1 image2 ...\n");
+      printf("unknown board: %s\n", board);
       return(-1);
     }
+  w->board = b;
+  return 0;
+}
 
-  strncpy((char *)phd->p_name, argv[3], NAMELEN-1);
-  if((fp_w = fopen((char *)phd->p_name, "wb+")) == NULL)
+int upk_writer_set_rootfs(upk_writer_t *w, const upk_region_t *r, int n)
+{
+  int i;
+
+  if(n < 0 || n > UPK_MAX_REGIONS)
     {
-      printf("Can't open %s\n",phd->p_name);
+      printf("at most %d rootfs regions\n", UPK_MAX_REGIONS);
       return(-1);
     }
+  for(i = 0; i < n; i++)
+    if(r[i].end < r[i].start || (i > 0 && r[i].start <= r[i-1].end))
+      {
+	printf("rootfs regions must be in order and not overlap\n");
+	return(-1);
+      }
+  memcpy(w->rootfs, r, n * sizeof(*r));
+  w->nrootfs = n;
+  return 0;
+}
 
-  /* packet hw to package */
-  if(flag)
-  {
-       if((hw_len = pack_hw(fp_w, &argv[4])) == 0)
-	    return (-1);
-  }
-  /* packet the new signature */
-  if((siglen = pack_signature(fp_w)) == 0)
-      return (-1);
-  hw_len += siglen;
-  /* packet firmware to package */
-  if(pack_firmware(fp_w, hw_len, argc-img_pos, &argv[img_pos]) != 0) 
-    return (-1);
-  /* packet upk_desc and version info */
-  if(pack_ver_info(fp_w, hw_len+phd->p_headsize, flag, argv[2]) != 0)
-    return (-1);
-
-  /* write hw flag and hw_len */
-  fseek(fp_w, 0, SEEK_END);
-  if(fwrite(&hw_flag, sizeof(hw_flag), 1, fp_w) != 1)
-    {
-      printf("can not write hw flag into package");
+int upk_writer_add_variant(upk_writer_t *w, const char *board, int hw,
+			   const char *desc, const char *path)
+{
+  upk_variant_t *v = &w->variant[w->nvariants];
+
+  if(w->nvariants >= UPK_MAX_VARIANTS)
+    {
+      printf("too many variants, at most %d\n", UPK_MAX_VARIANTS);
       return(-1);
     }
-  if(fwrite(&hw_len, sizeof(hw_len), 1, fp_w) != 1)
+  if((v->board = upk_board_find(board)) == NULL)
     {
-      printf("can not write hw_len into package");
+      printf("unknown board: %s\n", board);
       return(-1);
     }
+  if(desc && strlen(desc) >= DESCLEN)
+    {
+      printf("The upk_desc is too long\n");
+      return(-1);
+    }
+  v->hw   = hw;
+  v->desc = dup_str(desc);
+  v->path = dup_str(path);
+  if((desc && !v->desc) || !v->path)
+    {
+      free(v->desc);
+      free(v->path);
+      return(-1);
+    }
+  w->nvariants++;
+  return 0;
+}
+
+int upk_writer_variants(const upk_writer_t *w)
+{
+  return w->nvariants;
+}
 
-  fclose(fp_w);
+int upk_writer_set_output(upk_writer_t *w, const char *path)
+{
+  free(w->output);
+  w->output = dup_str(path);
+  return w->output ? 0 : -1;
+}
+
+const char *upk_writer_output(const upk_writer_t *w)
+{
+  return w->output;
+}
+
+/* lay the whole package out and hash it, before writing a byte of it */
+/* hash: the parts now, else pipe_parts() does it while writing */
+static int plan_package(upk_writer_t *w, const char *path, int hash)
+{
+  package_header_t *phd = &w->head;
+  /* plan_firmware() may split root.cramfs across all the regions */
+  char *names[UPK_MAX_IMAGES + UPK_MAX_REGIONS - 1];
+  int types[UPK_MAX_IMAGES + UPK_MAX_REGIONS - 1];
+  uint32 hw_len = 0;
+  int i;
+
+  if(w->stats)
+    w->srec = upk_stats_package(w->stats, path);
+  memset(&w->head, 0, sizeof(w->head));
+  memset(w->info, 0, sizeof(w->info));
+  memcpy(names, w->names, sizeof(w->names));
+  names[w->num] = NULL;
+  for(i = 0; i < w->num; i++)
+    types[i] = w->types[i] ? w->types[i] : image_type(names[i]);
+  strncpy((char *)phd->p_name, path, NAMELEN-1);
+  w->layout = *w->board;
+  if(w->nrootfs)
+    {
+      memcpy(w->layout.rootfs, w->rootfs, sizeof(w->rootfs));
+      w->layout.nrootfs = w->nrootfs;
+    }
+  /* checked here, not when set: the board may still change (--board
+     after the regions, a variant) */
+  if(upk_board_check_regions(&w->layout, w->layout.rootfs, w->layout.nrootfs) != 0)
+    return(-1);
 
+  if(w->hw[0])
+  {
+       if((hw_len = plan_hw(w)) == 0)
+	    return(-1);
+  }
+  plan_signature(w);
+  hw_len += sizeof(signature_t);
+  w->hw_len = hw_len;
+  if(plan_firmware(w, w->num, names, types) != 0 ||
+     plan_ver_info(w) != 0 ||
+     (hash && hash_parts(w) != 0))
+    return(-1);
   return 0;
 }
 
+/* version files are read at most once each for every package */
+static void reload_versions(upk_writer_t *w)
+{
+  int i;
+
+  for(i = 0; i < VER_FILES; i++)
+    if(!w->ver[i].given)
+      w->ver[i].len = -1;
+}
+
+/* and directories packed at most once */
+static void reload_inputs(upk_writer_t *w)
+{
+  reload_versions(w);
+  drop_packed(w);
+}
+
+static void plan_close(upk_writer_t *w)
+{
+  int i;
+
+  part_close(&w->hwp[0]);
+  part_close(&w->hwp[1]);
+  for(i = 0; i < UPK_MAX_IMAGES; i++)
+    part_close(&w->part[i]);
+}
+
+/* the package's length, as emit_package() lays it out */
+static off_t planned_size(const upk_writer_t *w)
+{
+  off_t size = (off_t)w->hw_len + w->head.p_headsize + 2 * sizeof(version_info) +
+    2 * sizeof(uint32);
+  int i;
+
+  for(i = 0; i < w->head.p_imagenum; i++)
+    size += w->info[i].i_imagesize;
+  return size;
+}
+
+static void memo_add_part(memo_hash_t *h, const upk_part_t *p)
+{
+  uint64 len = p->len;
+
+  memo_hash_add(h, &len, sizeof(len));
+  memo_hash_add(h, &p->eof, sizeof(p->eof));
+  memo_hash_add(h, &p->crc, sizeof(p->crc));
+}
+
+/*
+ * The memo key of a planned and hashed package: every byte it will have
+ * follows from the header, image table and version block (flags, board,
+ * upk_desc and the *.version files all end up there), the hw section's
+ * layout and each part's length and crc.
+ */
+static void memo_key(const upk_writer_t *w, char *key)
+{
+  memo_hash_t h;
+  int i;
+
+  memo_hash_init(&h);
+  memo_hash_add(&h, "upk-memo 1 " VERSION, sizeof("upk-memo 1 " VERSION));
+  memo_hash_add(&h, &w->sig, sizeof(w->sig));
+  memo_hash_add(&h, &w->hw_len, sizeof(w->hw_len));
+  if(w->hw[0])
+    {
+      memo_add_part(&h, &w->hwp[0]);
+      memo_add_part(&h, &w->hwp[1]);
+    }
+  memo_hash_add(&h, &w->head, sizeof(w->head));
+  memo_hash_add(&h, w->info, w->head.p_imagenum * sizeof(image_info_t));
+  memo_hash_add(&h, &w->vinfo, sizeof(w->vinfo));
+  for(i = 0; i < w->head.p_imagenum; i++)
+    memo_add_part(&h, &w->part[i]);
+  memo_hash_key(&h, key);
+}
+
+static int read_is(int fd, const void *want, size_t len, off_t off)
+{
+  uint8 buf[sizeof(package_header_t) + UPK_MAX_IMAGES * sizeof(image_info_t)];
+
+  return len <= sizeof(buf) && pread(fd, buf, len, off) == (ssize_t)len &&
+    memcmp(buf, want, len) == 0;
+}
+
+/* whether a store entry holds what the key says: a package of the
+   planned length with this header, image table, version blocks and
+   stored crcs, so a damaged or overwritten entry is never used */
+static int memo_check(const upk_writer_t *w, int fd)
+{
+  const package_header_t *phd = &w->head;
+  struct stat st;
+  off_t end, hw2;
+  int i;
+
+  if(fstat(fd, &st) != 0 || st.st_size != planned_size(w))
+    return 0;
+  end = st.st_size - 2 * sizeof(uint32);
+  if(!read_is(fd, &w->sig, sizeof(w->sig), w->hw_len - sizeof(signature_t)) ||
+     !read_is(fd, phd, sizeof(*phd), w->hw_len) ||
+     !read_is(fd, w->info, phd->p_imagenum * sizeof(image_info_t),
+	      (off_t)w->hw_len + sizeof(*phd)) ||
+     !read_is(fd, &w->vinfo, sizeof(w->vinfo), (off_t)w->hw_len + phd->p_headsize) ||
+     !read_is(fd, &w->vinfo, sizeof(w->vinfo), end - sizeof(version_info)) ||
+     !read_is(fd, &hw_flag, sizeof(hw_flag), end) ||
+     !read_is(fd, &w->hw_len, sizeof(w->hw_len), end + sizeof(uint32)))
+    return 0;
+  if(w->hw[0])
+    {
+      hw2 = (off_t)w->hwp[0].len + w->hwp[0].eof;
+      if(!read_is(fd, &w->hwp[1].crc, sizeof(uint32), hw2) ||
+	 !read_is(fd, &w->hw2_len, sizeof(uint32), hw2 + sizeof(uint32)))
+	return 0;
+    }
+  for(i = 0; i < phd->p_imagenum; i++)
+    if(w->info[i].i_type == IH_TYPE_COMPRESS &&
+       !read_is(fd, &w->part[i].crc, sizeof(uint32), (off_t)w->hw_len +
+		w->info[i].i_startaddr_p + w->info[i].i_imagesize - sizeof(uint32)))
+      return 0;
+  return 1;
+}
+
+/* path from the store if it holds this package: 1, else 0 */
+static int memo_lookup(upk_writer_t *w, const char *key, const char *path)
+{
+  upk_mark_t m;
+  int fd, ok, how;
+
+  stat_begin(w, &m);
+  if((fd = memo_open(w->memo, key)) < 0)
+    return 0;
+  ok = memo_check(w, fd);
+  close(fd);
+  if(!ok || (how = memo_get(w->memo, key, path, w->copy.flags)) < 0)
+    return 0;
+  stat_end(w, &m, UPK_STATS_PACKAGE, UPK_PHASE_WRITE, 0);
+  printf("%s: unchanged, %s from the memo store\n", path, memo_how(how));
+  return 1;
+}
+
+static int write_path(upk_writer_t *w, const char *path)
+{
+  char buf[PATH_MAX], tmp[PATH_MAX + 32], key[MEMO_KEY_LEN];
+  upk_mark_t m;
+  struct stat st;
+  int fd = -1, ret = -1;
+  /* a copy through user space reads every image anyway: hash it then,
+     unless the cache knows the crcs without reading (or the memo key
+     needs them first) */
+  int pipelined = !(w->copy.flags & (STREAM_ZERO_COPY | STREAM_URING)) &&
+    w->copy.cache == NULL && w->memo == NULL;
+  const char *file;
+
+  tmp[0] = '\0';
+  if(plan_package(w, path, !pipelined) != 0)
+    goto out;
+  if((file = upk_path(w, path, buf)) == NULL)
+    {
+      printf("Can't open %s\n", path);
+      goto out;
+    }
+  if(w->memo)
+    {
+      memo_key(w, key);
+      if(memo_lookup(w, key, file))
+	{
+	  ret = 0;
+	  goto out;
+	}
+    }
+  stat_begin(w, &m);
+  /* the package may be a hard link into a store, this build's or an
+     earlier one's: write a new file and rename it over the old one
+     instead of truncating the stored copy too */
+  if((w->memo || (stat(file, &st) == 0 && st.st_nlink > 1)) ?
+     (fd = memo_tmp(file, tmp, sizeof(tmp))) < 0 :
+     (fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+    {
+      printf("Can't open %s\n", path);
+      goto out;
+    }
+  stat_end(w, &m, UPK_STATS_PACKAGE, UPK_PHASE_OPEN, 0);
+  if(emit_package(w, fd, 0, pipelined) != 0)
+    {
+      printf("can not write %s\n", path);
+      goto out;
+    }
+  ret = 0;
+
+out:
+  if(fd >= 0 && close(fd) != 0 && ret == 0)
+    {
+      printf("can not write %s\n", path);
+      ret = -1;
+    }
+  if(tmp[0] && ret == 0 && rename(tmp, file) != 0)
+    {
+      printf("can not write %s\n", path);
+      ret = -1;
+    }
+  if(tmp[0] && ret != 0)
+    unlink(tmp);
+  /* a store that can't take it costs the next build, not this one */
+  if(w->memo && tmp[0] && ret == 0 && memo_put(w->memo, key, file, w->copy.flags) < 0)
+    printf("%s: can't add it to the memo store\n", path);
+  plan_close(w);
+  return ret;
+}
+
+int upk_writer_write(upk_writer_t *w, const char *path)
+{
+  reload_inputs(w);
+  return write_path(w, path);
+}
+
+int upk_writer_write_fd(upk_writer_t *w, const char *name, int fd)
+{
+  int ret = -1;
+
+  reload_inputs(w);
+  if(plan_package(w, name, 1) != 0)
+    goto out;
+  /* everything goes out in order, so any fd will do */
+  if(emit_package(w, fd, -1, 0) != 0)
+    {
+      printf("can not write %s\n", name);
+      goto out;
+    }
+  ret = 0;
+out:
+  plan_close(w);
+  return ret;
+}
+
+int upk_writer_write_variants(upk_writer_t *w)
+{
+  const upk_board_t *board = w->board;
+  char *desc = w->desc, *hw[2] = { w->hw[0], w->hw[1] };
+  crc_cache_t *cache = NULL;
+  upk_variant_t *v;
+  int i, bad = 0;
 
+  if(w->nvariants == 0)
+    return 0;
+  /* the cache hashes each input whole, whatever cuts the boards make */
+  if(w->copy.cache == NULL && (cache = w->copy.cache = crc_cache_new()) == NULL)
+    return w->nvariants;
+  /* directories the writer's own package packed are used again */
+  reload_versions(w);
+  for(i = 0; i < w->nvariants; i++)
+    {
+      v = &w->variant[i];
+      if(v->hw && hw[0] == NULL)
+	{
+	  printf("%s: an hh package needs the hw images\n", v->path);
+	  bad++;
+	  continue;
+	}
+      w->board = v->board;
+      w->desc  = v->desc ? v->desc : desc;
+      w->hw[0] = v->hw ? hw[0] : NULL;
+      w->hw[1] = v->hw ? hw[1] : NULL;
+      if(write_path(w, v->path) != 0)
+	bad++;
+    }
+  w->board = board;
+  w->desc  = desc;
+  w->hw[0] = hw[0];
+  w->hw[1] = hw[1];
+  if(cache)
+    {
+      w->copy.cache = NULL;
+      crc_cache_free(cache);
+    }
+  return bad;
+}
+
+const package_header_t *upk_writer_header(const upk_writer_t *w)
+{
+  return &w->head;
+}
+
+const image_info_t *upk_writer_images(const upk_writer_t *w)
+{
+  return w->info;
+}
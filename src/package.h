@@ -50,11 +50,13 @@
 #define IH_TYPE_CRAMFS          9       /* CRAMFS Image                 */
 #define IH_TYPE_COMPRESS        10      /* Compress files               */
 
-/* addr in flash */
-#if FLASH_16M
+/* addr in flash, see the board profiles in board.c; FLASH_16M only
+   picks the default one */
 #define UBOOT_ADDR_START      0x00100000
 #define UBOOT_ADDR_END        0x0013FFFF
 #define KERNEL_ADDR_START     0x00160000
+
+/* 16M */
 #define KERNEL_ADDR_END       0x002DFFFF
 #define CRAMFS_ADDR_START1    0x002E0000
 #define CRAMFS_ADDR_END1      0x009DFFFF
@@ -62,18 +64,20 @@
 #define CRAMFS_ADDR_END2      0x00FFFFFF
 #define JFFS_ADDR_START       0x01000000
 #define JFFS_ADDR_END         0x010FFFFF
-#else
-#define UBOOT_ADDR_START      0x00100000
-#define UBOOT_ADDR_END        0x0013FFFF
-#define KERNEL_ADDR_START     0x00160000
-#define KERNEL_ADDR_END       0x0027FFFF
+
+/* 8M */
+#define KERNEL_ADDR_END_8M    0x0027FFFF
 #define CRAMFS_ADDR_START     0x00280000
 #define CRAMFS_ADDR_END       0x0088FFFF
-#define JFFS_ADDR_START       0x00890000
-#define JFFS_ADDR_END         0x008EFFFF
+#define JFFS_ADDR_START_8M    0x00890000
+#define JFFS_ADDR_END_8M      0x008EFFFF
 #define RAMDISK_ADDR_START    0x008F0000
 #define RAMDISK_ADDR_END      0x008FFFFF
-#endif
+
+#define SZ_8K  0x2000
+#define HW_MAX_LEN  (14 * SZ_8K)   /* hw section, padded to 8K, by default */
+
+#define VER_LIMIT_LEN	14
 
 #define UBOOT_FILE_NAME   "u-boot.bin"
 #define KERNEL_FILE_NAME  "uImage"
@@ -91,7 +95,11 @@
 typedef unsigned char  uint8;
 typedef unsigned short uint16;
 typedef unsigned int   uint32;
-typedef unsigned long  uint64;
+typedef unsigned long long uint64;
+
+/* sizes and offsets are 32-bit on disk (image_info_t, the trailer's hw_len):
+   nothing from the package header on may end beyond this */
+#define UPK_SIZE_MAX  0xffffffffULL
 
 #define SWAP_LONG(x) \
 	((uint32)( \
@@ -149,6 +157,8 @@ typedef struct image_header {
 	uint8		ih_name[NAMELEN];	/* Image Name		*/
 } image_header_t;
 
+#define HW_FLAG 0x55AAAA55 /* trailer: hw_flag, then hw_len */
+
 #define NEUROS_UPK_SIGNATURE "Neuros Technology International LLC"
 typedef struct signature_struct{
     uint8    string[SIGNATURELEN];
@@ -167,6 +177,10 @@ typedef struct version_struct{
 
 
 extern unsigned long crc32 (unsigned long, const unsigned char *, unsigned int);
+extern unsigned long crc32_combine (unsigned long crc1, unsigned long crc2,
+				    unsigned long long len2);
+extern int crc32_set_kernel (const char *name);     /* 0 ok, -1 unknown/unsupported */
+extern const char *crc32_kernel_name (int k);       /* k < 0: the active kernel     */
 
 #endif
 
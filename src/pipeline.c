@@ -0,0 +1,224 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** pipeline.c
+ *
+ *  The read/hash/write pipeline, see pipeline.h.
+ *
+ *  Buffers go round three rings: free (writer to reader), full (reader to
+ *  hasher) and hashed (hasher to writer).  Each ring has one producer and
+ *  one consumer, so pushing and popping take no lock, just a load and a
+ *  store of the indices; a stage whose ring is empty sleeps on a futex
+ *  over the index it waits for, woken by every push.  A block with no
+ *  part (-1) ends the stream.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "pipeline.h"
+#include "stream.h"
+
+typedef struct pl_block {
+  uint8  *buf;
+  size_t  len;
+  int     part;                /* -1: the end */
+  off_t   off_w;
+  int     err;                 /* the read failed */
+} pl_block_t;
+
+/* a ring never holds more than the PIPELINE_DEPTH blocks there are */
+typedef struct spsc {
+  pl_block_t *slot[PIPELINE_DEPTH];
+  unsigned    head;            /* next to pop, the consumer's  */
+  unsigned    tail;            /* next to push, the producer's */
+} spsc_t;
+
+typedef struct pl {
+  pipeline_part_t *parts;
+  int              n;
+  int              fd_w;
+  spsc_t           free_, full, hashed;
+  int              failed;      /* the writer gave up: stop reading */
+} pl_t;
+
+static void futex_wait(unsigned *addr, unsigned val)
+{
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(unsigned *addr)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static void spsc_push(spsc_t *q, pl_block_t *b)
+{
+  unsigned tail = q->tail;
+
+  q->slot[tail % PIPELINE_DEPTH] = b;
+  /* the slot is written before the consumer can see it */
+  __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+  futex_wake(&q->tail);
+}
+
+static pl_block_t *spsc_pop(spsc_t *q)
+{
+  unsigned head = q->head, tail;
+  pl_block_t *b;
+
+  while((tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) == head)
+    futex_wait(&q->tail, tail);
+  b = q->slot[head % PIPELINE_DEPTH];
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+  return b;
+}
+
+static void *hasher(void *arg)
+{
+  pl_t *pl = arg;
+  pl_block_t *b;
+  int part;
+
+  /* a block is not ours to look at once it is passed on */
+  do
+    {
+      b = spsc_pop(&pl->full);
+      part = b->part;
+      if(part >= 0 && !b->err && pl->parts[part].hash)
+	pl->parts[part].crc = crc32(pl->parts[part].crc, b->buf, b->len);
+      spsc_push(&pl->hashed, b);
+    }
+  while(part >= 0);
+  return NULL;
+}
+
+static void *writer(void *arg)
+{
+  pl_t *pl = arg;
+  pl_block_t *b;
+  ssize_t n;
+  size_t done;
+  int part;
+
+  do
+    {
+      b = spsc_pop(&pl->hashed);
+      part = b->part;
+      if(part >= 0 && !__atomic_load_n(&pl->failed, __ATOMIC_RELAXED))
+	{
+	  for(done = 0; !b->err && done < b->len; done += n)
+	    {
+	      n = pwrite(pl->fd_w, b->buf + done, b->len - done, b->off_w + done);
+	      if(n < 0 && errno == EINTR)
+		n = 0;
+	      else if(n <= 0)
+		break;
+	    }
+	  if(b->err || done < b->len)
+	    __atomic_store_n(&pl->failed, 1, __ATOMIC_RELAXED);
+	}
+      spsc_push(&pl->free_, b);
+    }
+  while(part >= 0);
+  return NULL;
+}
+
+/* the reader, on the calling thread */
+static void reader(pl_t *pl)
+{
+  pipeline_part_t *p;
+  pl_block_t *b;
+  size_t at, done, len;
+  ssize_t n;
+  int i, err;
+
+  for(i = 0; i < pl->n; i++)
+    {
+      p = &pl->parts[i];
+      p->crc = 0;
+      for(at = 0; at < p->len; at += len)
+	{
+	  if(__atomic_load_n(&pl->failed, __ATOMIC_RELAXED))
+	    return;
+	  b = spsc_pop(&pl->free_);
+	  b->part  = i;
+	  b->len   = p->len - at < PIPELINE_BUF ? p->len - at : PIPELINE_BUF;
+	  b->off_w = p->off_w + at;
+	  b->err   = 0;
+	  for(done = 0; done < b->len; done += n)
+	    {
+	      n = pread(p->fd, b->buf + done, b->len - done, p->off + at + done);
+	      if(n < 0 && errno == EINTR)
+		n = 0;
+	      else if(n <= 0)
+		{
+		  b->err = 1;
+		  break;
+		}
+	    }
+	  len = b->len;
+	  err = b->err;
+	  spsc_push(&pl->full, b);
+	  if(err)
+	    return;
+	}
+    }
+}
+
+int pipeline_copy(pipeline_part_t *parts, int n, int fd_w)
+{
+  pl_block_t block[PIPELINE_DEPTH], *end;
+  pthread_t th, tw;
+  pl_t *pl;
+  uint8 *mem = NULL;
+  int i, ret = -1;
+
+  if((pl = calloc(1, sizeof(*pl))) == NULL ||
+     posix_memalign((void **)&mem, STREAM_ALIGN, PIPELINE_DEPTH * PIPELINE_BUF) != 0)
+    {
+      free(pl);
+      return(-1);
+    }
+  pl->parts = parts;
+  pl->n     = n;
+  pl->fd_w  = fd_w;
+  for(i = 0; i < PIPELINE_DEPTH; i++)
+    {
+      block[i].buf = mem + (size_t)i * PIPELINE_BUF;
+      spsc_push(&pl->free_, &block[i]);
+    }
+  if(pthread_create(&th, NULL, hasher, pl) != 0)
+    goto out;
+  if(pthread_create(&tw, NULL, writer, pl) != 0)
+    {
+      /* no writer: just end the hasher */
+      end = spsc_pop(&pl->free_);
+      end->part = -1;
+      spsc_push(&pl->full, end);
+      pthread_join(th, NULL);
+      goto out;
+    }
+
+  reader(pl);
+  end = spsc_pop(&pl->free_);
+  end->part = -1;
+  spsc_push(&pl->full, end);
+  pthread_join(th, NULL);
+  pthread_join(tw, NULL);
+  ret = pl->failed ? -1 : 0;
+
+out:
+  free(mem);
+  free(pl);
+  return ret;
+}
@@ -0,0 +1,40 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** pipeline.h
+ *
+ * Read, hash and write image payloads in one pass, on three threads: a
+ * reader filling buffers, a hasher and a writer, handing the buffers on
+ * through single-producer/single-consumer rings.  PIPELINE_DEPTH buffers
+ * of PIPELINE_BUF bytes are all the memory it takes, however big the
+ * images are, and reading, hashing and writing overlap so a copy runs at
+ * the speed of the slowest of the three rather than of their sum.
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "package.h"
+
+#define PIPELINE_DEPTH  16
+#define PIPELINE_BUF    0x40000
+
+typedef struct pipeline_part {
+  int     fd;
+  off_t   off;
+  size_t  len;
+  off_t   off_w;              /* where it goes in the output    */
+  int     hash;               /* 0: just copy, crc known        */
+  uint32  crc;                /* set to crc32(0, bytes) if hash */
+} pipeline_part_t;
+
+/* copy the n parts, in order, into fd_w at their offsets.  0 or -1 */
+extern int pipeline_copy(pipeline_part_t *parts, int n, int fd_w);
+
+#endif
@@ -0,0 +1,178 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** pool.c
+ *
+ *  Thread pool used to hash and write images in parallel.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "pool.h"
+
+typedef struct pool_job {
+  struct pool_job *next;
+  pool_group_t    *grp;
+  pool_fn          fn;
+  void            *arg;
+} pool_job_t;
+
+struct pool {
+  pthread_mutex_t lock;
+  pthread_cond_t  work;       /* a job was queued or the pool is closing */
+  pthread_cond_t  done;       /* some group's pending count dropped      */
+  pool_job_t     *head, *tail;
+  int             nthreads;
+  int             closing;
+  pthread_t      *tids;
+};
+
+/* called with the lock held; drops it while the job runs.  prev is the
+   job queued before it, NULL for the head */
+static void run_job(pool_t *pool, pool_job_t *prev, pool_job_t *job)
+{
+  if(prev)
+    prev->next = job->next;
+  else
+    pool->head = job->next;
+  if(pool->tail == job)
+    pool->tail = prev;
+  pthread_mutex_unlock(&pool->lock);
+
+  job->fn(job->arg);
+
+  pthread_mutex_lock(&pool->lock);
+  if(--job->grp->pending == 0)
+    pthread_cond_broadcast(&pool->done);
+  free(job);
+}
+
+static void *worker(void *arg)
+{
+  pool_t *pool = arg;
+
+  pthread_mutex_lock(&pool->lock);
+  while(1)
+    {
+      while(pool->head == NULL && !pool->closing)
+	pthread_cond_wait(&pool->work, &pool->lock);
+      if(pool->head == NULL)
+	break;
+      run_job(pool, NULL, pool->head);
+    }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+pool_t *pool_create(int nthreads)
+{
+  pool_t *pool;
+  int i;
+
+  if(nthreads <= 0)
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if(nthreads <= 0)
+    nthreads = 1;
+
+  if((pool = calloc(1, sizeof(*pool))) == NULL)
+    return NULL;
+  if((pool->tids = calloc(nthreads, sizeof(pthread_t))) == NULL)
+    {
+      free(pool);
+      return NULL;
+    }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  for(i = 0; i < nthreads; i++)
+    {
+      if(pthread_create(&pool->tids[i], NULL, worker, pool) != 0)
+	break;
+      pool->nthreads++;
+    }
+  if(pool->nthreads == 0)
+    {
+      pool_destroy(pool);
+      return NULL;
+    }
+  return pool;
+}
+
+void pool_destroy(pool_t *pool)
+{
+  int i;
+
+  if(pool == NULL)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  pool->closing = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  for(i = 0; i < pool->nthreads; i++)
+    pthread_join(pool->tids[i], NULL);
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->done);
+  free(pool->tids);
+  free(pool);
+}
+
+int pool_threads(const pool_t *pool)
+{
+  return pool ? pool->nthreads : 1;
+}
+
+int pool_submit(pool_t *pool, pool_group_t *grp, pool_fn fn, void *arg)
+{
+  pool_job_t *job;
+
+  if(pool == NULL || (job = malloc(sizeof(*job))) == NULL)
+    {
+      fn(arg);
+      return 0;
+    }
+  job->next = NULL;
+  job->grp  = grp;
+  job->fn   = fn;
+  job->arg  = arg;
+
+  pthread_mutex_lock(&pool->lock);
+  grp->pending++;
+  if(pool->tail)
+    pool->tail->next = job;
+  else
+    pool->head = job;
+  pool->tail = job;
+  pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+void pool_wait(pool_t *pool, pool_group_t *grp)
+{
+  pool_job_t *prev, *job;
+
+  if(pool == NULL)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  while(grp->pending)
+    {
+      /* help out rather than sleep while the group has queued work; only
+	 with its own jobs, another group's job might wait for something
+	 this thread holds (a file it is hashing for the crc cache) */
+      for(prev = NULL, job = pool->head; job && job->grp != grp; job = job->next)
+	prev = job;
+      if(job)
+	run_job(pool, prev, job);
+      else
+	pthread_cond_wait(&pool->done, &pool->lock);
+    }
+  pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,40 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** pool.h
+ *
+ * A small fixed-size thread pool.  Work is submitted against a group and
+ * pool_wait() blocks until everything in that group has run; the waiting
+ * thread runs queued jobs of that group itself meanwhile, so jobs may wait on
+ * groups of their own without starving the pool.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+
+typedef struct pool pool_t;
+
+typedef struct pool_group {
+  int pending;                /* jobs submitted but not finished */
+} pool_group_t;
+
+#define POOL_GROUP_INIT { 0 }
+
+typedef void (*pool_fn)(void *arg);
+
+/* nthreads <= 0 means one per online CPU; NULL on failure */
+extern pool_t *pool_create(int nthreads);
+extern void    pool_destroy(pool_t *pool);
+extern int     pool_threads(const pool_t *pool);
+
+/* with pool == NULL the job simply runs in the caller */
+extern int     pool_submit(pool_t *pool, pool_group_t *grp, pool_fn fn, void *arg);
+extern void    pool_wait(pool_t *pool, pool_group_t *grp);
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** reader.c
+ *
+ *  Opens an existing package and checks that its structures hang
+ *  together, for the tools that work on finished packages.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "upk.h"
+
+static int read_at(int fd, void *buf, size_t len, off_t off)
+{
+  return pread(fd, buf, len, off) == (ssize_t)len ? 0 : -1;
+}
+
+int upk_pkg_open(upk_pkg_t *pkg, const char *path, int writable)
+{
+  package_header_t *phd = &pkg->head;
+  struct stat st;
+  uint32 trailer[2];
+  int i;
+
+  memset(pkg, 0, sizeof(*pkg));
+  if((pkg->fd = open(path, writable ? O_RDWR : O_RDONLY)) < 0)
+    {
+      printf("Can't open %s\n", path);
+      return -1;
+    }
+  if(fstat(pkg->fd, &st) != 0)
+    goto bad;
+  pkg->size = st.st_size;
+
+  if(pkg->size < (off_t)(sizeof(signature_t) + sizeof(package_header_t) +
+			 2 * sizeof(version_info) + UPK_TRAILER_LEN) ||
+     read_at(pkg->fd, trailer, sizeof(trailer), pkg->size - UPK_TRAILER_LEN) != 0 ||
+     trailer[0] != HW_FLAG)
+    {
+      printf("%s: not a package (no hw_flag trailer)\n", path);
+      goto fail;
+    }
+  pkg->hw_flag = trailer[0];
+  pkg->hw_len  = trailer[1];
+
+  if(pkg->hw_len < sizeof(signature_t) ||
+     pkg->hw_len + (off_t)sizeof(package_header_t) > pkg->size ||
+     read_at(pkg->fd, phd, sizeof(*phd), pkg->hw_len) != 0)
+    goto bad;
+  if(phd->p_imagenum > UPK_MAX_IMAGES ||
+     phd->p_headsize != sizeof(package_header_t) + phd->p_imagenum * sizeof(image_info_t) ||
+     UPK_VER_OFF(pkg) + (off_t)sizeof(version_info) > UPK_VER2_OFF(pkg))
+    goto bad;
+  if(read_at(pkg->fd, pkg->info, phd->p_imagenum * sizeof(image_info_t),
+	     (off_t)pkg->hw_len + sizeof(package_header_t)) != 0 ||
+     read_at(pkg->fd, &pkg->ver[0], sizeof(version_info), UPK_VER_OFF(pkg)) != 0 ||
+     read_at(pkg->fd, &pkg->ver[1], sizeof(version_info), UPK_VER2_OFF(pkg)) != 0)
+    goto bad;
+
+  for(i = 0; i < phd->p_imagenum; i++)
+    if(pkg->info[i].i_startaddr_p < phd->p_headsize + sizeof(version_info) ||
+       UPK_IMG_OFF(pkg, i) + pkg->info[i].i_imagesize > UPK_VER2_OFF(pkg))
+      goto bad;
+  return 0;
+
+bad:
+  printf("%s: damaged package header\n", path);
+fail:
+  close(pkg->fd);
+  pkg->fd = -1;
+  return -1;
+}
+
+int upk_pkg_map(upk_pkg_t *pkg)
+{
+  void *map;
+
+  if(pkg->map)
+    return 0;
+  if((uint64)pkg->size > SIZE_MAX)
+    return -1;           /* a 32-bit address space can't hold it */
+  map = mmap(NULL, pkg->size, PROT_READ, MAP_SHARED, pkg->fd, 0);
+  if(map == MAP_FAILED)
+    return -1;
+  pkg->map = map;
+  return 0;
+}
+
+/*
+ * Every part of a split root.cramfs but the last filled its region.  The
+ * last one was cut at its region too unless that is the board's last
+ * rootfs region, which takes whatever is left.
+ */
+uint32 upk_pkg_part_limit(const upk_pkg_t *pkg, int i)
+{
+  const image_info_t *iif = &pkg->info[i];
+  const upk_board_t *board;
+
+  if(iif->i_type != IH_TYPE_CRAMFS || iif->i_endaddr_f < iif->i_startaddr_f)
+    return 0;
+  if(i + 1 < pkg->head.p_imagenum && pkg->info[i+1].i_type == IH_TYPE_CRAMFS)
+    return iif->i_endaddr_f + 1 - iif->i_startaddr_f;
+  board = upk_board_by_flash(pkg->head.p_reserve);
+  if(board == NULL || iif->i_endaddr_f == board->rootfs[board->nrootfs - 1].end)
+    return 0;
+  return iif->i_endaddr_f + 1 - iif->i_startaddr_f;
+}
+
+/*
+ * The old builder's readers left the 0xff from fgetc()'s EOF in the
+ * version fields, right after the NUL the newline became, where the
+ * builder now only zero pads.  Such a package has the EOF byte after
+ * every image too.
+ */
+int upk_pkg_legacy(const upk_pkg_t *pkg)
+{
+  return memchr(pkg->head.p_vuboot,  LEGACY_EOF_BYTE, VERLEN) != NULL ||
+	 memchr(pkg->head.p_vkernel, LEGACY_EOF_BYTE, VERLEN) != NULL ||
+	 memchr(pkg->head.p_vrootfs, LEGACY_EOF_BYTE, VERLEN) != NULL;
+}
+
+void upk_pkg_close(upk_pkg_t *pkg)
+{
+  if(pkg->map)
+    munmap(pkg->map, pkg->size);
+  if(pkg->fd >= 0)
+    close(pkg->fd);
+  pkg->map = NULL;
+  pkg->fd = -1;
+}
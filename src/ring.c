@@ -0,0 +1,233 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** ring.c
+ *
+ *  io_uring set up by hand, see ring.h.  The submission and completion
+ *  rings are shared with the kernel through mmap(); the only ordering
+ *  that matters is publishing the SQ tail after the entries it covers
+ *  and reading CQ entries after the tail that announced them.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "ring.h"
+
+#if defined(HAVE_LINUX_IO_URING_H)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct ring {
+  int                  fd;
+  unsigned             queued;         /* prepared, not yet submitted */
+  unsigned             fixed;          /* buffers are registered      */
+  unsigned            *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned            *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void                *sq_map, *cq_map;
+  size_t               sq_len, cq_len, sqes_len;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned op, const void *arg, unsigned n)
+{
+  return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+ring_t *ring_new(unsigned depth, const struct iovec *bufs, unsigned nbufs)
+{
+  struct io_uring_params p;
+  ring_t *r;
+  uint8 *sq, *cq;
+
+  if((r = calloc(1, sizeof(*r))) == NULL)
+    return NULL;
+  memset(&p, 0, sizeof(p));
+  if((r->fd = uring_setup(depth, &p)) < 0)
+    {
+      free(r);
+      return NULL;
+    }
+  r->sq_len   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_len   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP)
+    r->sq_len = r->cq_len = r->sq_len > r->cq_len ? r->sq_len : r->cq_len;
+
+  r->sq_map = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if(r->sq_map == MAP_FAILED)
+    goto fail;
+  if(p.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_map = r->sq_map;
+  else if((r->cq_map = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, r->fd,
+			    IORING_OFF_CQ_RING)) == MAP_FAILED)
+    goto fail;
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if(r->sqes == MAP_FAILED)
+    goto fail;
+
+  sq = r->sq_map;
+  cq = r->cq_map;
+  r->sq_head  = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head  = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  /* locked memory may be short (RLIMIT_MEMLOCK): plain reads then */
+  if(bufs && nbufs &&
+     uring_register(r->fd, IORING_REGISTER_BUFFERS, bufs, nbufs) == 0)
+    r->fixed = 1;
+  return r;
+
+fail:
+  if(r->sqes && r->sqes != MAP_FAILED)
+    munmap(r->sqes, r->sqes_len);
+  if(r->cq_map && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map)
+    munmap(r->cq_map, r->cq_len);
+  if(r->sq_map && r->sq_map != MAP_FAILED)
+    munmap(r->sq_map, r->sq_len);
+  close(r->fd);
+  free(r);
+  return NULL;
+}
+
+void ring_free(ring_t *r)
+{
+  if(r == NULL)
+    return;
+  munmap(r->sqes, r->sqes_len);
+  if(r->cq_map != r->sq_map)
+    munmap(r->cq_map, r->cq_len);
+  munmap(r->sq_map, r->sq_len);
+  close(r->fd);
+  free(r);
+}
+
+static int ring_prep(ring_t *r, int op, int fd, const void *buf, size_t len,
+		     off_t off, int index, unsigned long long tag)
+{
+  unsigned tail = *r->sq_tail, head, i;
+  struct io_uring_sqe *sqe;
+
+  head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  if(tail - head > *r->sq_mask)
+    return -1;
+  i = tail & *r->sq_mask;
+  sqe = &r->sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  if(r->fixed && index >= 0)
+    {
+      sqe->opcode    = op == IORING_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+      sqe->buf_index = index;
+    }
+  else
+    sqe->opcode = op;
+  sqe->fd        = fd;
+  sqe->addr      = (unsigned long)buf;
+  sqe->len       = len;
+  sqe->off       = off;
+  sqe->user_data = tag;
+  r->sq_array[i] = i;
+  /* the entry must be visible before the tail that hands it over */
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  r->queued++;
+  return 0;
+}
+
+int ring_read(ring_t *r, int fd, void *buf, size_t len, off_t off,
+	      int index, unsigned long long tag)
+{
+  return ring_prep(r, IORING_OP_READ, fd, buf, len, off, index, tag);
+}
+
+int ring_write(ring_t *r, int fd, const void *buf, size_t len, off_t off,
+	       int index, unsigned long long tag)
+{
+  return ring_prep(r, IORING_OP_WRITE, fd, buf, len, off, index, tag);
+}
+
+int ring_wait(ring_t *r, unsigned long long *tag, int *res)
+{
+  struct io_uring_cqe *cqe;
+  unsigned head;
+  int n;
+
+  /* hand over what is queued even when a completion is already waiting */
+  while(r->queued)
+    {
+      if((n = uring_enter(r->fd, r->queued, 0, 0)) > 0)
+	r->queued -= n;
+      else if(n == 0 || errno != EINTR)
+	return -1;
+    }
+  for(;;)
+    {
+      head = *r->cq_head;
+      if(head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+	break;
+      if(uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+	return -1;
+    }
+  cqe  = &r->cqes[head & *r->cq_mask];
+  *tag = cqe->user_data;
+  *res = cqe->res;
+  __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+#else
+
+ring_t *ring_new(unsigned depth, const struct iovec *bufs, unsigned nbufs)
+{
+  return NULL;
+}
+
+void ring_free(ring_t *r)
+{
+}
+
+int ring_read(ring_t *r, int fd, void *buf, size_t len, off_t off,
+	      int index, unsigned long long tag)
+{
+  return -1;
+}
+
+int ring_write(ring_t *r, int fd, const void *buf, size_t len, off_t off,
+	       int index, unsigned long long tag)
+{
+  return -1;
+}
+
+int ring_wait(ring_t *r, unsigned long long *tag, int *res)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif
@@ -0,0 +1,43 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** ring.h
+ *
+ * A minimal io_uring on the raw system calls (no liburing): reads and
+ * writes at offsets, into buffers registered with the ring when the
+ * kernel and RLIMIT_MEMLOCK allow it.  Without <linux/io_uring.h>, or on
+ * a kernel that refuses it, ring_new() returns NULL and callers use
+ * pread()/pwrite() instead.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "package.h"
+
+typedef struct ring ring_t;
+
+/* a ring of depth entries; bufs, if not NULL, are registered for
+   ring_read()/ring_write() with their index.  NULL if unsupported */
+extern ring_t *ring_new(unsigned depth, const struct iovec *bufs, unsigned nbufs);
+extern void    ring_free(ring_t *r);
+
+/* queue one request, tag comes back with its completion; buf must lie
+   in registered buffer index (-1: not registered).  0, or -1 if full */
+extern int ring_read(ring_t *r, int fd, void *buf, size_t len, off_t off,
+		     int index, unsigned long long tag);
+extern int ring_write(ring_t *r, int fd, const void *buf, size_t len, off_t off,
+		      int index, unsigned long long tag);
+
+/* submit what is queued, then wait for at least one completion and
+   return it: 0, or -1 with errno if the ring itself failed */
+extern int ring_wait(ring_t *r, unsigned long long *tag, int *res);
+
+#endif
@@ -0,0 +1,325 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** stats.c
+ *
+ *  Build statistics, see stats.h.
+ *
+ *  Syscalls are the read/write family ones the kernel counts per thread
+ *  in /proc/thread-self/io (syscr + syscw: read, pread, write, sendfile,
+ *  copy_file_range ...); what taking a mark costs in them is measured
+ *  once and left out.  Cycles and cache misses come from perf counters
+ *  each thread opens for itself the first time it takes a mark and
+ *  closes when it exits.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#endif
+#include "upk.h"
+#include "stats.h"
+
+#define STATS_IMAGES  (UPK_MAX_IMAGES + 2)   /* and hw1, hw2 */
+
+static const char *const phase_names[UPK_PHASES] = {
+  "open", "read", "hash", "write", "fsync"
+};
+
+typedef struct stats_image {
+  char            name[NAMELEN + 1];
+  upk_counters_t  phase[UPK_PHASES];
+} stats_image_t;
+
+typedef struct stats_pkg {
+  char            name[NAMELEN + 1];
+  upk_counters_t  phase[UPK_PHASES];
+  stats_image_t   image[STATS_IMAGES];
+} stats_pkg_t;
+
+struct upk_stats {
+  pthread_mutex_t lock;
+  stats_pkg_t    *pkg;
+  int             npkg;
+  int             cap;
+  uint64_t        mark_syscalls;   /* what a mark and a since cost */
+  int             perf;            /* the first thread got counters */
+};
+
+/* -2: not tried yet, -1: not available */
+static __thread int perf_fd[2] = { -2, -2 };
+
+/* closes a thread's counters when it exits */
+static pthread_key_t  perf_key;
+static pthread_once_t perf_once = PTHREAD_ONCE_INIT;
+
+static void perf_close(void *fd)
+{
+  int *p = fd, i;
+
+  for(i = 0; i < 2; i++)
+    if(p[i] >= 0)
+      close(p[i]);
+}
+
+static void perf_key_create(void)
+{
+  pthread_key_create(&perf_key, perf_close);
+}
+
+static void perf_open(void)
+{
+#if defined(HAVE_LINUX_PERF_EVENT_H) && defined(SYS_perf_event_open)
+  static const uint64_t config[2] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES
+  };
+  struct perf_event_attr attr;
+  int i;
+
+  pthread_once(&perf_once, perf_key_create);
+  for(i = 0; i < 2; i++)
+    {
+      memset(&attr, 0, sizeof(attr));
+      attr.size           = sizeof(attr);
+      attr.type           = PERF_TYPE_HARDWARE;
+      attr.config         = config[i];
+      attr.exclude_kernel = 1;
+      attr.exclude_hv     = 1;
+      perf_fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+      if(perf_fd[i] < 0)
+	perf_fd[i] = -1;
+    }
+  if(perf_fd[0] >= 0 || perf_fd[1] >= 0)
+    pthread_setspecific(perf_key, perf_fd);
+#else
+  perf_fd[0] = perf_fd[1] = -1;
+#endif
+}
+
+static uint64_t perf_read(int k)
+{
+  uint64_t v;
+
+  if(perf_fd[k] < 0 || read(perf_fd[k], &v, sizeof(v)) != sizeof(v))
+    return 0;
+  return v;
+}
+
+static uint64_t io_syscalls(void)
+{
+  char buf[512], *p;
+  uint64_t n = 0;
+  ssize_t len;
+  int fd;
+
+  if((fd = open("/proc/thread-self/io", O_RDONLY | O_CLOEXEC)) < 0)
+    return 0;
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if(len <= 0)
+    return 0;
+  buf[len] = '\0';
+  if((p = strstr(buf, "syscr:")) != NULL)
+    n += strtoull(p + 6, NULL, 10);
+  if((p = strstr(buf, "syscw:")) != NULL)
+    n += strtoull(p + 6, NULL, 10);
+  return n;
+}
+
+void upk_stats_mark(const upk_stats_t *st, upk_mark_t *m)
+{
+  struct timespec ts;
+
+  if(perf_fd[0] == -2)
+    perf_open();
+  memset(m, 0, sizeof(*m));
+  m->c.syscalls     = io_syscalls();
+  m->c.cycles       = perf_read(0);
+  m->c.cache_misses = perf_read(1);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  m->c.ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void upk_stats_since(const upk_stats_t *st, const upk_mark_t *m, uint64_t bytes,
+		     upk_counters_t *d)
+{
+  upk_mark_t now;
+
+  upk_stats_mark(st, &now);
+  d->ns           = now.c.ns - m->c.ns;
+  d->bytes        = bytes;
+  d->syscalls     = now.c.syscalls - m->c.syscalls;
+  d->syscalls     = d->syscalls > st->mark_syscalls ? d->syscalls - st->mark_syscalls : 0;
+  d->cycles       = now.c.cycles - m->c.cycles;
+  d->cache_misses = now.c.cache_misses - m->c.cache_misses;
+}
+
+upk_stats_t *upk_stats_new(void)
+{
+  upk_stats_t *st;
+  upk_mark_t m;
+  upk_counters_t d;
+
+  if((st = calloc(1, sizeof(*st))) == NULL)
+    return NULL;
+  pthread_mutex_init(&st->lock, NULL);
+  upk_stats_mark(st, &m);
+  upk_stats_since(st, &m, 0, &d);
+  st->mark_syscalls = d.syscalls;
+  st->perf = (perf_fd[0] >= 0);
+  return st;
+}
+
+void upk_stats_free(upk_stats_t *st)
+{
+  if(st == NULL)
+    return;
+  pthread_mutex_destroy(&st->lock);
+  free(st->pkg);
+  free(st);
+}
+
+int upk_stats_package(upk_stats_t *st, const char *name)
+{
+  stats_pkg_t *pkg;
+  int id = -1;
+
+  pthread_mutex_lock(&st->lock);
+  if(st->npkg == st->cap)
+    {
+      pkg = realloc(st->pkg, (st->cap ? 2 * st->cap : 8) * sizeof(*pkg));
+      if(pkg == NULL)
+	goto out;
+      st->pkg = pkg;
+      st->cap = st->cap ? 2 * st->cap : 8;
+    }
+  id = st->npkg++;
+  memset(&st->pkg[id], 0, sizeof(st->pkg[id]));
+  strncpy(st->pkg[id].name, name, NAMELEN);
+out:
+  pthread_mutex_unlock(&st->lock);
+  return id;
+}
+
+void upk_stats_image(upk_stats_t *st, int pkg, int image, const char *name)
+{
+  if(pkg < 0 || image < 0 || image >= STATS_IMAGES)
+    return;
+  pthread_mutex_lock(&st->lock);
+  strncpy(st->pkg[pkg].image[image].name, name, NAMELEN);
+  pthread_mutex_unlock(&st->lock);
+}
+
+static void add(upk_counters_t *to, const upk_counters_t *d)
+{
+  to->ns           += d->ns;
+  to->bytes        += d->bytes;
+  to->syscalls     += d->syscalls;
+  to->cycles       += d->cycles;
+  to->cache_misses += d->cache_misses;
+}
+
+void upk_stats_add(upk_stats_t *st, int pkg, int image, int phase,
+		   const upk_counters_t *d)
+{
+  if(pkg < 0 || image >= STATS_IMAGES || phase < 0 || phase >= UPK_PHASES)
+    return;
+  pthread_mutex_lock(&st->lock);
+  if(image == UPK_STATS_PACKAGE)
+    add(&st->pkg[pkg].phase[phase], d);
+  else
+    add(&st->pkg[pkg].image[image].phase[phase], d);
+  pthread_mutex_unlock(&st->lock);
+}
+
+void upk_json_str(FILE *fp, const char *s)
+{
+  putc('"', fp);
+  for(; *s; s++)
+    {
+      if(*s == '"' || *s == '\\')
+	fprintf(fp, "\\%c", *s);
+      else if((unsigned char)*s < 0x20)
+	fprintf(fp, "\\u%04x", (unsigned char)*s);
+      else
+	putc(*s, fp);
+    }
+  putc('"', fp);
+}
+
+static void json_phases(FILE *fp, const upk_counters_t *phase, int perf,
+			const char *indent)
+{
+  const upk_counters_t *c;
+  int i, n = 0;
+
+  fprintf(fp, "{");
+  for(i = 0; i < UPK_PHASES; i++)
+    {
+      c = &phase[i];
+      if(c->ns == 0 && c->bytes == 0)
+	continue;
+      fprintf(fp, "%s\n%s  \"%s\": { \"wall_ns\": %llu, \"bytes\": %llu, \"syscalls\": %llu",
+	      n++ ? "," : "", indent, phase_names[i], (unsigned long long)c->ns,
+	      (unsigned long long)c->bytes, (unsigned long long)c->syscalls);
+      if(perf)
+	fprintf(fp, ", \"cycles\": %llu, \"cache_misses\": %llu",
+		(unsigned long long)c->cycles, (unsigned long long)c->cache_misses);
+      fprintf(fp, " }");
+    }
+  if(n)
+    fprintf(fp, "\n%s", indent);
+  fprintf(fp, "}");
+}
+
+int upk_stats_json(upk_stats_t *st, FILE *fp)
+{
+  upk_counters_t total[UPK_PHASES];
+  stats_pkg_t *pkg;
+  int i, k, p, n;
+
+  memset(total, 0, sizeof(total));
+  pthread_mutex_lock(&st->lock);
+  fprintf(fp, "{\n  \"perf\": %s,\n  \"packages\": [", st->perf ? "true" : "false");
+  for(p = 0; p < st->npkg; p++)
+    {
+      pkg = &st->pkg[p];
+      for(k = 0; k < UPK_PHASES; k++)
+	add(&total[k], &pkg->phase[k]);
+      fprintf(fp, "%s\n    { \"package\": ", p ? "," : "");
+      upk_json_str(fp, pkg->name);
+      fprintf(fp, ",\n      \"phases\": ");
+      json_phases(fp, pkg->phase, st->perf, "      ");
+      fprintf(fp, ",\n      \"images\": [");
+      for(i = n = 0; i < STATS_IMAGES; i++)
+	{
+	  if(pkg->image[i].name[0] == '\0')
+	    continue;
+	  fprintf(fp, "%s\n        { \"image\": ", n++ ? "," : "");
+	  upk_json_str(fp, pkg->image[i].name);
+	  if(i < UPK_MAX_IMAGES)    /* a split root.cramfs has one per part */
+	    fprintf(fp, ", \"index\": %d", i);
+	  fprintf(fp, ", \"phases\": ");
+	  json_phases(fp, pkg->image[i].phase, st->perf, "          ");
+	  fprintf(fp, " }");
+	}
+      fprintf(fp, "%s] }", n ? "\n      " : "");
+    }
+  fprintf(fp, "%s],\n  \"total\": ", st->npkg ? "\n  " : "");
+  json_phases(fp, total, st->perf, "  ");
+  fprintf(fp, "\n}\n");
+  pthread_mutex_unlock(&st->lock);
+  return ferror(fp) ? -1 : 0;
+}
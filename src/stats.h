@@ -0,0 +1,70 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** stats.h
+ *
+ * Opt-in instrumentation of package builds.  Every package gets a record
+ * of its phases, each with wall time, bytes moved, read/write family
+ * syscalls and, where perf_event_open() lets us, cycles and cache
+ * misses; every image gets the same breakdown for its share.  All
+ * counters are those of the thread doing the work.  A writer without a
+ * upk_stats_t does none of this.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+enum {
+  UPK_PHASE_OPEN,      /* opening and sizing the inputs             */
+  UPK_PHASE_READ,      /* version files and other small reads       */
+  UPK_PHASE_HASH,      /* reading and hashing payloads              */
+  UPK_PHASE_WRITE,     /* writing the package                       */
+  UPK_PHASE_FSYNC,     /* getting it to disk (--fsync)              */
+  UPK_PHASES
+};
+
+#define UPK_STATS_PACKAGE  (-1)   /* upk_stats_add() image: the package */
+
+typedef struct upk_counters {
+  uint64_t ns;
+  uint64_t bytes;
+  uint64_t syscalls;
+  uint64_t cycles;
+  uint64_t cache_misses;
+} upk_counters_t;
+
+/* where the calling thread's counters stood */
+typedef struct upk_mark {
+  upk_counters_t c;
+} upk_mark_t;
+
+typedef struct upk_stats upk_stats_t;
+
+extern upk_stats_t *upk_stats_new(void);
+extern void         upk_stats_free(upk_stats_t *st);
+
+extern void upk_stats_mark(const upk_stats_t *st, upk_mark_t *m);
+/* *d = what the calling thread did since m; bytes is what it moved */
+extern void upk_stats_since(const upk_stats_t *st, const upk_mark_t *m,
+			    uint64_t bytes, upk_counters_t *d);
+
+/* start the record of a package, returns its id (or -1) */
+extern int  upk_stats_package(upk_stats_t *st, const char *name);
+extern void upk_stats_image(upk_stats_t *st, int pkg, int image, const char *name);
+/* add d to a phase of the package, or of one of its images */
+extern void upk_stats_add(upk_stats_t *st, int pkg, int image, int phase,
+			  const upk_counters_t *d);
+
+/* everything recorded so far as one JSON document; 0 or -1 */
+extern int  upk_stats_json(upk_stats_t *st, FILE *fp);
+/* s as a quoted JSON string */
+extern void upk_json_str(FILE *fp, const char *s);
+
+#endif
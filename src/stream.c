@@ -0,0 +1,518 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** stream.c
+ *
+ *  Copies an image into the package a block at a time: read, hash and
+ *  write whole buffers instead of one fgetc()/fputc()/crc32() per byte.
+ *
+ *  When both ends are regular files the payload does not need to pass
+ *  through user space at all: the CRC is taken from a read-only mapping
+ *  of the source and the bytes are moved with a reflink (FICLONERANGE)
+ *  or copy_file_range(), falling back to write() from the mapping.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#include "stream.h"
+#include "ring.h"
+#include "cache.h"
+
+#define CRC_STEP  0x40000000  /* crc32() takes an unsigned int length */
+
+static uint32 crc_serial(uint32 crc, const uint8 *buf, size_t len)
+{
+  size_t n;
+
+  for(; len; buf += n, len -= n)
+    {
+      n = len < CRC_STEP ? len : CRC_STEP;
+      crc = crc32(crc, buf, n);
+    }
+  return crc;
+}
+
+typedef struct crc_job {
+  const uint8 *buf;
+  size_t       len;
+  uint32       crc;
+} crc_job_t;
+
+static void crc_job_run(void *arg)
+{
+  crc_job_t *job = arg;
+
+  job->crc = crc_serial(0, job->buf, job->len);
+}
+
+void stream_crc_chunks(pool_t *pool, const uint8 *buf, size_t len,
+		       size_t chunk, uint32 *out)
+{
+  pool_group_t grp = POOL_GROUP_INIT;
+  crc_job_t *jobs;
+  size_t njobs, i;
+
+  njobs = (len + chunk - 1) / chunk;
+  if(pool_threads(pool) < 2 || (jobs = calloc(njobs, sizeof(*jobs))) == NULL)
+    {
+      for(i = 0; i < njobs; i++)
+	out[i] = crc_serial(0, buf + i * chunk,
+			    (i == njobs - 1) ? len - i * chunk : chunk);
+      return;
+    }
+
+  for(i = 0; i < njobs; i++)
+    {
+      jobs[i].buf = buf + i * chunk;
+      jobs[i].len = (i == njobs - 1) ? len - i * chunk : chunk;
+      pool_submit(pool, &grp, crc_job_run, &jobs[i]);
+    }
+  pool_wait(pool, &grp);
+
+  for(i = 0; i < njobs; i++)
+    out[i] = jobs[i].crc;
+  free(jobs);
+}
+
+uint32 stream_crc(pool_t *pool, uint32 crc, const uint8 *buf, size_t len)
+{
+  uint32 *parts;
+  size_t chunk, n, i;
+
+  if(pool_threads(pool) < 2 || len < 2 * CRC_CHUNK_MIN)
+    return crc_serial(crc, buf, len);
+
+  /* a few chunks per thread evens out page faults and stragglers */
+  chunk = len / (4 * pool_threads(pool));
+  if(chunk < CRC_CHUNK_MIN)
+    chunk = CRC_CHUNK_MIN;
+  n = (len + chunk - 1) / chunk;
+  if((parts = malloc(n * sizeof(*parts))) == NULL)
+    return crc_serial(crc, buf, len);
+
+  stream_crc_chunks(pool, buf, len, chunk, parts);
+  for(i = 0; i < n; i++)
+    crc = crc32_combine(crc, parts[i], (i == n - 1) ? len - i * chunk : chunk);
+  free(parts);
+  return crc;
+}
+
+int stream_crc_fd(pool_t *pool, int fd, off_t off, size_t len, uint32 *crc)
+{
+  long pg = sysconf(_SC_PAGESIZE);
+  off_t base = off - off % pg;
+  size_t skip = off - base;
+  uint8 *map;
+
+  if(len == 0)
+    return 0;
+  map = mmap(NULL, len + skip, PROT_READ, MAP_SHARED, fd, base);
+  if(map == MAP_FAILED)
+    return -1;
+  madvise(map, len + skip, pool_threads(pool) > 1 ? MADV_WILLNEED : MADV_SEQUENTIAL);
+  *crc = stream_crc(pool, *crc, map + skip, len);
+  munmap(map, len + skip);
+  return 0;
+}
+
+int stream_anon_fd(const char *name)
+{
+  FILE *fp;
+  int fd;
+
+#ifdef HAVE_MEMFD_CREATE
+  if((fd = memfd_create(name, MFD_CLOEXEC)) >= 0)
+    return fd;
+#endif
+  if((fp = tmpfile()) == NULL)
+    return -1;
+  fd = dup(fileno(fp));
+  fclose(fp);
+  return fd;
+}
+
+/* write() all of buf, pipes may take less at a time */
+int stream_write_all(int fd, const void *buf, size_t len)
+{
+  const uint8 *p = buf;
+  ssize_t n;
+
+  while(len)
+    {
+      if((n = write(fd, p, len)) < 0 && errno == EINTR)
+	continue;
+      if(n <= 0)
+	return -1;
+      p += n;
+      len -= n;
+    }
+  return 0;
+}
+
+int stream_copy_range(int fd_r, off_t off_r, int fd_w, off_t off_w, size_t len)
+{
+  /* nothing to do, and to FICLONERANGE a length of 0 means "to EOF" */
+  if(len == 0)
+    return 0;
+
+#ifdef FICLONERANGE
+  {
+    /* whole shared extents on btrfs/xfs; needs block aligned offsets */
+    struct file_clone_range fcr;
+
+    fcr.src_fd = fd_r;
+    fcr.src_offset = off_r;
+    fcr.src_length = len;
+    fcr.dest_offset = off_w;
+    if(ioctl(fd_w, FICLONERANGE, &fcr) == 0)
+      return 0;
+  }
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+  ssize_t n = 0;
+
+  while(len)
+    {
+      n = copy_file_range(fd_r, &off_r, fd_w, &off_w, len, 0);
+      if(n < 0 && errno == EINTR)
+	continue;
+      if(n <= 0)
+	break;
+      len -= n;
+    }
+  if(len == 0)
+    return 0;
+  if(n < 0 && errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+     errno != EOPNOTSUPP && errno != EBADF)
+    return -1;
+#endif
+
+  /* portable fallback, still a single copy out of the page cache */
+  return stream_copy_user(fd_r, off_r, fd_w, off_w, len);
+}
+
+int stream_copy_user(int fd_r, off_t off_r, int fd_w, off_t off_w, size_t len)
+{
+  ssize_t n;
+  uint8 *buf;
+  size_t done;
+
+  if(posix_memalign((void **)&buf, STREAM_ALIGN, STREAM_BUFSIZE) != 0)
+    return -1;
+  for(done = 0; done < len; done += n)
+    {
+      n = len - done < STREAM_BUFSIZE ? len - done : STREAM_BUFSIZE;
+      n = pread(fd_r, buf, n, off_r + done);
+      if(n <= 0 || pwrite(fd_w, buf, n, off_w + done) != n)
+	{
+	  free(buf);
+	  return -1;
+	}
+    }
+  free(buf);
+  return 0;
+}
+
+/* a ring buffer and the piece of an extent it holds */
+typedef struct ring_slot {
+  uint8  *buf;
+  int     x;
+  size_t  at;            /* of the extent */
+  size_t  len;
+  size_t  done;          /* read, or written once writing */
+  int     writing;
+} ring_slot_t;
+
+static int slot_queue(ring_t *r, const stream_extent_t *x, ring_slot_t *s,
+		      int fd_w, int i)
+{
+  const stream_extent_t *e = &x[s->x];
+
+  return s->writing ?
+    ring_write(r, fd_w, s->buf + s->done, s->len - s->done,
+	       e->off_w + s->at + s->done, i, i) :
+    ring_read(r, e->fd, s->buf + s->done, s->len - s->done,
+	      e->off + s->at + s->done, i, i);
+}
+
+/* 0, or 1 if the extents must be copied some other way; whatever was
+   written by then is simply written again */
+static int copy_ring(const stream_extent_t *x, int n, int fd_w)
+{
+  struct iovec iov[STREAM_RING_DEPTH];
+  ring_slot_t slot[STREAM_RING_DEPTH], *s;
+  int free_[STREAM_RING_DEPTH], nfree = 0, busy = 0, k = 0, i, res, ret = 0;
+  unsigned long long tag;
+  size_t at = 0;
+  uint8 *mem;
+  ring_t *r;
+
+  if(posix_memalign((void **)&mem, STREAM_ALIGN,
+		    STREAM_RING_DEPTH * STREAM_RING_BUF) != 0)
+    return 1;
+  for(i = 0; i < STREAM_RING_DEPTH; i++)
+    {
+      iov[i].iov_base = slot[i].buf = mem + (size_t)i * STREAM_RING_BUF;
+      iov[i].iov_len  = STREAM_RING_BUF;
+      free_[nfree++]  = STREAM_RING_DEPTH - 1 - i;
+    }
+  if((r = ring_new(STREAM_RING_DEPTH, iov, STREAM_RING_DEPTH)) == NULL)
+    {
+      free(mem);
+      return 1;
+    }
+
+  for(;;)
+    {
+      /* keep every free buffer reading, across extents */
+      while(ret == 0 && nfree && k < n)
+	{
+	  if(at == x[k].len)
+	    {
+	      k++;
+	      at = 0;
+	      continue;
+	    }
+	  i = free_[--nfree];
+	  s = &slot[i];
+	  s->x       = k;
+	  s->at      = at;
+	  s->len     = x[k].len - at < STREAM_RING_BUF ? x[k].len - at : STREAM_RING_BUF;
+	  s->done    = 0;
+	  s->writing = 0;
+	  at += s->len;
+	  if(slot_queue(r, x, s, fd_w, i) != 0)
+	    ret = 1;
+	  else
+	    busy++;
+	}
+      if(busy == 0)
+	break;
+      if(ring_wait(r, &tag, &res) != 0)
+	{
+	  /* requests may still be running into the buffers: keep them */
+	  ring_free(r);
+	  return 1;
+	}
+      s = &slot[tag];
+      if(res == -EINTR || res == -EAGAIN)
+	res = 0;
+      else if(res <= 0)
+	ret = 1;         /* short file, or an op this kernel lacks */
+      s->done += res > 0 ? res : 0;
+      if(ret == 0 && s->done == s->len && !s->writing)
+	{
+	  s->writing = 1;
+	  s->done    = 0;
+	}
+      else if(ret != 0 || s->done == s->len)
+	{
+	  free_[nfree++] = tag;
+	  busy--;
+	  continue;
+	}
+      if(slot_queue(r, x, s, fd_w, tag) != 0)
+	{
+	  ret = 1;
+	  free_[nfree++] = tag;
+	  busy--;
+	}
+    }
+  ring_free(r);
+  free(mem);
+  return ret;
+}
+
+int stream_copy_extents(const stream_extent_t *x, int n, int fd_w, int flags)
+{
+  int i;
+
+  if((flags & STREAM_URING) && copy_ring(x, n, fd_w) == 0)
+    return 0;
+  for(i = 0; i < n; i++)
+    if(((flags & STREAM_ZERO_COPY) ?
+	stream_copy_range(x[i].fd, x[i].off, fd_w, x[i].off_w, x[i].len) :
+	stream_copy_user(x[i].fd, x[i].off, fd_w, x[i].off_w, x[i].len)) != 0)
+      return -1;
+  return 0;
+}
+
+int stream_copy_out(int fd_r, off_t off_r, int fd_w, size_t len, int flags)
+{
+  ssize_t n = 0;
+  uint8 *buf;
+  size_t done;
+
+  if(flags & STREAM_ZERO_COPY)
+    {
+#ifdef HAVE_SPLICE
+      /* into a pipe the pages are just referenced */
+      while(len && (n = splice(fd_r, &off_r, fd_w, NULL, len, SPLICE_F_MORE)) > 0)
+	len -= n;
+      if(len == 0)
+	return 0;
+#endif
+#ifdef HAVE_SENDFILE
+      /* anything else: sockets, files, ttys */
+      while(len && (n = sendfile(fd_w, fd_r, &off_r, len)) > 0)
+	len -= n;
+      if(len == 0)
+	return 0;
+#endif
+    }
+
+  if(posix_memalign((void **)&buf, STREAM_ALIGN, STREAM_BUFSIZE) != 0)
+    return -1;
+  for(done = 0; done < len; done += n)
+    {
+      n = len - done < STREAM_BUFSIZE ? len - done : STREAM_BUFSIZE;
+      n = pread(fd_r, buf, n, off_r + done);
+      if(n <= 0 || stream_write_all(fd_w, buf, n) != 0)
+	{
+	  free(buf);
+	  return -1;
+	}
+    }
+  free(buf);
+  return 0;
+}
+
+static int stream_copy_zero(FILE *fp_r, FILE *fp_w, uint32 limit,
+			    const stream_opts_t *opt, uint32 *crc, off_t *len)
+{
+  struct stat st_r, st_w;
+  off_t off_r, off_w;
+  size_t n;
+  int fd_r = fileno(fp_r), fd_w = fileno(fp_w);
+  uint8 eof = LEGACY_EOF_BYTE;
+
+  if(fflush(fp_w) != 0 || fstat(fd_r, &st_r) != 0 || fstat(fd_w, &st_w) != 0)
+    return 1;
+  if(!S_ISREG(st_r.st_mode) || !S_ISREG(st_w.st_mode))
+    return 1;
+  if((off_r = ftello(fp_r)) < 0 || (off_w = ftello(fp_w)) < 0)
+    return 1;
+
+  n = off_r < st_r.st_size ? st_r.st_size - off_r : 0;
+  if(limit && n > limit)
+    n = limit;
+  if(crc && opt->cache)
+    {
+      uint32 part;
+
+      if(crc_cache_range(opt->cache, opt->pool, fd_r, off_r, n, &part) != 0)
+	return 1;
+      *crc = crc32_combine(*crc, part, n);
+    }
+  else if(crc && stream_crc_fd(opt->pool, fd_r, off_r, n, crc) != 0)
+    return 1;
+  if(stream_copy_range(fd_r, off_r, fd_w, off_w, n) != 0)
+    {
+      printf("write error\n");
+      return -1;
+    }
+  *len = n;
+
+  if((opt->flags & STREAM_LEGACY_EOF) && (!limit || n < limit))
+    {
+      if(pwrite(fd_w, &eof, 1, off_w + n) != 1)
+	{
+	  printf("write error\n");
+	  return -1;
+	}
+      if(crc)
+	*crc = crc32(*crc, &eof, 1);
+      (*len)++;
+    }
+
+  /* leave both streams where the buffered path would have */
+  fseeko(fp_r, off_r + n, SEEK_SET);
+  fseeko(fp_w, off_w + *len, SEEK_SET);
+  return 0;
+}
+
+int stream_copy(FILE *fp_r, FILE *fp_w, uint32 limit,
+		const stream_opts_t *opt, uint32 *crc, off_t *len)
+{
+  uint8 *buf;
+  size_t want, got;
+  off_t total = 0;
+  int ret = 0;
+
+  if(opt->flags & STREAM_ZERO_COPY)
+    {
+      ret = stream_copy_zero(fp_r, fp_w, limit, opt, crc, len);
+      if(ret <= 0)
+	return ret;
+      ret = 0;
+    }
+
+  if(posix_memalign((void **)&buf, STREAM_ALIGN, STREAM_BUFSIZE) != 0)
+    {
+      printf("can't allocate copy buffer\n");
+      return -1;
+    }
+
+  while(1)
+    {
+      want = STREAM_BUFSIZE;
+      if(limit && limit - total < want)
+	want = limit - total;
+      if(want == 0)
+	break;
+
+      got = fread(buf, 1, want, fp_r);
+      if(got == 0)
+	{
+	  if(ferror(fp_r))
+	    {
+	      printf("read error\n");
+	      ret = -1;
+	    }
+	  else if(opt->flags & STREAM_LEGACY_EOF)
+	    {
+	      /* the old loop stored (char)EOF before it noticed feof() */
+	      buf[0] = LEGACY_EOF_BYTE;
+	      if(fwrite(buf, 1, 1, fp_w) != 1)
+		ret = -1;
+	      if(crc)
+		*crc = crc32(*crc, buf, 1);
+	      total++;
+	    }
+	  break;
+	}
+
+      if(fwrite(buf, 1, got, fp_w) != got)
+	{
+	  ret = -1;
+	  break;
+	}
+      if(crc)
+	*crc = stream_crc(opt->pool, *crc, buf, got);
+      total += got;
+    }
+
+  if(ret < 0 && !ferror(fp_r))
+    printf("write error\n");
+  free(buf);
+  *len = total;
+  return ret;
+}
@@ -0,0 +1,113 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** stream.h
+ *
+ * Block-buffered copy engine used to move image payloads into a package.
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "package.h"
+#include "pool.h"
+
+#define STREAM_BUFSIZE   0x100000  /* 1M per read/hash/write step */
+#define STREAM_ALIGN     0x1000
+
+/* stream_copy() flags */
+#define STREAM_LEGACY_EOF  0x01    /* also emit the trailing 0xff byte the old
+				      fgetc()/feof() loops wrote at EOF */
+#define STREAM_ZERO_COPY   0x02    /* let the kernel move the bytes (reflink or
+				      copy_file_range) and hash from mmap */
+#define STREAM_FSYNC       0x04    /* fsync() a package before calling it
+				      written */
+#define STREAM_URING       0x08    /* move payloads through io_uring, see
+				      stream_copy_extents() */
+
+#define LEGACY_EOF_BYTE  ((uint8)EOF)
+
+#define CRC_CHUNK_MIN    0x100000  /* smallest piece worth a pool job */
+
+struct crc_cache;
+
+typedef struct stream_opts {
+  int     flags;                   /* STREAM_* */
+  pool_t *pool;                    /* hash on this pool, NULL: serially */
+  struct crc_cache *cache;         /* reuse input CRCs, may be NULL      */
+} stream_opts_t;
+
+/*
+ * crc32() over any length.  With a pool the buffer is cut into chunks
+ * hashed concurrently and merged with crc32_combine(), giving exactly
+ * the serial result.
+ */
+extern uint32 stream_crc(pool_t *pool, uint32 crc, const uint8 *buf, size_t len);
+
+/* the CRC (from 0) of every chunk-sized piece of buf, the last may be short */
+extern void stream_crc_chunks(pool_t *pool, const uint8 *buf, size_t len,
+			      size_t chunk, uint32 *out);
+
+/* update *crc with len bytes of fd at off, read through mmap() */
+extern int stream_crc_fd(pool_t *pool, int fd, off_t off, size_t len, uint32 *crc);
+
+/*
+ * Move len bytes from fd_r@off_r to fd_w@off_w without a user-space copy
+ * (reflink, then copy_file_range(), then pread()/pwrite()).  0 or -1.
+ */
+extern int stream_copy_range(int fd_r, off_t off_r, int fd_w, off_t off_w,
+			     size_t len);
+/* the same through a user-space buffer, pread()/pwrite() */
+extern int stream_copy_user(int fd_r, off_t off_r, int fd_w, off_t off_w,
+			    size_t len);
+
+/* one payload of a package: len bytes of fd@off, to go to off_w */
+typedef struct stream_extent {
+  int     fd;
+  off_t   off;
+  off_t   off_w;
+  size_t  len;
+} stream_extent_t;
+
+/*
+ * Copy all n extents into fd_w.  With STREAM_URING the reads of every
+ * extent share one io_uring queue of STREAM_RING_DEPTH buffers, each
+ * written out as soon as it is full, so many requests are in flight
+ * whatever the storage's latency; without io_uring (or if the kernel
+ * turns a request down) they are copied one after the other as
+ * stream_copy_range() or stream_copy_user() would.  0 or -1.
+ */
+#define STREAM_RING_DEPTH  32
+#define STREAM_RING_BUF    0x40000
+extern int stream_copy_extents(const stream_extent_t *x, int n, int fd_w, int flags);
+
+/*
+ * Append len bytes of fd_r@off_r to fd_w at its current position, for
+ * outputs that can't seek (pipes, sockets, ttys): splice() or sendfile()
+ * with STREAM_ZERO_COPY, else read()/write().  0 or -1.
+ */
+extern int stream_copy_out(int fd_r, off_t off_r, int fd_w, size_t len, int flags);
+extern int stream_write_all(int fd, const void *buf, size_t len);
+/* an unnamed file in memory (memfd, else tmpfile()) for images we make */
+extern int stream_anon_fd(const char *name);
+
+/*
+ * Copy fp_r to fp_w from their current positions, stopping after limit
+ * bytes (0: copy to EOF).  If crc is not NULL it is updated with every
+ * byte written; *len receives the number of bytes written and both
+ * streams are left positioned just past the copied data.
+ * With STREAM_ZERO_COPY a regular-file source is copied in the kernel;
+ * anything else silently takes the buffered path.
+ * Returns 0, or -1 on a read or write error.
+ */
+extern int stream_copy(FILE *fp_r, FILE *fp_w, uint32 limit,
+		       const stream_opts_t *opt, uint32 *crc, off_t *len);
+
+#endif
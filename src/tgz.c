@@ -0,0 +1,512 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** tgz.c
+ *
+ *  Directories packed into .tar.gz images, see tgz.h.
+ *
+ *  The walk fills a batch of TGZ_BATCH blocks straight from the files,
+ *  the pool deflates the batch, and the results go out in order while
+ *  the next batch is read.  Only the last 32K of a batch are kept, as
+ *  the dictionary of the first block of the next.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "tgz.h"
+#include "gzip.h"
+#include "stream.h"
+
+#define TGZ_DICT    0x8000      /* deflate's window */
+#define TAR_BLOCK   512
+#define TAR_RECORD  (20 * TAR_BLOCK)
+
+typedef struct tgz_job {
+  const uint8 *in;
+  size_t       len;
+  const uint8 *dict;
+  size_t       dictlen;
+  int          level;
+  int          last;
+  uint8       *out;
+  size_t       outlen;
+  uint32       icrc;             /* of in  */
+  uint32       ocrc;             /* of out */
+  int          ret;
+} tgz_job_t;
+
+typedef struct tgz {
+  int        fd;
+  pool_t    *pool;
+  int        level;
+  uint8     *buf;                /* TGZ_DICT of history, then the batch */
+  size_t     fill;               /* bytes of the batch so far           */
+  size_t     dictlen;            /* history before it                   */
+  uint32     icrc;               /* tar stream flushed so far           */
+  off_t      ilen;
+  uint32     ocrc;               /* gzip stream written so far          */
+  off_t      olen;
+  tgz_job_t  job[TGZ_BATCH];
+  char       path[PATH_MAX];     /* what the walk is at                 */
+  size_t     root;               /* archive names start here in path    */
+} tgz_t;
+
+/* ustar header */
+typedef struct tar_header {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+} tar_header_t;
+
+static int tgz_out(tgz_t *t, const void *buf, size_t len)
+{
+  if(stream_write_all(t->fd, buf, len) != 0)
+    return(-1);
+  t->ocrc = crc32(t->ocrc, buf, len);
+  t->olen += len;
+  return 0;
+}
+
+static void tgz_job_run(void *arg)
+{
+  tgz_job_t *job = arg;
+
+  job->icrc = crc32(0, job->in, job->len);
+  job->ret  = gzip_block(job->in, job->len, job->dict, job->dictlen,
+			 job->level, job->last, &job->out, &job->outlen);
+  if(job->ret == 0)
+    job->ocrc = crc32(0, job->out, job->outlen);
+}
+
+/* deflate the batch and write it out; last ends the deflate stream */
+static int tgz_flush(tgz_t *t, int last)
+{
+  pool_group_t grp = POOL_GROUP_INIT;
+  uint8 *data = t->buf + TGZ_DICT;
+  tgz_job_t *job;
+  int k, n, ret = 0;
+
+  n = (t->fill + TGZ_BLOCK - 1) / TGZ_BLOCK;
+  if(n == 0 && !last)
+    return 0;
+  if(n == 0)
+    n = 1;                 /* an empty final block */
+  for(k = 0; k < n; k++)
+    {
+      job = &t->job[k];
+      memset(job, 0, sizeof(*job));
+      job->in      = data + (size_t)k * TGZ_BLOCK;
+      job->len     = (k == n - 1) ? t->fill - (size_t)k * TGZ_BLOCK : TGZ_BLOCK;
+      job->dict    = k ? job->in - TGZ_DICT : data - t->dictlen;
+      job->dictlen = k ? TGZ_DICT : t->dictlen;
+      job->level   = t->level;
+      job->last    = last && k == n - 1;
+      pool_submit(t->pool, &grp, tgz_job_run, job);
+    }
+  pool_wait(t->pool, &grp);
+
+  for(k = 0; k < n; k++)
+    {
+      job = &t->job[k];
+      if(ret == 0 && (job->ret != 0 || tgz_out(t, job->out, job->outlen) != 0))
+	ret = -1;
+      t->icrc = crc32_combine(t->icrc, job->icrc, job->len);
+      free(job->out);
+    }
+  t->ilen += t->fill;
+  if(!last)
+    {
+      /* a full batch: its last 32K prime the next one */
+      memcpy(t->buf, data + t->fill - TGZ_DICT, TGZ_DICT);
+      t->dictlen = TGZ_DICT;
+    }
+  t->fill = 0;
+  return ret;
+}
+
+/* where the next tar bytes go, and how many fit */
+static uint8 *tgz_room(tgz_t *t, size_t *n)
+{
+  if(t->fill == TGZ_BATCH * TGZ_BLOCK && tgz_flush(t, 0) != 0)
+    return NULL;
+  *n = TGZ_BATCH * TGZ_BLOCK - t->fill;
+  return t->buf + TGZ_DICT + t->fill;
+}
+
+static int tgz_put(tgz_t *t, const void *buf, size_t len)
+{
+  const uint8 *p = buf;
+  uint8 *dst;
+  size_t n;
+
+  while(len)
+    {
+      if((dst = tgz_room(t, &n)) == NULL)
+	return(-1);
+      if(n > len)
+	n = len;
+      memcpy(dst, p, n);
+      t->fill += n;
+      p += n;
+      len -= n;
+    }
+  return 0;
+}
+
+/* zeros up to the next multiple of align of the whole tar stream */
+static int tgz_pad(tgz_t *t, size_t align)
+{
+  static const uint8 zero[TAR_BLOCK];
+  size_t n = (t->ilen + t->fill) % align, k;
+
+  for(n = n ? align - n : 0; n > 0; n -= k)
+    {
+      k = n < sizeof(zero) ? n : sizeof(zero);
+      if(tgz_put(t, zero, k) != 0)
+	return(-1);
+    }
+  return 0;
+}
+
+/* a numeric field: octal while it fits, else GNU base-256 */
+static void tar_number(char *field, size_t size, unsigned long long v)
+{
+  char digits[24];
+  int i;
+
+  if(v < 1ULL << (3 * (size - 1)))
+    {
+      snprintf(digits, sizeof(digits), "%0*llo", (int)size - 1, v);
+      memcpy(field, digits, size);
+      return;
+    }
+  for(i = size - 1; i > 0; i--, v >>= 8)
+    field[i] = (char)(v & 0xff);
+  field[0] = (char)0x80;
+}
+
+static int tar_block(tgz_t *t, tar_header_t *h)
+{
+  const unsigned char *p = (const unsigned char *)h;
+  unsigned sum = 0;
+  size_t i;
+
+  memcpy(h->magic, "ustar", 6);
+  memcpy(h->version, "00", 2);
+  memset(h->chksum, ' ', sizeof(h->chksum));
+  for(i = 0; i < sizeof(*h); i++)
+    sum += p[i];
+  snprintf(h->chksum, sizeof(h->chksum), "%06o", sum);
+  return tgz_put(t, h, sizeof(*h));
+}
+
+/* a GNU ././@LongLink entry carrying a name too long for the header */
+static int tar_longname(tgz_t *t, char type, const char *name)
+{
+  tar_header_t h;
+  size_t len = strlen(name) + 1;
+
+  memset(&h, 0, sizeof(h));
+  strcpy(h.name, "././@LongLink");
+  tar_number(h.mode, sizeof(h.mode), 0644);
+  tar_number(h.uid, sizeof(h.uid), 0);
+  tar_number(h.gid, sizeof(h.gid), 0);
+  tar_number(h.size, sizeof(h.size), len);
+  tar_number(h.mtime, sizeof(h.mtime), 0);
+  h.typeflag = type;
+  if(tar_block(t, &h) != 0 || tgz_put(t, name, len) != 0)
+    return(-1);
+  return tgz_pad(t, TAR_BLOCK);
+}
+
+static int tar_header(tgz_t *t, const char *name, const struct stat *st,
+		      char type, off_t size, const char *link)
+{
+  tar_header_t h;
+  size_t len = strlen(name), cut;
+
+  memset(&h, 0, sizeof(h));
+  if(len <= sizeof(h.name))
+    memcpy(h.name, name, len);
+  else
+    {
+      /* ustar splits at a '/', prefix first; failing that a long name */
+      for(cut = len - 1; cut > 0; cut--)
+	if(name[cut] == '/' && cut <= sizeof(h.prefix) &&
+	   len - cut - 1 <= sizeof(h.name) && len - cut - 1 > 0)
+	  break;
+      if(cut > 0)
+	{
+	  memcpy(h.prefix, name, cut);
+	  memcpy(h.name, name + cut + 1, len - cut - 1);
+	}
+      else
+	{
+	  if(tar_longname(t, 'L', name) != 0)
+	    return(-1);
+	  memcpy(h.name, name, sizeof(h.name));
+	}
+    }
+  if(link)
+    {
+      len = strlen(link);
+      if(len > sizeof(h.linkname) && tar_longname(t, 'K', link) != 0)
+	return(-1);
+      memcpy(h.linkname, link, len < sizeof(h.linkname) ? len : sizeof(h.linkname));
+    }
+  tar_number(h.mode, sizeof(h.mode), st->st_mode & 07777);
+  tar_number(h.uid, sizeof(h.uid), st->st_uid);
+  tar_number(h.gid, sizeof(h.gid), st->st_gid);
+  tar_number(h.size, sizeof(h.size), size);
+  tar_number(h.mtime, sizeof(h.mtime), st->st_mtime < 0 ? 0 : st->st_mtime);
+  if(type == '3' || type == '4')
+    {
+      tar_number(h.devmajor, sizeof(h.devmajor), major(st->st_rdev));
+      tar_number(h.devminor, sizeof(h.devminor), minor(st->st_rdev));
+    }
+  h.typeflag = type;
+  return tar_block(t, &h);
+}
+
+/* a regular file's contents, read straight into the batch */
+static int tar_file(tgz_t *t, const struct stat *st)
+{
+  off_t left = st->st_size;
+  uint8 *dst;
+  size_t n;
+  ssize_t got;
+  int fd;
+
+  if((fd = open(t->path, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+      printf("can't open file: %s\n", t->path);
+      return(-1);
+    }
+  while(left > 0)
+    {
+      if((dst = tgz_room(t, &n)) == NULL)
+	goto bad;
+      if(n > left)
+	n = left;
+      if((got = read(fd, dst, n)) < 0 && errno == EINTR)
+	continue;
+      if(got <= 0)
+	{
+	  printf("%s: %s\n", t->path, got ? "read error" : "file shrank as we read it");
+	  goto bad;
+	}
+      t->fill += got;
+      left -= got;
+    }
+  close(fd);
+  return tgz_pad(t, TAR_BLOCK);
+bad:
+  close(fd);
+  return(-1);
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* everything below t->path, which is len bytes long */
+static int tar_dir(tgz_t *t, size_t len)
+{
+  DIR *d;
+  struct dirent *de;
+  struct stat st;
+  char **names = NULL, **more, link[PATH_MAX];
+  size_t n = 0, cap = 0, i, l;
+  ssize_t ll;
+  int ret = -1;
+
+  if((d = opendir(t->path)) == NULL)
+    {
+      printf("can't read directory: %s\n", t->path);
+      return(-1);
+    }
+  while((de = readdir(d)) != NULL)
+    {
+      if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+	continue;
+      if(n == cap)
+	{
+	  cap = cap ? 2 * cap : 64;
+	  if((more = realloc(names, cap * sizeof(*names))) == NULL)
+	    goto out;
+	  names = more;
+	}
+      if((names[n] = strdup(de->d_name)) == NULL)
+	goto out;
+      n++;
+    }
+  /* the same archive whatever order the filesystem lists them in */
+  qsort(names, n, sizeof(*names), name_cmp);
+
+  for(i = 0; i < n; i++)
+    {
+      l = strlen(names[i]);
+      if(len + 1 + l + 1 >= sizeof(t->path))
+	{
+	  printf("path too long: %s/%s\n", t->path, names[i]);
+	  goto out;
+	}
+      t->path[len] = '/';
+      memcpy(t->path + len + 1, names[i], l + 1);
+      if(lstat(t->path, &st) != 0)
+	{
+	  printf("can't stat %s\n", t->path);
+	  goto out;
+	}
+      if(S_ISDIR(st.st_mode))
+	{
+	  /* directories are named with a trailing '/' */
+	  t->path[len + 1 + l] = '/';
+	  t->path[len + 2 + l] = '\0';
+	  if(tar_header(t, t->path + t->root, &st, '5', 0, NULL) != 0)
+	    goto out;
+	  t->path[len + 1 + l] = '\0';
+	  if(tar_dir(t, len + 1 + l) != 0)
+	    goto out;
+	}
+      else if(S_ISREG(st.st_mode))
+	{
+	  if(tar_header(t, t->path + t->root, &st, '0', st.st_size, NULL) != 0 ||
+	     tar_file(t, &st) != 0)
+	    goto out;
+	}
+      else if(S_ISLNK(st.st_mode))
+	{
+	  if((ll = readlink(t->path, link, sizeof(link) - 1)) < 0)
+	    {
+	      printf("can't read link %s\n", t->path);
+	      goto out;
+	    }
+	  link[ll] = '\0';
+	  if(tar_header(t, t->path + t->root, &st, '2', 0, link) != 0)
+	    goto out;
+	}
+      else if(S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) || S_ISFIFO(st.st_mode))
+	{
+	  if(tar_header(t, t->path + t->root, &st,
+			S_ISCHR(st.st_mode) ? '3' : S_ISBLK(st.st_mode) ? '4' : '6',
+			0, NULL) != 0)
+	    goto out;
+	}
+      else
+	printf("skipping %s: not a file, directory, link or device\n", t->path);
+    }
+  ret = 0;
+
+out:
+  t->path[len] = '\0';
+  for(i = 0; i < n; i++)
+    free(names[i]);
+  free(names);
+  closedir(d);
+  return ret;
+}
+
+static void put_le32(uint8 *p, uint32 v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+int tgz_pack(const char *dir, pool_t *pool, int level, int *fd,
+	     off_t *len, uint32 *crc, off_t *tarlen)
+{
+  /* no name, no mtime, so the same tree gives the same bytes */
+  static const uint8 gz_head[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+  static const uint8 end[2 * TAR_BLOCK];
+  uint8 gz_tail[8];
+  tgz_t *t;
+  size_t l;
+  int ret = -1;
+
+#if !defined(HAVE_ZLIB_H) || !defined(HAVE_LIBZ)
+  printf("built without zlib, can't pack %s\n", dir);
+  return(-1);
+#endif
+  if((t = calloc(1, sizeof(*t))) == NULL ||
+     (t->buf = malloc(TGZ_DICT + TGZ_BATCH * TGZ_BLOCK)) == NULL)
+    {
+      printf("out of memory\n");
+      goto out;
+    }
+  t->pool  = pool;
+  t->level = level;
+  l = strlen(dir);
+  while(l > 1 && dir[l-1] == '/')
+    l--;
+  if(l + 2 >= sizeof(t->path))
+    {
+      printf("path too long: %s\n", dir);
+      goto out;
+    }
+  memcpy(t->path, dir, l);
+  t->root = l + 1;
+  if((t->fd = stream_anon_fd("upk-tgz")) < 0)
+    {
+      printf("can't make a temporary file for %s\n", dir);
+      goto out;
+    }
+
+  /* two zero blocks end the archive, then it is padded to a record */
+  if(tgz_out(t, gz_head, sizeof(gz_head)) != 0 ||
+     tar_dir(t, l) != 0 ||
+     tgz_put(t, end, sizeof(end)) != 0 ||
+     tgz_pad(t, TAR_RECORD) != 0 ||
+     tgz_flush(t, 1) != 0)
+    goto fail;
+  put_le32(gz_tail, t->icrc);
+  put_le32(gz_tail + 4, (uint32)t->ilen);
+  if(tgz_out(t, gz_tail, sizeof(gz_tail)) != 0)
+    goto fail;
+
+  *fd     = t->fd;
+  *len    = t->olen;
+  *crc    = t->ocrc;
+  *tarlen = t->ilen;
+  ret = 0;
+  goto out;
+
+fail:
+  printf("can't pack %s\n", dir);
+  close(t->fd);
+out:
+  if(t)
+    free(t->buf);
+  free(t);
+  return ret;
+}
@@ -0,0 +1,37 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** tgz.h
+ *
+ * A directory as a .tar.gz image, made in memory.  The tar stream (ustar,
+ * GNU long names, entries sorted by name) is cut into TGZ_BLOCK pieces
+ * deflated independently on the pool, each primed with the 32K before
+ * it, the way pigz does it; the pieces join into one ordinary gzip
+ * member.  The CRC of the result is put together from the pieces' as
+ * they are written, so the image never has to be read back to hash it.
+ */
+
+#ifndef TGZ_H
+#define TGZ_H
+
+#include <sys/types.h>
+#include "package.h"
+#include "pool.h"
+
+#define TGZ_BLOCK   0x20000     /* deflated as one pool job        */
+#define TGZ_BATCH   64          /* blocks in memory at a time      */
+#define TGZ_LEVEL   6           /* gzip's default                  */
+
+/*
+ * Pack dir into an anonymous in-memory file: *fd (the caller's to close)
+ * holds *len bytes with crc32 *crc, made from *tarlen bytes of tar.
+ * Returns 0, or -1 after printing why.
+ */
+extern int tgz_pack(const char *dir, pool_t *pool, int level, int *fd,
+		    off_t *len, uint32 *crc, off_t *tarlen);
+
+#endif
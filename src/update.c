@@ -0,0 +1,321 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** update.c
+ *
+ *  Replaces one image of a finished package in place.  Everything in
+ *  front of the image stays where it is, the bytes behind it (later
+ *  images, the version_info copy and the trailer) are moved by the size
+ *  difference, and the header CRCs are patched:
+ *
+ *    p_datacrc = crc(A || B || C)   A, C: data images before/after B
+ *
+ *  crc(C) is recovered from the old p_datacrc as
+ *  T ^ crc32_combine(crc(A || B), 0, |C|), so only A and the old B are
+ *  read back; C is moved but never hashed.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "upk.h"
+
+#define MOVE_BUFSIZE  STREAM_BUFSIZE
+
+/* move len bytes at from to to, the ranges may overlap */
+static int move_bytes(int fd, off_t from, off_t to, off_t len)
+{
+  uint8 *buf;
+  off_t done, n;
+  int ret = -1;
+
+  if(from == to || len == 0)
+    return 0;
+  if((buf = malloc(MOVE_BUFSIZE)) == NULL)
+    return -1;
+  /* growing: start at the end so nothing is overwritten before it moved */
+  for(done = 0; done < len; done += n)
+    {
+      off_t pos;
+
+      n = len - done < MOVE_BUFSIZE ? len - done : MOVE_BUFSIZE;
+      pos = (to > from) ? len - done - n : done;
+      if(pread(fd, buf, n, from + pos) != n ||
+	 pwrite(fd, buf, n, to + pos) != n)
+	goto out;
+    }
+  ret = 0;
+out:
+  free(buf);
+  return ret;
+}
+
+/* bytes stream_copy() will produce for an image of size bytes */
+static off_t copy_len(off_t size, uint32 limit, int flags)
+{
+  if(limit && size >= limit)
+    return limit;
+  return size + ((flags & STREAM_LEGACY_EOF) ? 1 : 0);
+}
+
+/* as the builder stores a version file holding version and a newline */
+static void set_version(uint8 *field, const char *version, int flags)
+{
+  size_t n = strlen(version);
+
+  memset(field, 0, VERLEN);
+  strncpy((char *)field, version, VERLEN-1);
+  if((flags & STREAM_LEGACY_EOF) && n + 1 < VERLEN)
+    field[n + 1] = LEGACY_EOF_BYTE;
+}
+
+int upk_update(const char *package, const char *image, const char *name,
+	       const char *version, const stream_opts_t *opt)
+{
+  upk_pkg_t pkg;
+  stream_opts_t own;
+  package_header_t *phd = &pkg.head;
+  image_info_t *iif;
+  FILE *fp_r = NULL, *fp_w = NULL;
+  struct stat st;
+  uint32 limit[UPK_MAX_REGIONS], extcrc;
+  uint32 crc_a = 0, crc_b = 0, crc_c = 0, crc_new = 0;
+  uint64 len_a = 0, len_b = 0, len_c = 0, len_new = 0;
+  off_t newlen[UPK_MAX_REGIONS], len;
+  off_t start, old_end, delta, tail, left, room;
+  int i, k, parts, data, fd, ret = -1;
+
+  if(name == NULL)
+    name = strrchr(image, '/') ? strrchr(image, '/') + 1 : image;
+  if(version && strlen(version) > VER_LIMIT_LEN)
+    {
+      printf("version can't be longer than %d\n", VER_LIMIT_LEN);
+      return -1;
+    }
+  if(upk_pkg_open(&pkg, package, 1) != 0)
+    return -1;
+  fd = pkg.fd;
+  /* changed in place, a hard link into a --memo store would change the
+     stored package (and every other link to it) as well */
+  if(fstat(fd, &st) == 0 && st.st_nlink > 1)
+    {
+      printf("%s has other hard links (a --memo store?), copy it before updating\n",
+	     package);
+      goto out;
+    }
+
+  /* the package, not the command line, says whether its images end in
+     the legacy EOF byte: a mix would make extract cut an image short */
+  own = *opt;
+  if(upk_pkg_legacy(&pkg))
+    own.flags |= STREAM_LEGACY_EOF;
+  else
+    own.flags &= ~STREAM_LEGACY_EOF;
+  opt = &own;
+
+  for(k = 0; k < phd->p_imagenum; k++)
+    if(strncmp((char *)pkg.info[k].i_name, name, NAMELEN) == 0)
+      break;
+  if(k == phd->p_imagenum)
+    {
+      printf("%s: no image named %s\n", package, name);
+      goto out;
+    }
+  iif = &pkg.info[k];
+  /* a split root.cramfs: every part up to the one that took the rest */
+  for(parts = 1; parts < UPK_MAX_REGIONS && upk_pkg_part_limit(&pkg, k + parts - 1) &&
+	k + parts < phd->p_imagenum && pkg.info[k+parts].i_type == IH_TYPE_CRAMFS; parts++)
+    ;
+  data = (iif->i_type != IH_TYPE_COMPRESS);
+
+  if((fp_r = fopen(image, "rb")) == NULL || fstat(fileno(fp_r), &st) != 0)
+    {
+      printf("can't open file: %s\n", image);
+      goto out;
+    }
+
+  /*
+   * The new image must be laid out the way the builder would lay it
+   * out: cut at the same regions, so it has to need exactly as many of
+   * them as the old one did.
+   */
+  left = st.st_size;
+  room = 0;
+  for(i = 0; i < parts; i++)
+    {
+      limit[i]  = upk_pkg_part_limit(&pkg, k + i);
+      newlen[i] = copy_len(left, limit[i], opt->flags);
+      if(i < parts - 1)
+	room += limit[i];
+      left -= (limit[i] && left > limit[i]) ? limit[i] : left;
+    }
+  if(iif->i_type == IH_TYPE_CRAMFS &&
+     ((parts > 1 && st.st_size <= room) ||
+      st.st_size - room > pkg.info[k+parts-1].i_endaddr_f + 1 - pkg.info[k+parts-1].i_startaddr_f))
+    {
+      printf("%s: %s no longer takes exactly %d flash region(s), rebuild the package\n",
+	     package, name, parts);
+      goto out;
+    }
+  if(iif->i_type == IH_TYPE_COMPRESS)
+    newlen[0] += sizeof(extcrc);
+  for(i = 0; i < parts; i++)
+    if((uint64)newlen[i] > UPK_SIZE_MAX)
+      {
+	printf("%s is too big: %llu bytes, an image takes 4G at most\n",
+	       image, (unsigned long long)newlen[i]);
+	goto out;
+      }
+
+  start   = UPK_IMG_OFF(&pkg, k);
+  old_end = start;
+  for(i = k; i < k + parts; i++)
+    old_end += pkg.info[i].i_imagesize;
+  for(i = 0; i < phd->p_imagenum; i++)
+    if(i >= k + parts && UPK_IMG_OFF(&pkg, i) < old_end)
+      {
+	printf("%s: images are not in package order, rebuild the package\n", package);
+	goto out;
+      }
+  delta = -(old_end - start);
+  for(i = 0; i < parts; i++)
+    delta += newlen[i];
+  /* i_startaddr_p, i_imagesize and p_datasize all stay below this */
+  if(pkg.size + delta - pkg.hw_len > (off_t)UPK_SIZE_MAX)
+    {
+      printf("%s: package would grow beyond 4G\n", package);
+      goto out;
+    }
+
+  /* A and the old B, read before anything moves */
+  if(data)
+    {
+      for(i = 0; i < k; i++)
+	if(pkg.info[i].i_type != IH_TYPE_COMPRESS)
+	  {
+	    if(stream_crc_fd(opt->pool, fd, UPK_IMG_OFF(&pkg, i),
+			     pkg.info[i].i_imagesize, &crc_a) != 0)
+	      goto io;
+	    len_a += pkg.info[i].i_imagesize;
+	  }
+      len_b = old_end - start;
+      if(stream_crc_fd(opt->pool, fd, start, len_b, &crc_b) != 0)
+	goto io;
+      if(len_a + len_b > phd->p_datasize)
+	goto damaged;
+      len_c = phd->p_datasize - len_a - len_b;
+      crc_c = phd->p_datacrc ^
+	crc32_combine(crc32_combine(crc_a, crc_b, len_b), 0, len_c);
+    }
+
+  /* shift the tail: later images, the version_info copy and the trailer */
+  tail = pkg.size - old_end;
+  if(move_bytes(fd, old_end, old_end + delta, tail) != 0)
+    goto io;
+  if(delta < 0 && ftruncate(fd, pkg.size + delta) != 0)
+    goto io;
+  pkg.size += delta;
+
+  /* the new image itself */
+  if((fp_w = fdopen(dup(fd), "r+b")) == NULL)
+    goto io;
+  fseeko(fp_w, start, SEEK_SET);
+  for(i = 0; i < parts; i++)
+    {
+      extcrc = 0;
+      if(stream_copy(fp_r, fp_w, limit[i], opt,
+		     data ? &crc_new : &extcrc, &len) != 0)
+	{
+	  printf("can't copy %s into package\n", image);
+	  goto out;
+	}
+      if(iif->i_type == IH_TYPE_COMPRESS)
+	{
+	  if(fwrite(&extcrc, sizeof(extcrc), 1, fp_w) != 1)
+	    goto io;
+	  len += sizeof(extcrc);
+	}
+      if(len != newlen[i])
+	{
+	  printf("%s changed while it was copied, %s is damaged\n", image, package);
+	  goto out;
+	}
+      pkg.info[k+i].i_imagesize = (uint32)len;
+      if(i > 0)
+	pkg.info[k+i].i_startaddr_p = pkg.info[k+i-1].i_startaddr_p + (uint32)newlen[i-1];
+      len_new += len;
+    }
+  if(fclose(fp_w) != 0)
+    {
+      fp_w = NULL;
+      goto io;
+    }
+  fp_w = NULL;
+
+  /* table and header */
+  for(i = k + parts; i < phd->p_imagenum; i++)
+    pkg.info[i].i_startaddr_p += delta;
+  if(data)
+    {
+      phd->p_datasize = (uint32)(len_a + len_new + len_c);
+      phd->p_datacrc = crc32_combine(crc32_combine(crc_a, crc_new, len_new),
+				     crc_c, len_c);
+    }
+  if(version)
+    {
+      for(i = k; i < k + parts; i++)
+	set_version(pkg.info[i].i_version, version, opt->flags);
+      switch(iif->i_type)
+	{
+	case IH_TYPE_KERNEL:
+	  set_version(phd->p_vkernel, version, opt->flags);
+	  set_version(pkg.ver[0].os_ver, version, opt->flags);
+	  set_version(pkg.ver[1].os_ver, version, opt->flags);
+	  break;
+	case IH_TYPE_CRAMFS:
+	  set_version(phd->p_vrootfs, version, opt->flags);
+	  set_version(pkg.ver[0].app_ver, version, opt->flags);
+	  set_version(pkg.ver[1].app_ver, version, opt->flags);
+	  break;
+	case IH_TYPE_UBOOT:
+	  set_version(phd->p_vuboot, version, opt->flags);
+	  break;
+	}
+    }
+  phd->p_headcrc = 0;
+  phd->p_headcrc = crc32(0, (uint8 *)phd, sizeof(package_header_t));
+  phd->p_headcrc = crc32(phd->p_headcrc, (uint8 *)pkg.info,
+			 phd->p_imagenum * sizeof(image_info_t));
+
+  if(pwrite(fd, phd, sizeof(*phd), pkg.hw_len) != sizeof(*phd) ||
+     pwrite(fd, pkg.info, phd->p_imagenum * sizeof(image_info_t),
+	    pkg.hw_len + sizeof(*phd)) != phd->p_imagenum * sizeof(image_info_t) ||
+     pwrite(fd, &pkg.ver[0], sizeof(version_info), UPK_VER_OFF(&pkg)) != sizeof(version_info) ||
+     pwrite(fd, &pkg.ver[1], sizeof(version_info), UPK_VER2_OFF(&pkg)) != sizeof(version_info))
+    goto io;
+
+  printf("%s: %s %llu -> %llu bytes\n", package, name,
+	 (unsigned long long)(old_end - start), (unsigned long long)len_new);
+  ret = 0;
+  goto out;
+
+damaged:
+  printf("%s: damaged package header\n", package);
+  goto out;
+io:
+  printf("can not update %s, it may be damaged\n", package);
+out:
+  if(fp_w)
+    fclose(fp_w);
+  if(fp_r)
+    fclose(fp_r);
+  upk_pkg_close(&pkg);
+  return ret;
+}
@@ -0,0 +1,271 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** upk.h
+ *
+ * libupk: builds UPK packages.  All state lives in a upk_writer_t, so any
+ * number of writers may be used one after another or from different
+ * threads at the same time; a pool_t may be shared between them.
+ *
+ *   upk_writer_t *w = upk_writer_new();
+ *   upk_writer_set_dir(w, "images");
+ *   upk_writer_set_desc(w, "Safer UPK");
+ *   upk_writer_add_image(w, "uImage");
+ *   upk_writer_add_image(w, "root.cramfs");
+ *   if(upk_writer_write(w, "dev.upk") != 0) ...
+ *   upk_writer_free(w);
+ */
+
+#ifndef UPK_H
+#define UPK_H
+
+#include "package.h"
+#include "pool.h"
+#include "cache.h"
+#include "stream.h"
+#include "stats.h"
+#include "memo.h"
+
+#define UPK_MAX_IMAGES  10            /* image_info_t slots in a package */
+
+#define UPK_MAX_REGIONS 8             /* flash regions root.cramfs may span */
+
+/* a stretch of flash, end is its last byte */
+typedef struct upk_region {
+  uint32 start;
+  uint32 end;
+} upk_region_t;
+
+#define UPK_REGION_SIZE(r)  ((r)->end + 1 - (r)->start)
+
+/* where a board keeps each image; root.cramfs is cut to fill the rootfs
+   regions in order */
+typedef struct upk_board {
+  const char   *name;                     /* "16M", "8M"                */
+  uint32        flash;                    /* p_reserve Bit[1:0]         */
+  upk_region_t  uboot;
+  upk_region_t  kernel;
+  int           nrootfs;
+  upk_region_t  rootfs[UPK_MAX_REGIONS];
+} upk_board_t;
+
+/* by name, by the p_reserve of a package, and the one FLASH_16M picks */
+extern const upk_board_t *upk_board_find(const char *name);
+extern const upk_board_t *upk_board_by_flash(uint32 reserve);
+extern const upk_board_t *upk_board_default(void);
+/* bytes of flash for root.cramfs */
+extern off_t  upk_board_rootfs_size(const upk_board_t *board);
+/* "START-END START-END ..." (or comma separated) into r[max]: ascending,
+   not overlapping.  Returns how many, or -1 after printing why */
+extern int    upk_board_parse_regions(const char *s, upk_region_t *r, int max);
+/* 0 if none of r[n] touches board's u-boot or kernel, else -1 after
+   printing which */
+extern int    upk_board_check_regions(const upk_board_t *board,
+				      const upk_region_t *r, int n);
+
+typedef struct upk_writer upk_writer_t;
+
+extern upk_writer_t *upk_writer_new(void);
+extern void          upk_writer_free(upk_writer_t *w);
+
+/* directory holding the images and *.version files (default: cwd) */
+extern int  upk_writer_set_dir(upk_writer_t *w, const char *dir);
+/* upk_desc stored in the version_info blocks, shorter than DESCLEN */
+extern int  upk_writer_set_desc(upk_writer_t *w, const char *desc);
+/* STREAM_* copy flags and an optional hashing pool (not owned) */
+extern void upk_writer_set_copy(upk_writer_t *w, int flags, pool_t *pool);
+/* look input CRCs up in (and add them to) a shared cache (not owned) */
+extern void upk_writer_set_cache(upk_writer_t *w, crc_cache_t *cache);
+/* record every package's phases in stats (not owned, NULL: don't) */
+extern void upk_writer_set_stats(upk_writer_t *w, upk_stats_t *stats);
+/* take packages from (and add them to) a store of finished ones (not
+   owned, NULL: don't); see memo.h */
+extern void upk_writer_set_memo(upk_writer_t *w, memo_t *memo);
+/* MSP430 images: makes this an "hh" package */
+extern int  upk_writer_set_hw(upk_writer_t *w, const char *hw1, const char *hw2);
+/* pad the hw section to a multiple of align bytes, at most max of them
+   (0: no limit); the default is 8K and 14 x 8K as the loader expects */
+extern int  upk_writer_set_hw_align(upk_writer_t *w, uint32 align, uint32 max);
+/* images in package order; the file name decides the image type.  A
+   directory becomes an ext image NAME.tar.gz, packed in memory on the
+   writer's pool (see tgz.h), or for root.cramfs a cramfs image of it
+   (see cramfs.h) */
+extern int  upk_writer_add_image(upk_writer_t *w, const char *name);
+/* an image of the given IH_TYPE_*, whatever its file name */
+extern int  upk_writer_add_image_type(upk_writer_t *w, const char *name, int type);
+/* use version for file ("uImage.version", ...) instead of reading it */
+extern int  upk_writer_set_version(upk_writer_t *w, const char *file,
+				   const char *version);
+/* board to build for, by name (default: upk_board_default()) */
+extern int  upk_writer_set_board(upk_writer_t *w, const char *board);
+/* put root.cramfs in these n regions instead of the board's (n 0: the
+   board's again); a split image takes as many of them as it needs */
+extern int  upk_writer_set_rootfs(upk_writer_t *w, const upk_region_t *r, int n);
+/* the package a manifest asked for */
+extern int  upk_writer_set_output(upk_writer_t *w, const char *path);
+extern const char *upk_writer_output(const upk_writer_t *w);
+
+/*
+ * Build the package at path (relative to the writer's directory; the
+ * name is also stored as p_name).  May be called again for another
+ * package with the same settings.  Returns 0, or -1 after printing why.
+ */
+extern int  upk_writer_write(upk_writer_t *w, const char *path);
+/*
+ * The same, appending the package to fd instead (a pipe or socket is
+ * fine: it is written strictly in order); name is stored as p_name.
+ */
+extern int  upk_writer_write_fd(upk_writer_t *w, const char *name, int fd);
+
+/*
+ * Variants: packages made of the same images that differ only in board,
+ * in leaving out the MSP430 images (hw 0; hw 1 needs upk_writer_set_hw())
+ * and in upk_desc (NULL: the writer's).  upk_writer_write_variants()
+ * builds all of them; every input is read and hashed once for all (with
+ * a private crc cache if the writer has none), the version files are
+ * read once and directories packed for the writer's own package are
+ * reused, so each further variant costs only its headers and the
+ * kernel's copies of the payload.  Returns the number that failed.
+ */
+extern int  upk_writer_add_variant(upk_writer_t *w, const char *board, int hw,
+				   const char *desc, const char *path);
+extern int  upk_writer_variants(const upk_writer_t *w);
+extern int  upk_writer_write_variants(upk_writer_t *w);
+
+/* 1 (default): progress and errors; 2: also dump every header built */
+extern void upk_set_log_level(int level);
+
+/* header and image table of the last package written */
+extern const package_header_t *upk_writer_header(const upk_writer_t *w);
+extern const image_info_t     *upk_writer_images(const upk_writer_t *w);
+
+/*
+ * An existing package.  The layout is
+ *
+ *   [hw section] signature_t | package_header_t image_info_t[n]
+ *   version_info | images ... | version_info hw_flag hw_len
+ *
+ * where hw_len counts everything before the package header and every
+ * i_startaddr_p is relative to the package header.
+ */
+typedef struct upk_pkg {
+  int               fd;
+  off_t             size;
+  uint8            *map;          /* whole file read-only, see upk_pkg_map() */
+  uint32            hw_flag;
+  uint32            hw_len;
+  package_header_t  head;
+  image_info_t      info[UPK_MAX_IMAGES];
+  version_info      ver[2];       /* after the image table, before the trailer */
+} upk_pkg_t;
+
+#define UPK_TRAILER_LEN   (2 * sizeof(uint32))
+#define UPK_VER_OFF(pkg)  ((off_t)(pkg)->hw_len + (pkg)->head.p_headsize)
+#define UPK_VER2_OFF(pkg) ((pkg)->size - UPK_TRAILER_LEN - (off_t)sizeof(version_info))
+#define UPK_IMG_OFF(pkg, i) ((off_t)(pkg)->hw_len + (pkg)->info[i].i_startaddr_p)
+
+/* read and sanity check the trailer, header, image table and version
+   blocks; writable opens the file for upk_update().  0 or -1 */
+extern int  upk_pkg_open(upk_pkg_t *pkg, const char *path, int writable);
+/* map the whole file read-only at pkg->map */
+extern int  upk_pkg_map(upk_pkg_t *pkg);
+/* where the builder cut the root.cramfs part that is image i: its
+   region's size, or 0 if it took the rest of the file */
+extern uint32 upk_pkg_part_limit(const upk_pkg_t *pkg, int i);
+/* whether the old builder made the package, told by the 0xff it left in
+   the header's version fields; its images end in the legacy EOF byte */
+extern int  upk_pkg_legacy(const upk_pkg_t *pkg);
+extern void upk_pkg_close(upk_pkg_t *pkg);
+
+/*
+ * Replace one image of an existing package in place: only the bytes
+ * after it move, and p_datacrc is patched with crc32_combine() from the
+ * images before it, never the ones after.  image is matched against
+ * i_name by its base name (or by name if not NULL); version, if not NULL,
+ * becomes its version string.  The legacy EOF byte follows the new
+ * image if upk_pkg_legacy() says so, whatever opt->flags hold.  Returns
+ * 0 or -1.
+ */
+extern int upk_update(const char *package, const char *image, const char *name,
+		      const char *version, const stream_opts_t *opt);
+
+/*
+ * Check the signature, p_headcrc, p_datacrc, every ext crc and that the
+ * two version_info copies agree, hashing the images concurrently on
+ * pool.  Prints each problem found; returns 0 if there were none, -1
+ * otherwise.
+ */
+extern int upk_verify(const char *package, pool_t *pool);
+
+#define UPK_EXTRACT_VERSIONS  0x100  /* also write the *.version files */
+
+/*
+ * Unpack a package into dir: every image under its base name with
+ * root.cramfs rejoined and ext crcs dropped, hw1.bin/hw2.bin for an "hh"
+ * package, and with UPK_EXTRACT_VERSIONS the *.version files.  With
+ * STREAM_LEGACY_EOF, implied for a package whose version fields show the
+ * old builder made it, the 0xff byte such packages add to each image is
+ * dropped too.  Prints the upk-builder arguments that rebuild the
+ * package; returns 0 or -1.
+ */
+extern int upk_extract(const char *package, const char *dir, int flags);
+
+/*
+ * Compare two packages: the header and version fields that differ, then
+ * each image (paired by name, split root.cramfs parts in order) as same,
+ * added, removed, of another version and/or changed, with the byte
+ * ranges that differ.  The images are compared in chunks on pool.
+ * Returns 0 if the packages are the same, 1 if not, -1 on error.
+ */
+extern int upk_diff(const char *old_package, const char *new_package, pool_t *pool);
+
+/*
+ * Configure w from upk-builder style arguments:
+ *   argv[0] flag ("hh"/"nh"), argv[1] upk_desc, argv[2] package name,
+ *   then hw1 hw2 for "hh", then the images.
+ * *package is set to argv[2].  Returns 0, or -1 after printing usage.
+ */
+extern int upk_writer_args(upk_writer_t *w, int argc, char *argv[],
+			   const char **package);
+
+/*
+ * Configure w from a build manifest of "key = value" lines (package,
+ * desc, board, rootfs, dir, hw, hw_align, image, variant, *.version;
+ * see manifest.c).
+ * *package is set to the package it names, NULL if it only lists
+ * variants.  Returns 0, or -1 after printing why.
+ */
+extern int upk_writer_load(upk_writer_t *w, const char *manifest,
+			   const char **package);
+
+/* "ALIGN[,MAX]" for upk_writer_set_hw_align() (MAX 0 if not given) */
+extern int upk_parse_hw_align(upk_writer_t *w, const char *val);
+
+/* split a manifest line in place; "..." and '...' group words, # ends it */
+extern int upk_split_line(char *p, char *argv[], int max);
+
+/*
+ * Build every package listed in a manifest, one per line, written like
+ * the upk-builder arguments:
+ *
+ *   # flag upk_desc        package   [hw1 hw2] images ...
+ *   nh     "Safer UPK"     safe.upk  uImage root.cramfs programs_0.tar.gz
+ *   hh     "Full UPK"      full.upk  hw1.bin hw2.bin u-boot.bin env.img uImage
+ *
+ * or naming a build manifest of its own (a line with a single word).
+ * Paths are relative to the manifest's directory.  Packages are built
+ * concurrently on pool, and every distinct input is hashed only once
+ * (looked up in cache first if one is given); stats, if not NULL, gets
+ * a record of each, and a package memo already holds is taken from it.
+ * A line that doesn't parse counts as a failed package; the other lines
+ * are built all the same.  Returns the number of packages that failed,
+ * or -1 if the manifest could not be read.
+ */
+extern int upk_batch(const char *manifest, int copy_flags, pool_t *pool,
+		     crc_cache_t *cache, upk_stats_t *stats, memo_t *memo);
+
+#endif
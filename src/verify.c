@@ -0,0 +1,139 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** verify.c
+ *
+ *  Checks every checksum of a finished package the way the loader on the
+ *  device would, without flashing it.  The file is mapped once and each
+ *  image is hashed as its own pool job (large ones are further cut into
+ *  chunks by stream_crc()); p_datacrc is then assembled from the per
+ *  image CRCs with crc32_combine().
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "upk.h"
+
+typedef struct verify_job {
+  pool_t      *pool;
+  const uint8 *buf;
+  size_t       len;
+  uint32       crc;
+} verify_job_t;
+
+static void verify_job_run(void *arg)
+{
+  verify_job_t *job = arg;
+
+  job->crc = stream_crc(job->pool, 0, job->buf, job->len);
+}
+
+int upk_verify(const char *package, pool_t *pool)
+{
+  upk_pkg_t pkg;
+  package_header_t *phd = &pkg.head, head;
+  image_info_t *iif;
+  const signature_t *sig;
+  verify_job_t jobs[UPK_MAX_IMAGES];
+  pool_group_t grp = POOL_GROUP_INIT;
+  uint32 crc, datacrc = 0, datasize = 0, extcrc;
+  int i, bad = 0;
+
+  if(upk_pkg_open(&pkg, package, 0) != 0)
+    return -1;
+  if(upk_pkg_map(&pkg) != 0)
+    {
+      printf("%s: can't map the package\n", package);
+      upk_pkg_close(&pkg);
+      return -1;
+    }
+  madvise(pkg.map, pkg.size, MADV_WILLNEED);
+
+  /* images first, the header checks run while they are hashed */
+  for(i = 0; i < phd->p_imagenum; i++)
+    {
+      iif = &pkg.info[i];
+      jobs[i].pool = pool;
+      jobs[i].buf  = pkg.map + UPK_IMG_OFF(&pkg, i);
+      jobs[i].len  = iif->i_imagesize;
+      if(iif->i_type == IH_TYPE_COMPRESS)
+	{
+	  if(iif->i_imagesize < sizeof(extcrc))
+	    {
+	      printf("%s: %.*s: too short for its ext crc\n", package, NAMELEN, iif->i_name);
+	      bad++;
+	      jobs[i].len = 0;
+	    }
+	  else
+	    jobs[i].len -= sizeof(extcrc);
+	}
+      pool_submit(pool, &grp, verify_job_run, &jobs[i]);
+    }
+
+  sig = (const signature_t *)(pkg.map + pkg.hw_len - sizeof(signature_t));
+  if(memcmp(sig->string, NEUROS_UPK_SIGNATURE, sizeof(NEUROS_UPK_SIGNATURE)) != 0 ||
+     crc32(0, sig->string, sizeof(sig->string)) != sig->strcrc)
+    {
+      printf("%s: bad signature\n", package);
+      bad++;
+    }
+
+  head = *phd;
+  head.p_headcrc = 0;
+  crc = crc32(0, (uint8 *)&head, sizeof(head));
+  crc = crc32(crc, (uint8 *)pkg.info, phd->p_imagenum * sizeof(image_info_t));
+  if(crc != phd->p_headcrc)
+    {
+      printf("%s: p_headcrc is %x, should be %x\n", package, phd->p_headcrc, crc);
+      bad++;
+    }
+
+  if(memcmp(&pkg.ver[0], &pkg.ver[1], sizeof(version_info)) != 0)
+    {
+      printf("%s: the two version_info copies differ\n", package);
+      bad++;
+    }
+
+  pool_wait(pool, &grp);
+
+  for(i = 0; i < phd->p_imagenum; i++)
+    {
+      iif = &pkg.info[i];
+      if(iif->i_type != IH_TYPE_COMPRESS)
+	{
+	  datacrc = crc32_combine(datacrc, jobs[i].crc, jobs[i].len);
+	  datasize += iif->i_imagesize;
+	}
+      else if(iif->i_imagesize >= sizeof(extcrc))
+	{
+	  memcpy(&extcrc, jobs[i].buf + jobs[i].len, sizeof(extcrc));
+	  if(extcrc != jobs[i].crc)
+	    {
+	      printf("%s: %.*s: ext crc is %x, should be %x\n", package,
+		     NAMELEN, iif->i_name, extcrc, jobs[i].crc);
+	      bad++;
+	    }
+	}
+    }
+  if(datasize != phd->p_datasize)
+    {
+      printf("%s: p_datasize is %x, images add up to %x\n", package,
+	     phd->p_datasize, datasize);
+      bad++;
+    }
+  else if(datacrc != phd->p_datacrc)
+    {
+      printf("%s: p_datacrc is %x, should be %x\n", package, phd->p_datacrc, datacrc);
+      bad++;
+    }
+
+  upk_pkg_close(&pkg);
+  printf("%s: %s\n", package, bad ? "BAD" : "OK");
+  return bad ? -1 : 0;
+}
@@ -0,0 +1,126 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** crc-test.c
+ *
+ *  make check: every crc kernel this machine can run against a bit at a
+ *  time reference, from every start offset within 16 bytes, for every
+ *  length up to a few blocks of the folding kernel and for lengths either
+ *  side of the 16/64 byte and fold boundaries, starting from 0 and from a
+ *  running crc.  Also crc32_combine() against the crc of the whole.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "package.h"
+
+#define POLY     0xedb88320U
+#define MAXOFF   16
+#define MAXLEN   (1 << 20)
+
+/* lengths around the kernels' strides and tails: 16-byte blocks, the
+   64-byte fold minimum and 4-lane loop, the 32-bit uInt of a call */
+static const unsigned long lengths[] = {
+  255, 256, 257, 1023, 1024, 1025, 4095, 4096, 4097,
+  65535, 65536, 65537, MAXLEN - 1, MAXLEN
+};
+
+static unsigned long crc_ref(unsigned long crc, const uint8 *buf, unsigned long len)
+{
+  uint32 c = (uint32)crc ^ 0xffffffffU;
+  int k;
+
+  while(len--)
+    {
+      c ^= *buf++;
+      for(k = 0; k < 8; k++)
+	c = (c >> 1) ^ (POLY & -(c & 1));
+    }
+  return c ^ 0xffffffffU;
+}
+
+static int failures;
+
+static void check(const char *kernel, int off, unsigned long len,
+		  unsigned long seed, unsigned long got, unsigned long want)
+{
+  if(got == want)
+    return;
+  if(failures++ < 20)
+    printf("%s: offset %d length %lu from %08lx: %08lx, want %08lx\n",
+	   kernel, off, len, seed, got, want);
+}
+
+/* one buffer, one offset, one length through every kernel */
+static void check_all(const uint8 *buf, int off, unsigned long len)
+{
+  static const unsigned long seeds[] = { 0, 0x12345678 };
+  const char *kernel;
+  unsigned long want;
+  int k, s;
+
+  for(s = 0; s < 2; s++)
+    {
+      want = crc_ref(seeds[s], buf + off, len);
+      for(k = 0; (kernel = crc32_kernel_name(k)) != NULL; k++)
+	if(crc32_set_kernel(kernel) == 0)
+	  check(kernel, off, len, seeds[s], crc32(seeds[s], buf + off, len), want);
+    }
+}
+
+int main(void)
+{
+  const char *kernel, *active = crc32_kernel_name(-1);
+  unsigned long len, a, whole;
+  uint8 *buf;
+  uint32 x = 2463534242U;
+  int k, off, l;
+
+  if((buf = malloc(MAXLEN + MAXOFF)) == NULL)
+    return 1;
+  for(len = 0; len < MAXLEN + MAXOFF; len++)
+    {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      buf[len] = (uint8)x;
+    }
+
+  for(k = 0; (kernel = crc32_kernel_name(k)) != NULL; k++)
+    printf("kernel %s%s\n", kernel,
+	   crc32_set_kernel(kernel) == 0 ? "" : ": not on this CPU, skipped");
+
+  for(off = 0; off < MAXOFF; off++)
+    {
+      for(len = 0; len <= 4 * 64 + 16; len++)
+	check_all(buf, off, len);
+      for(l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+	if(lengths[l] <= 65537 || off % 5 == 0)
+	  check_all(buf, off, lengths[l]);
+    }
+
+  /* crc(A || B) from crc(A), crc(B) and |B|, for every split of 300 */
+  whole = crc_ref(0, buf, 300);
+  for(a = 0; a <= 300; a++)
+    if(crc32_combine(crc_ref(0, buf, a), crc_ref(0, buf + a, 300 - a), 300 - a) != whole)
+      {
+	printf("crc32_combine: wrong at split %lu of 300\n", a);
+	failures++;
+      }
+
+  crc32_set_kernel(active);
+  free(buf);
+  if(failures)
+    {
+      printf("%d mismatches\n", failures);
+      return 1;
+    }
+  printf("all kernels agree with the reference\n");
+  return 0;
+}
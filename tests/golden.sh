@@ -0,0 +1,57 @@
+#!/bin/sh
+# --legacy-eof promises the old builder's packages byte for byte: build
+# nh and hh packages from fixed inputs every way the copy path can go
+# and compare them with golden.cksum, the old builder's output for the
+# same inputs.  Packages without --legacy-eof must not depend on the way
+# they were written either.
+
+builder=`pwd`/../src/upk-builder
+mkinput=`pwd`/mkinput
+golden=`cd ${srcdir:-.} && pwd`/golden.cksum
+dir=golden.dir
+
+rm -rf $dir && mkdir $dir && cd $dir || exit 99
+
+$mkinput hw1.bin 3001 1 &&
+$mkinput hw2.bin 1999 2 &&
+$mkinput u-boot.bin 65537 3 &&
+$mkinput env.img 8192 4 &&
+$mkinput uImage 300001 5 &&
+$mkinput root.cramfs 700003 6 &&
+$mkinput programs_0.tar.gz 123457 7 || exit 99
+printf '1.23-4.56-7.89\n' > u-boot.version
+printf '2.34-5.67-8.90\n' > uImage.version
+printf '3.45-6.78-9.01\n' > rootfs.version
+printf '4.56-7.89-0.12\n' > extapp.version
+printf '1.02\n' > hw1.version
+printf '3.04\n' > hw2.version
+
+build()
+{
+  $builder "$@" nh "golden nh" nh.upk uImage root.cramfs programs_0.tar.gz > /dev/null &&
+  $builder "$@" hh "golden hh" hh.upk hw1.bin hw2.bin u-boot.bin env.img uImage \
+    root.cramfs programs_0.tar.gz > /dev/null &&
+  cksum nh.upk hh.upk
+}
+
+grep -v '^#' $golden > want
+fail=0
+for opts in "" "-j 4" "--no-zero-copy" "--no-zero-copy -j 4" "--io-uring" "--io-uring -j 4"; do
+  if ! build --legacy-eof $opts > got || ! cmp -s got want; then
+    echo "FAIL: --legacy-eof $opts differs from the old builder:"
+    cat got
+    fail=1
+  fi
+  if ! build $opts > got; then
+    echo "FAIL: $opts doesn't build"
+    fail=1
+  elif [ -z "$opts" ]; then
+    mv got plain
+  elif ! cmp -s got plain; then
+    echo "FAIL: $opts gives other packages than no options"
+    fail=1
+  fi
+done
+
+cd .. && rm -rf $dir
+exit $fail
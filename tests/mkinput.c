@@ -0,0 +1,47 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *****************************************************************************/
+/** mkinput.c
+ *
+ *  mkinput FILE SIZE SEED: SIZE pseudo-random bytes (xorshift32 from
+ *  SEED) into FILE, the same on every machine, for the golden test.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char *argv[])
+{
+  unsigned long size, i;
+  unsigned int x;
+  FILE *fp;
+
+  if(argc != 4 || (x = strtoul(argv[3], NULL, 0)) == 0)
+    {
+      printf("usage: mkinput FILE SIZE SEED (SEED not 0)\n");
+      return 1;
+    }
+  size = strtoul(argv[2], NULL, 0);
+  if((fp = fopen(argv[1], "wb")) == NULL)
+    {
+      printf("can't create %s\n", argv[1]);
+      return 1;
+    }
+  for(i = 0; i < size; i++)
+    {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      putc(x & 0xff, fp);
+    }
+  if(fclose(fp) != 0)
+    {
+      printf("can not write %s\n", argv[1]);
+      return 1;
+    }
+  return 0;
+}